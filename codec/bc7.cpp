@@ -0,0 +1,930 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <smmintrin.h>
+
+#include "bc7.hpp"
+
+// pixels in subset 1 of each two-subset partition, bit i for pixel i
+static const uint16_t kPartitions2[64] = {
+    0xcccc, 0x8888, 0xeeee, 0xecc8, 0xc880, 0xfeec, 0xfec8, 0xec80,
+    0xc800, 0xffec, 0xfe80, 0xe800, 0xffe8, 0xff00, 0xfff0, 0xf000,
+    0xf710, 0x008e, 0x7100, 0x08ce, 0x008c, 0x7310, 0x3100, 0x8cce,
+    0x088c, 0x3110, 0x6666, 0x366c, 0x17e8, 0x0ff0, 0x718e, 0x399c,
+    0xaaaa, 0xf0f0, 0x5a5a, 0x33cc, 0x3c3c, 0x55aa, 0x9696, 0xa55a,
+    0x73ce, 0x13c8, 0x324c, 0x3bdc, 0x6996, 0xc33c, 0x9966, 0x0660,
+    0x0272, 0x04e4, 0x4e40, 0x2720, 0xc936, 0x936c, 0x39c6, 0x639c,
+    0x9336, 0x9cc6, 0x817e, 0xe718, 0xccf0, 0x0fcc, 0x7744, 0xee22 };
+
+// the pixel of subset 1 whose index is stored without its top bit; pixel 0 is subset 0's
+static const uint8_t kAnchors2[64] = {
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15,  2,  8,  2,  2,  8,  8, 15,  2,  8,  2,  2,  8,  8,  2,  2,
+    15, 15,  6,  8,  2,  8, 15, 15,  2,  8,  2,  2,  2, 15, 15,  6,
+     6,  2,  6,  8, 15, 15,  2,  2, 15, 15, 15, 15, 15,  2,  2, 15 };
+
+// the subset of each pixel of each three-subset partition, two bits per pixel, pixel i at bit 2i
+static const uint32_t kPartitions3[64] = {
+    0xaa685050, 0x6a5a5040, 0x5a5a4200, 0x5450a0a8, 0xa5a50000, 0xa0a05050, 0x5555a0a0, 0x5a5a5050,
+    0xaa550000, 0xaa555500, 0xaaaa5500, 0x90909090, 0x94949494, 0xa4a4a4a4, 0xa9a59450, 0x2a0a4250,
+    0xa5945040, 0x0a425054, 0xa5a5a500, 0x55a0a0a0, 0xa8a85454, 0x6a6a4040, 0xa4a45000, 0x1a1a0500,
+    0x0050a4a4, 0xaaa59090, 0x14696914, 0x69691400, 0xa08585a0, 0xaa821414, 0x50a4a450, 0x6a5a0200,
+    0xa9a58000, 0x5090a0a8, 0xa8a09050, 0x24242424, 0x00aa5500, 0x24924924, 0x24499224, 0x50a50a50,
+    0x500aa550, 0xaaaa4444, 0x66660000, 0xa5a0a5a0, 0x50a050a0, 0x69286928, 0x44aaaa44, 0x66666600,
+    0xaa444444, 0x54a854a8, 0x95809580, 0x96969600, 0xa85454a8, 0x80959580, 0xaa141414, 0x96960000,
+    0xaaaa1414, 0xa05050a0, 0xa0a5a5a0, 0x96000000, 0x40804080, 0xa9a8a9a8, 0xaaaaaa44, 0x2a4a5254 };
+
+// the pixels of subsets 1 and 2 of each three-subset partition whose indices are stored without
+// their top bit
+static const uint8_t kAnchors3[2][64] = {
+    {  3,  3, 15, 15,  8,  3, 15, 15,  8,  8,  6,  6,  6,  5,  3,  3,
+       3,  3,  8, 15,  3,  3,  6, 10,  5,  8,  8,  6,  8,  5, 15, 15,
+       8, 15,  3,  5,  6, 10,  8, 15, 15,  3, 15,  5, 15, 15, 15, 15,
+       3, 15,  5,  5,  5,  8,  5, 10,  5, 10,  8, 13, 15, 12,  3,  3 },
+    { 15,  8,  8,  3, 15, 15,  3,  8, 15, 15, 15, 15, 15, 15, 15,  8,
+      15,  8, 15,  3, 15,  8, 15,  8,  3, 15,  6, 10, 15, 15, 10,  8,
+      15,  3, 15, 10, 10,  8,  9, 10,  6, 15,  8, 15,  3,  6,  6,  8,
+      15,  3, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,  3, 15, 15,  8 } };
+
+static const int kWeights2[4] = { 0, 21, 43, 64 };
+static const int kWeights3[8] = { 0, 9, 18, 27, 37, 46, 55, 64 };
+static const int kWeights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+static const int kColourChannels = 0x7;   // channel masks, bit c for channel c of rgba
+static const int kAlphaChannel = 0x8;
+static const int kAllChannels = 0xf;
+
+// mode 1 is only tried for blocks whose mode 6 error is above this, summed over the pixels
+static const float kGoodEnoughError = 16.0f * 8.0f;
+static const int kMode1Partitions = 2;   // partitions tried in full, best estimate first
+
+static inline int interpolate(int e0, int e1, int weight)
+{
+    return ((64 - weight) * e0 + weight * e1 + 32) >> 6;
+}
+
+// 128 bits, least significant first
+class BitWriter
+{
+public:
+    // count is at most 8
+    void put(uint32_t value, int count)
+    {
+        uint64_t field = value & ((1u << count) - 1);
+        int shift = position_ & 63;
+        bits_[position_ >> 6] |= field << shift;
+        if (shift + count > 64)
+            bits_[1] |= field >> (64 - shift);
+        position_ += count;
+    }
+
+    void store(uint8_t* out) const
+    {
+        for (int i = 0; i < 16; ++i)
+            out[i] = (uint8_t)(bits_[i >> 3] >> (8 * (i & 7)));
+    }
+
+private:
+    uint64_t bits_[2]{};
+    int position_{ 0 };
+};
+
+class BitReader
+{
+public:
+    explicit BitReader(const uint8_t* block)
+    {
+        for (int i = 0; i < 16; ++i)
+            bits_[i >> 3] |= (uint64_t)block[i] << (8 * (i & 7));
+    }
+
+    // count is at most 8
+    int get(int count)
+    {
+        int shift = position_ & 63;
+        uint64_t field = bits_[position_ >> 6] >> shift;
+        if (shift + count > 64)
+            field |= bits_[1] << (64 - shift);
+        position_ += count;
+        return (int)(field & ((1u << count) - 1));
+    }
+
+private:
+    uint64_t bits_[2]{};
+    int position_{ 0 };
+};
+
+// a block's pixels, both as rows of rgba and as each channel of each group of four pixels
+struct Block
+{
+    float pixels[16][4];
+    __m128 channels[4][4];
+    bool opaque;
+};
+
+static void loadBlock(const uint8_t* rgba, size_t stride, int x, int width, int rows, Block& block)
+{
+    alignas(16) float planar[4][16];
+    block.opaque = true;
+    for (int j = 0; j < 4; ++j)
+    {
+        const uint8_t* row = rgba + std::min(j, rows - 1) * stride;
+        for (int i = 0; i < 4; ++i)
+        {
+            const uint8_t* pixel = row + std::min(x + i, width - 1) * 4;
+            for (int c = 0; c < 4; ++c)
+                planar[c][j * 4 + i] = block.pixels[j * 4 + i][c] = pixel[c];
+            block.opaque &= (pixel[3] == 255);
+        }
+    }
+    for (int c = 0; c < 4; ++c)
+        for (int g = 0; g < 4; ++g)
+            block.channels[c][g] = _mm_load_ps(planar[c] + g * 4);
+}
+
+// gives each pixel of mask the index of its nearest palette entry, comparing the channels in
+// channelMask, and returns the summed squared error
+static float assignIndices(const Block& block, uint16_t mask, int channelMask,
+                           const int palette[][4], int count, uint8_t indices[16])
+{
+    float error = 0.0f;
+    for (int g = 0; g < 4; ++g)
+    {
+        if (((mask >> (g * 4)) & 0xf) == 0)
+            continue;
+
+        __m128 best = _mm_set1_ps(INFINITY);
+        __m128i bestIndex = _mm_setzero_si128();
+        for (int k = 0; k < count; ++k)
+        {
+            __m128 distance = _mm_setzero_ps();
+            for (int c = 0; c < 4; ++c)
+            {
+                if (channelMask & (1 << c))
+                {
+                    __m128 difference = _mm_sub_ps(block.channels[c][g], _mm_set1_ps((float)palette[k][c]));
+                    distance = _mm_add_ps(distance, _mm_mul_ps(difference, difference));
+                }
+            }
+            __m128 closer = _mm_cmplt_ps(distance, best);
+            best = _mm_min_ps(distance, best);
+            bestIndex = _mm_blendv_epi8(bestIndex, _mm_set1_epi32(k), _mm_castps_si128(closer));
+        }
+
+        alignas(16) float errors[4];
+        alignas(16) int32_t chosen[4];
+        _mm_store_ps(errors, best);
+        _mm_store_si128((__m128i*)chosen, bestIndex);
+        for (int i = 0; i < 4; ++i)
+        {
+            if (mask & (1 << (g * 4 + i)))
+            {
+                indices[g * 4 + i] = (uint8_t)chosen[i];
+                error += errors[i];
+            }
+        }
+    }
+    return error;
+}
+
+static void buildPalette(const int e0[4], const int e1[4], const int* weights, int count, int palette[][4])
+{
+    for (int k = 0; k < count; ++k)
+        for (int c = 0; c < 4; ++c)
+            palette[k][c] = interpolate(e0[c], e1[c], weights[k]);
+}
+
+static inline float horizontalSum(__m128 v)
+{
+    v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+}
+
+static inline float horizontalMin(__m128 v)
+{
+    v = _mm_min_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_min_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+}
+
+static inline float horizontalMax(__m128 v)
+{
+    v = _mm_max_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_max_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+}
+
+// lanes of group g of four pixels that are in mask
+static inline __m128 groupMask(uint16_t mask, int g)
+{
+    int bits = (mask >> (g * 4)) & 0xf;
+    return _mm_castsi128_ps(_mm_cmpeq_epi32(
+        _mm_and_si128(_mm_set1_epi32(bits), _mm_setr_epi32(1, 2, 4, 8)), _mm_setr_epi32(1, 2, 4, 8)));
+}
+
+// endpoints at the extremes of the pixels of mask projected onto their principal axis, in the
+// channels of channelMask
+static void fitPrincipalAxis(const Block& block, uint16_t mask, int channelMask, float e0[4], float e1[4])
+{
+    __m128 lanes[4];
+    for (int g = 0; g < 4; ++g)
+        lanes[g] = groupMask(mask, g);
+    float n = (float)__builtin_popcount(mask);
+
+    const __m128 infinity = _mm_set1_ps(INFINITY);
+    float mean[4], low[4], high[4];
+    for (int c = 0; c < 4; ++c)
+    {
+        __m128 sum = _mm_setzero_ps();
+        __m128 lo = infinity;
+        __m128 hi = _mm_sub_ps(_mm_setzero_ps(), infinity);
+        for (int g = 0; g < 4; ++g)
+        {
+            sum = _mm_add_ps(sum, _mm_and_ps(lanes[g], block.channels[c][g]));
+            lo = _mm_min_ps(lo, _mm_blendv_ps(infinity, block.channels[c][g], lanes[g]));
+            hi = _mm_max_ps(hi, _mm_blendv_ps(_mm_sub_ps(_mm_setzero_ps(), infinity), block.channels[c][g], lanes[g]));
+        }
+        mean[c] = horizontalSum(sum) / n;
+        low[c] = horizontalMin(lo);
+        high[c] = horizontalMax(hi);
+    }
+
+    // offsets from the mean, zero outside mask or channelMask
+    __m128 d[4][4];
+    for (int c = 0; c < 4; ++c)
+        for (int g = 0; g < 4; ++g)
+            d[c][g] = (channelMask & (1 << c))
+                ? _mm_and_ps(lanes[g], _mm_sub_ps(block.channels[c][g], _mm_set1_ps(mean[c])))
+                : _mm_setzero_ps();
+
+    float covariance[4][4];
+    for (int a = 0; a < 4; ++a)
+    {
+        for (int b = a; b < 4; ++b)
+        {
+            __m128 sum = _mm_setzero_ps();
+            for (int g = 0; g < 4; ++g)
+                sum = _mm_add_ps(sum, _mm_mul_ps(d[a][g], d[b][g]));
+            covariance[a][b] = covariance[b][a] = horizontalSum(sum);
+        }
+    }
+
+    // power iteration from the diagonal of the bounding box, which is usually close already
+    float axis[4];
+    for (int c = 0; c < 4; ++c)
+        axis[c] = (channelMask & (1 << c)) ? high[c] - low[c] : 0.0f;
+    for (int iteration = 0; iteration < 4; ++iteration)
+    {
+        float next[4] = { 0, 0, 0, 0 };
+        for (int a = 0; a < 4; ++a)
+            for (int b = 0; b < 4; ++b)
+                next[a] += covariance[a][b] * axis[b];
+        float length = std::sqrt(next[0] * next[0] + next[1] * next[1] + next[2] * next[2] + next[3] * next[3]);
+        if (length < 1e-6f)
+            break;
+        for (int c = 0; c < 4; ++c)
+            axis[c] = next[c] / length;
+    }
+    float length = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2] + axis[3] * axis[3]);
+
+    float tMin = 0.0f, tMax = 0.0f;
+    if (length > 1e-6f)
+    {
+        for (int c = 0; c < 4; ++c)
+            axis[c] /= length;
+
+        __m128 lo = infinity;
+        __m128 hi = _mm_sub_ps(_mm_setzero_ps(), infinity);
+        for (int g = 0; g < 4; ++g)
+        {
+            __m128 t = _mm_setzero_ps();
+            for (int c = 0; c < 4; ++c)
+                t = _mm_add_ps(t, _mm_mul_ps(d[c][g], _mm_set1_ps(axis[c])));
+            lo = _mm_min_ps(lo, _mm_blendv_ps(infinity, t, lanes[g]));
+            hi = _mm_max_ps(hi, _mm_blendv_ps(_mm_sub_ps(_mm_setzero_ps(), infinity), t, lanes[g]));
+        }
+        tMin = horizontalMin(lo);
+        tMax = horizontalMax(hi);
+    }
+
+    for (int c = 0; c < 4; ++c)
+    {
+        if (channelMask & (1 << c))
+        {
+            e0[c] = std::min(std::max(mean[c] + tMin * axis[c], 0.0f), 255.0f);
+            e1[c] = std::min(std::max(mean[c] + tMax * axis[c], 0.0f), 255.0f);
+        }
+        else
+        {
+            e0[c] = e1[c] = mean[c];
+        }
+    }
+}
+
+// least-squares endpoints for the pixels of mask given their indices; false if they are all
+// at one end
+static bool refineEndpoints(const Block& block, uint16_t mask, int channelMask, const uint8_t indices[16],
+                            const int* weights, float e0[4], float e1[4])
+{
+    float aa = 0, ab = 0, bb = 0;
+    float ax[4] = { 0, 0, 0, 0 };
+    float bx[4] = { 0, 0, 0, 0 };
+    for (int i = 0; i < 16; ++i)
+    {
+        if (!(mask & (1 << i)))
+            continue;
+        float b = weights[indices[i]] / 64.0f;
+        float a = 1.0f - b;
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+        for (int c = 0; c < 4; ++c)
+        {
+            ax[c] += a * block.pixels[i][c];
+            bx[c] += b * block.pixels[i][c];
+        }
+    }
+
+    float determinant = aa * bb - ab * ab;
+    if (std::fabs(determinant) < 1e-6f)
+        return false;
+
+    for (int c = 0; c < 4; ++c)
+    {
+        if (channelMask & (1 << c))
+        {
+            e0[c] = std::min(std::max((bb * ax[c] - ab * bx[c]) / determinant, 0.0f), 255.0f);
+            e1[c] = std::min(std::max((aa * bx[c] - ab * ax[c]) / determinant, 0.0f), 255.0f);
+        }
+    }
+    return true;
+}
+
+// 7-bit endpoint with a p-bit of its own, for mode 6; returns the p-bit
+static int quantizeUniqueP(const float e[4], int q[4], int value[4])
+{
+    int bestP = 0;
+    float bestError = INFINITY;
+    for (int p = 0; p < 2; ++p)
+    {
+        float error = 0.0f;
+        int candidate[4];
+        for (int c = 0; c < 4; ++c)
+        {
+            candidate[c] = std::min(std::max((int)std::lround((e[c] - p) / 2.0f), 0), 127);
+            float difference = (float)(candidate[c] * 2 + p) - e[c];
+            error += difference * difference;
+        }
+        if (error < bestError)
+        {
+            bestError = error;
+            bestP = p;
+            for (int c = 0; c < 4; ++c)
+                q[c] = candidate[c];
+        }
+    }
+    for (int c = 0; c < 4; ++c)
+        value[c] = q[c] * 2 + bestP;
+    return bestP;
+}
+
+// a 6-bit colour endpoint and p-bit as the decoder expands them
+static inline int expand6p(int q, int p)
+{
+    int v = (q << 1) | p;
+    return (v << 1) | (v >> 6);
+}
+
+// 6-bit colour endpoints sharing a p-bit, for mode 1; returns the p-bit
+static int quantizeSharedP(const float e0[4], const float e1[4], int q0[3], int q1[3], int v0[4], int v1[4])
+{
+    int bestP = 0;
+    float bestError = INFINITY;
+    for (int p = 0; p < 2; ++p)
+    {
+        float error = 0.0f;
+        int candidate0[3], candidate1[3];
+        for (int e = 0; e < 2; ++e)
+        {
+            const float* target = e ? e1 : e0;
+            int* candidate = e ? candidate1 : candidate0;
+            for (int c = 0; c < 3; ++c)
+            {
+                int estimate = (int)std::lround((target[c] * 127.0f / 255.0f - p) / 2.0f);
+                float best = INFINITY;
+                for (int q = std::max(estimate - 1, 0); q <= std::min(estimate + 1, 63); ++q)
+                {
+                    float difference = (float)expand6p(q, p) - target[c];
+                    if (difference * difference < best)
+                    {
+                        best = difference * difference;
+                        candidate[c] = q;
+                    }
+                }
+                error += best;
+            }
+        }
+        if (error < bestError)
+        {
+            bestError = error;
+            bestP = p;
+            std::copy(candidate0, candidate0 + 3, q0);
+            std::copy(candidate1, candidate1 + 3, q1);
+        }
+    }
+    for (int c = 0; c < 3; ++c)
+    {
+        v0[c] = expand6p(q0[c], bestP);
+        v1[c] = expand6p(q1[c], bestP);
+    }
+    v0[3] = v1[3] = 255;
+    return bestP;
+}
+
+// a 7-bit colour endpoint as the decoder expands it, for mode 5
+static void quantize7(const float e[4], int q[4], int value[4])
+{
+    for (int c = 0; c < 3; ++c)
+    {
+        q[c] = std::min(std::max((int)std::lround(e[c] * 127.0f / 255.0f), 0), 127);
+        value[c] = (q[c] << 1) | (q[c] >> 6);
+    }
+    q[3] = value[3] = std::min(std::max((int)std::lround(e[3]), 0), 255);
+}
+
+static int refinements(Bc7Effort effort)
+{
+    return (effort == kBc7EffortFastest) ? 0 : (effort == kBc7EffortFast) ? 1 : 2;
+}
+
+// mode 6: one subset, rgba endpoints of 7 bits and a p-bit each, 4-bit indices
+static float encodeMode6(const Block& block, Bc7Effort effort, uint8_t* out)
+{
+    float e0[4], e1[4];
+    fitPrincipalAxis(block, 0xffff, kAllChannels, e0, e1);
+
+    float bestError = INFINITY;
+    int bestQ[2][4] = {}, bestP[2] = {};
+    uint8_t bestIndices[16] = {};
+    for (int iteration = 0; ; ++iteration)
+    {
+        int q[2][4], v[2][4], p[2];
+        p[0] = quantizeUniqueP(e0, q[0], v[0]);
+        p[1] = quantizeUniqueP(e1, q[1], v[1]);
+
+        int palette[16][4];
+        buildPalette(v[0], v[1], kWeights4, 16, palette);
+        uint8_t indices[16];
+        float error = assignIndices(block, 0xffff, kAllChannels, palette, 16, indices);
+        if (error < bestError)
+        {
+            bestError = error;
+            std::memcpy(bestQ, q, sizeof(q));
+            std::memcpy(bestP, p, sizeof(p));
+            std::memcpy(bestIndices, indices, sizeof(indices));
+        }
+
+        if (iteration == refinements(effort) || error == 0.0f
+            || !refineEndpoints(block, 0xffff, kAllChannels, indices, kWeights4, e0, e1))
+            break;
+    }
+
+    // the anchor's index has its top bit implied clear
+    if (bestIndices[0] >= 8)
+    {
+        for (int c = 0; c < 4; ++c)
+            std::swap(bestQ[0][c], bestQ[1][c]);
+        std::swap(bestP[0], bestP[1]);
+        for (int i = 0; i < 16; ++i)
+            bestIndices[i] = (uint8_t)(15 - bestIndices[i]);
+    }
+
+    BitWriter bits;
+    bits.put(1 << 6, 7);
+    for (int c = 0; c < 4; ++c)
+    {
+        bits.put(bestQ[0][c], 7);
+        bits.put(bestQ[1][c], 7);
+    }
+    bits.put(bestP[0], 1);
+    bits.put(bestP[1], 1);
+    for (int i = 0; i < 16; ++i)
+        bits.put(bestIndices[i], (i == 0) ? 3 : 4);
+    bits.store(out);
+    return bestError;
+}
+
+// fits, quantizes and indexes one set of endpoints, refining by least squares; used for the
+// separate colour and alpha of mode 5 and the subsets of mode 1
+template <typename Quantize>
+static float encodeEndpoints(const Block& block, uint16_t mask, int channelMask, const int* weights, int count,
+                             Bc7Effort effort, Quantize quantize, uint8_t indices[16])
+{
+    float e0[4], e1[4];
+    fitPrincipalAxis(block, mask, channelMask, e0, e1);
+
+    float bestError = INFINITY;
+    for (int iteration = 0; ; ++iteration)
+    {
+        int v[2][4];
+        quantize(e0, e1, v[0], v[1], false);
+
+        int palette[8][4];
+        buildPalette(v[0], v[1], weights, count, palette);
+        uint8_t candidate[16];
+        float error = assignIndices(block, mask, channelMask, palette, count, candidate);
+        if (error < bestError)
+        {
+            bestError = error;
+            quantize(e0, e1, v[0], v[1], true);   // keep these endpoints
+            for (int i = 0; i < 16; ++i)
+                if (mask & (1 << i))
+                    indices[i] = candidate[i];
+        }
+
+        if (iteration == refinements(effort) || error == 0.0f
+            || !refineEndpoints(block, mask, channelMask, candidate, weights, e0, e1))
+            break;
+    }
+    return bestError;
+}
+
+// mode 5: one subset, 7-bit colour and 8-bit alpha endpoints with separate 2-bit indices
+static float encodeMode5(const Block& block, Bc7Effort effort, uint8_t* out)
+{
+    int colour[2][4], alpha[2][4];
+    uint8_t colourIndices[16], alphaIndices[16];
+
+    float error = encodeEndpoints(block, 0xffff, kColourChannels, kWeights2, 4, effort,
+        [&](const float* e0, const float* e1, int* v0, int* v1, bool keep) {
+            int q0[4], q1[4];
+            quantize7(e0, q0, v0);
+            quantize7(e1, q1, v1);
+            if (keep)
+            {
+                std::copy(q0, q0 + 4, colour[0]);
+                std::copy(q1, q1 + 4, colour[1]);
+            }
+        }, colourIndices);
+    error += encodeEndpoints(block, 0xffff, kAlphaChannel, kWeights2, 4, effort,
+        [&](const float* e0, const float* e1, int* v0, int* v1, bool keep) {
+            int q0[4], q1[4];
+            quantize7(e0, q0, v0);
+            quantize7(e1, q1, v1);
+            if (keep)
+            {
+                std::copy(q0, q0 + 4, alpha[0]);
+                std::copy(q1, q1 + 4, alpha[1]);
+            }
+        }, alphaIndices);
+
+    if (colourIndices[0] >= 2)
+    {
+        std::swap(colour[0], colour[1]);
+        for (int i = 0; i < 16; ++i)
+            colourIndices[i] = (uint8_t)(3 - colourIndices[i]);
+    }
+    if (alphaIndices[0] >= 2)
+    {
+        std::swap(alpha[0], alpha[1]);
+        for (int i = 0; i < 16; ++i)
+            alphaIndices[i] = (uint8_t)(3 - alphaIndices[i]);
+    }
+
+    BitWriter bits;
+    bits.put(1 << 5, 6);
+    bits.put(0, 2);   // no rotation
+    for (int c = 0; c < 3; ++c)
+    {
+        bits.put(colour[0][c], 7);
+        bits.put(colour[1][c], 7);
+    }
+    bits.put(alpha[0][3], 8);
+    bits.put(alpha[1][3], 8);
+    for (int i = 0; i < 16; ++i)
+        bits.put(colourIndices[i], (i == 0) ? 1 : 2);
+    for (int i = 0; i < 16; ++i)
+        bits.put(alphaIndices[i], (i == 0) ? 1 : 2);
+    bits.store(out);
+    return error;
+}
+
+// the error of fitting each subset of a two-subset partition to a line through its mean: what
+// is left of its variance after the part along its principal axis
+static void rankPartitions(const Block& block, int best[kMode1Partitions])
+{
+    // sums over pixels of r, g, b and their products
+    float moments[16][9];
+    float total[9] = {};
+    for (int i = 0; i < 16; ++i)
+    {
+        const float* p = block.pixels[i];
+        float m[9] = { p[0], p[1], p[2], p[0] * p[0], p[1] * p[1], p[2] * p[2], p[0] * p[1], p[0] * p[2], p[1] * p[2] };
+        for (int k = 0; k < 9; ++k)
+        {
+            moments[i][k] = m[k];
+            total[k] += m[k];
+        }
+    }
+
+    auto residual = [](const float* s, int n) {
+        if (n <= 1)
+            return 0.0f;
+        float inverse = 1.0f / n;
+        float c[3][3];
+        c[0][0] = s[3] - s[0] * s[0] * inverse;
+        c[1][1] = s[4] - s[1] * s[1] * inverse;
+        c[2][2] = s[5] - s[2] * s[2] * inverse;
+        c[0][1] = c[1][0] = s[6] - s[0] * s[1] * inverse;
+        c[0][2] = c[2][0] = s[7] - s[0] * s[2] * inverse;
+        c[1][2] = c[2][1] = s[8] - s[1] * s[2] * inverse;
+
+        float trace = c[0][0] + c[1][1] + c[2][2];
+        float axis[3] = { 1.0f, 1.0f, 1.0f };
+        float largest = 0.0f;
+        for (int iteration = 0; iteration < 4; ++iteration)
+        {
+            float next[3];
+            for (int a = 0; a < 3; ++a)
+                next[a] = c[a][0] * axis[0] + c[a][1] * axis[1] + c[a][2] * axis[2];
+            float length = std::sqrt(next[0] * next[0] + next[1] * next[1] + next[2] * next[2]);
+            if (length < 1e-6f)
+                return 0.0f;
+            for (int a = 0; a < 3; ++a)
+                axis[a] = next[a] / length;
+            largest = length;
+        }
+        return std::max(trace - largest, 0.0f);
+    };
+
+    float bestScores[kMode1Partitions];
+    for (int k = 0; k < kMode1Partitions; ++k)
+    {
+        bestScores[k] = INFINITY;
+        best[k] = 0;
+    }
+
+    for (int partition = 0; partition < 64; ++partition)
+    {
+        float subset1[9] = {};
+        int n1 = 0;
+        for (int i = 0; i < 16; ++i)
+        {
+            if (kPartitions2[partition] & (1 << i))
+            {
+                for (int k = 0; k < 9; ++k)
+                    subset1[k] += moments[i][k];
+                ++n1;
+            }
+        }
+        float subset0[9];
+        for (int k = 0; k < 9; ++k)
+            subset0[k] = total[k] - subset1[k];
+
+        float score = residual(subset0, 16 - n1) + residual(subset1, n1);
+        for (int k = 0; k < kMode1Partitions; ++k)
+        {
+            if (score < bestScores[k])
+            {
+                for (int m = kMode1Partitions - 1; m > k; --m)
+                {
+                    bestScores[m] = bestScores[m - 1];
+                    best[m] = best[m - 1];
+                }
+                bestScores[k] = score;
+                best[k] = partition;
+                break;
+            }
+        }
+    }
+}
+
+// mode 1: two subsets, 6-bit rgb endpoints with a p-bit shared within each subset, 3-bit indices
+static float encodeMode1(const Block& block, int partition, Bc7Effort effort, uint8_t* out)
+{
+    uint16_t masks[2] = { (uint16_t)~kPartitions2[partition], kPartitions2[partition] };
+    int anchors[2] = { 0, kAnchors2[partition] };
+
+    int q[2][2][3], p[2];
+    uint8_t indices[16];
+    float error = 0.0f;
+    for (int s = 0; s < 2; ++s)
+    {
+        error += encodeEndpoints(block, masks[s], kColourChannels, kWeights3, 8, effort,
+            [&](const float* e0, const float* e1, int* v0, int* v1, bool keep) {
+                int q0[3], q1[3];
+                int shared = quantizeSharedP(e0, e1, q0, q1, v0, v1);
+                if (keep)
+                {
+                    std::copy(q0, q0 + 3, q[s][0]);
+                    std::copy(q1, q1 + 3, q[s][1]);
+                    p[s] = shared;
+                }
+            }, indices);
+
+        if (indices[anchors[s]] >= 4)
+        {
+            std::swap(q[s][0], q[s][1]);
+            for (int i = 0; i < 16; ++i)
+                if (masks[s] & (1 << i))
+                    indices[i] = (uint8_t)(7 - indices[i]);
+        }
+    }
+
+    BitWriter bits;
+    bits.put(1 << 1, 2);
+    bits.put(partition, 6);
+    for (int c = 0; c < 3; ++c)
+        for (int s = 0; s < 2; ++s)
+            for (int e = 0; e < 2; ++e)
+                bits.put(q[s][e][c], 6);
+    bits.put(p[0], 1);
+    bits.put(p[1], 1);
+    for (int i = 0; i < 16; ++i)
+        bits.put(indices[i], (i == anchors[0] || i == anchors[1]) ? 2 : 3);
+    bits.store(out);
+    return error;
+}
+
+static void encodeBlock(const Block& block, Bc7Effort effort, uint8_t* out)
+{
+    float error = encodeMode6(block, effort, out);
+    if (effort == kBc7EffortFastest || error <= kGoodEnoughError)
+        return;
+
+    uint8_t candidate[16];
+    if (!block.opaque)
+    {
+        if (encodeMode5(block, effort, candidate) < error)
+            std::memcpy(out, candidate, 16);
+        return;
+    }
+
+    if (effort < kBc7EffortNormal)
+        return;
+
+    int partitions[kMode1Partitions];
+    rankPartitions(block, partitions);
+    for (int partition : partitions)
+    {
+        float candidateError = encodeMode1(block, partition, effort, candidate);
+        if (candidateError < error)
+        {
+            error = candidateError;
+            std::memcpy(out, candidate, 16);
+        }
+    }
+}
+
+void compressBc7(const uint8_t* rgba, int width, int height, size_t stride, uint8_t* blocks, Bc7Effort effort)
+{
+    for (int y = 0; y < height; y += 4, rgba += 4 * stride)
+    {
+        int rows = std::min(4, height - y);
+        for (int x = 0; x < width; x += 4, blocks += 16)
+        {
+            Block block;
+            loadBlock(rgba, stride, x, width, rows, block);
+            encodeBlock(block, effort, blocks);
+        }
+    }
+}
+
+// layout of each mode
+struct ModeInfo
+{
+    int subsets;
+    int partitionBits;
+    int rotationBits;
+    int indexSelectionBits;
+    int colourBits;
+    int alphaBits;
+    int endpointPBits;    // one per endpoint
+    int sharedPBits;      // one per subset
+    int indexBits;
+    int secondaryIndexBits;
+};
+
+static const ModeInfo kModes[8] = {
+    { 3, 4, 0, 0, 4, 0, 1, 0, 3, 0 },
+    { 2, 6, 0, 0, 6, 0, 0, 1, 3, 0 },
+    { 3, 6, 0, 0, 5, 0, 0, 0, 2, 0 },
+    { 2, 6, 0, 0, 7, 0, 1, 0, 2, 0 },
+    { 1, 0, 2, 1, 5, 6, 0, 0, 2, 3 },
+    { 1, 0, 2, 0, 7, 8, 0, 0, 2, 2 },
+    { 1, 0, 0, 0, 7, 7, 1, 0, 4, 0 },
+    { 2, 6, 0, 0, 5, 5, 1, 0, 2, 0 } };
+
+static const int* weightsFor(int bits)
+{
+    return (bits == 2) ? kWeights2 : (bits == 3) ? kWeights3 : kWeights4;
+}
+
+void decompressBc7Block(const uint8_t* block, uint8_t* rgba)
+{
+    int mode = 0;
+    while (mode < 8 && !(block[0] & (1 << mode)))
+        ++mode;
+    if (mode == 8)
+    {
+        // reserved; decoders give transparent black
+        std::memset(rgba, 0, 64);
+        return;
+    }
+
+    const ModeInfo& info = kModes[mode];
+    BitReader bits(block);
+    bits.get(mode + 1);
+    int partition = bits.get(info.partitionBits);
+    int rotation = bits.get(info.rotationBits);
+    int indexSelection = bits.get(info.indexSelectionBits);
+
+    int endpoints[6][4];   // [subset * 2 + end][channel]
+    int endpointCount = info.subsets * 2;
+    for (int c = 0; c < 3; ++c)
+        for (int e = 0; e < endpointCount; ++e)
+            endpoints[e][c] = bits.get(info.colourBits);
+    for (int e = 0; e < endpointCount; ++e)
+        endpoints[e][3] = info.alphaBits ? bits.get(info.alphaBits) : 255;
+
+    int colourBits = info.colourBits;
+    int alphaBits = info.alphaBits;
+    if (info.endpointPBits || info.sharedPBits)
+    {
+        int pBits[6];
+        if (info.endpointPBits)
+            for (int e = 0; e < endpointCount; ++e)
+                pBits[e] = bits.get(1);
+        else
+            for (int s = 0; s < info.subsets; ++s)
+                pBits[s * 2] = pBits[s * 2 + 1] = bits.get(1);
+
+        for (int e = 0; e < endpointCount; ++e)
+        {
+            for (int c = 0; c < 3; ++c)
+                endpoints[e][c] = (endpoints[e][c] << 1) | pBits[e];
+            if (alphaBits)
+                endpoints[e][3] = (endpoints[e][3] << 1) | pBits[e];
+        }
+        ++colourBits;
+        if (alphaBits)
+            ++alphaBits;
+    }
+
+    for (int e = 0; e < endpointCount; ++e)
+    {
+        for (int c = 0; c < 3; ++c)
+            endpoints[e][c] = (endpoints[e][c] << (8 - colourBits)) | (endpoints[e][c] >> (2 * colourBits - 8));
+        if (alphaBits)
+            endpoints[e][3] = (endpoints[e][3] << (8 - alphaBits)) | (endpoints[e][3] >> (2 * alphaBits - 8));
+    }
+
+    // the subset of each pixel, two bits per pixel, and the anchors of subsets 1 and 2; unused
+    // anchors are pixel 0, subset 0's
+    uint32_t subsets = 0;
+    int anchor1 = 0, anchor2 = 0;
+    if (info.subsets == 2)
+    {
+        for (int i = 0; i < 16; ++i)
+            subsets |= (uint32_t)((kPartitions2[partition] >> i) & 1) << (i * 2);
+        anchor1 = kAnchors2[partition];
+    }
+    else if (info.subsets == 3)
+    {
+        subsets = kPartitions3[partition];
+        anchor1 = kAnchors3[0][partition];
+        anchor2 = kAnchors3[1][partition];
+    }
+
+    int indices[16], secondary[16];
+    for (int i = 0; i < 16; ++i)
+        indices[i] = bits.get((i == 0 || i == anchor1 || i == anchor2) ? info.indexBits - 1 : info.indexBits);
+    for (int i = 0; i < 16 && info.secondaryIndexBits; ++i)
+        secondary[i] = bits.get((i == 0) ? info.secondaryIndexBits - 1 : info.secondaryIndexBits);
+
+    for (int i = 0; i < 16; ++i)
+    {
+        int s = (subsets >> (i * 2)) & 3;
+        const int* e0 = endpoints[s * 2];
+        const int* e1 = endpoints[s * 2 + 1];
+
+        int colourIndex = indices[i], colourIndexBits = info.indexBits;
+        int alphaIndex = indices[i], alphaIndexBits = info.indexBits;
+        if (info.secondaryIndexBits)
+        {
+            if (indexSelection)
+                colourIndex = secondary[i], colourIndexBits = info.secondaryIndexBits;
+            else
+                alphaIndex = secondary[i], alphaIndexBits = info.secondaryIndexBits;
+        }
+
+        uint8_t* pixel = rgba + i * 4;
+        for (int c = 0; c < 3; ++c)
+            pixel[c] = (uint8_t)interpolate(e0[c], e1[c], weightsFor(colourIndexBits)[colourIndex]);
+        pixel[3] = (uint8_t)interpolate(e0[3], e1[3], weightsFor(alphaIndexBits)[alphaIndex]);
+
+        if (rotation)
+            std::swap(pixel[3], pixel[rotation - 1]);
+    }
+}
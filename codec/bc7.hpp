@@ -0,0 +1,24 @@
+#pragma once
+
+// BC7 (BPTC) compression for Hap 7, and decompression of single blocks
+
+#include <cstddef>
+#include <cstdint>
+
+// How hard the encoder looks for a good encoding of each block
+enum Bc7Effort {
+    kBc7EffortFastest = 0,   // mode 6 from each block's principal axis
+    kBc7EffortFast = 1,      // mode 6 refined by least squares; mode 5 for blocks with alpha
+    kBc7EffortNormal = 2     // as fast, and mode 1 over the most promising two-subset partitions
+};
+
+// Compress the height rows of 8-bit rgba at rgba, which are stride bytes apart, to consecutive
+// 16-byte blocks at blocks. Blocks that overhang the image repeat its last row and column.
+//
+// Endpoints come from the principal axis of each block, or of each subset, and every pixel is
+// given its nearest palette entry, four pixels at a time with SSE.
+void compressBc7(const uint8_t* rgba, int width, int height, size_t stride, uint8_t* blocks, Bc7Effort effort);
+
+// Decode a block to 16 rgba pixels in row order. Blocks of the reserved mode 8 give transparent
+// black, as from other decoders.
+void decompressBc7Block(const uint8_t* block, uint8_t* rgba);
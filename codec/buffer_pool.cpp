@@ -0,0 +1,116 @@
+#include <algorithm>
+#include <new>
+
+#include "buffer_pool.hpp"
+
+BufferPool::Buffer::Buffer(Buffer&& other) noexcept
+    : pool_(other.pool_), data_(other.data_), size_(other.size_), capacity_(other.capacity_)
+{
+    other.pool_ = nullptr;
+    other.data_ = nullptr;
+    other.size_ = other.capacity_ = 0;
+}
+
+BufferPool::Buffer& BufferPool::Buffer::operator=(Buffer&& other) noexcept
+{
+    if (this != &other)
+    {
+        reset();
+        std::swap(pool_, other.pool_);
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        std::swap(capacity_, other.capacity_);
+    }
+    return *this;
+}
+
+void BufferPool::Buffer::reset()
+{
+    if (data_)
+        pool_->release(data_, capacity_);
+    pool_ = nullptr;
+    data_ = nullptr;
+    size_ = capacity_ = 0;
+}
+
+BufferPool::~BufferPool()
+{
+    for (const auto& entry : free_)
+        ::operator delete(entry.second.data, std::align_val_t(kAlignment));
+}
+
+BufferPool::Buffer BufferPool::acquire(size_t size)
+{
+    std::vector<uint8_t*> expired;
+    uint8_t* reused = nullptr;
+    size_t capacity = 0;
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        expire(std::chrono::steady_clock::now(), expired);
+
+        auto found = free_.lower_bound(size);
+        if (found != free_.end() && found->first <= std::max<size_t>(size, 1) * kMaxSlack)
+        {
+            capacity = found->first;
+            reused = found->second.data;
+            free_.erase(found);
+
+            ++stats_.hits;
+            stats_.inUseBytes += capacity;
+        }
+    }
+    freeAll(expired);
+    if (reused)
+        return Buffer(this, reused, size, capacity);
+
+    // allocate outside the lock; other jobs may be acquiring meanwhile
+    uint8_t* data = static_cast<uint8_t*>(::operator new(std::max<size_t>(size, 1), std::align_val_t(kAlignment)));
+
+    std::lock_guard<std::mutex> guard(mutex_);
+    ++stats_.misses;
+    stats_.inUseBytes += size;
+    residentBytes_ += size;
+    stats_.peakResidentBytes = std::max(stats_.peakResidentBytes, residentBytes_);
+    return Buffer(this, data, size, size);
+}
+
+void BufferPool::release(uint8_t* data, size_t capacity)
+{
+    std::vector<uint8_t*> expired;
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        auto now = std::chrono::steady_clock::now();
+        expire(now, expired);
+        free_.emplace(capacity, FreeBuffer{ data, now });
+        stats_.inUseBytes -= capacity;
+    }
+    freeAll(expired);
+}
+
+void BufferPool::expire(std::chrono::steady_clock::time_point now, std::vector<uint8_t*>& expired)
+{
+    for (auto entry = free_.begin(); entry != free_.end();)
+    {
+        if (now - entry->second.released > maxIdle_)
+        {
+            expired.push_back(entry->second.data);
+            residentBytes_ -= entry->first;
+            ++stats_.expired;
+            entry = free_.erase(entry);
+        }
+        else
+            ++entry;
+    }
+}
+
+void BufferPool::freeAll(const std::vector<uint8_t*>& buffers)
+{
+    for (uint8_t* data : buffers)
+        ::operator delete(data, std::align_val_t(kAlignment));
+}
+
+BufferPoolStats BufferPool::stats() const
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    return stats_;
+}
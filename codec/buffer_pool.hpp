@@ -0,0 +1,89 @@
+#pragma once
+
+// recycles the large per-frame buffers of encoder jobs, so that jobs created and destroyed by the
+// host, or encoding one frame after another, don't allocate and fault in fresh memory each time
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+struct BufferPoolStats
+{
+    uint64_t hits{ 0 };               // acquires satisfied by a returned buffer
+    uint64_t misses{ 0 };             // acquires that allocated
+    size_t inUseBytes{ 0 };           // held by buffers not yet returned
+    size_t peakResidentBytes{ 0 };    // most ever allocated, in use or waiting to be reused
+    uint64_t expired{ 0 };            // returned buffers freed after lying idle past the limit
+};
+
+class BufferPool
+{
+public:
+    static const size_t kAlignment = 64;   // cache line; also suits any SSE or AVX access
+    static const size_t kMaxSlack = 2;     // most a reused buffer's capacity may be, times the request
+
+    // storage from acquire, given back to the pool when destroyed or reset
+    class Buffer
+    {
+    public:
+        Buffer() : pool_(nullptr), data_(nullptr), size_(0), capacity_(0) {}
+        Buffer(Buffer&& other) noexcept;
+        Buffer& operator=(Buffer&& other) noexcept;
+        ~Buffer() { reset(); }
+
+        Buffer(const Buffer&) = delete;
+        Buffer& operator=(const Buffer&) = delete;
+
+        uint8_t* data() const { return data_; }
+        size_t size() const { return size_; }
+        explicit operator bool() const { return data_ != nullptr; }
+
+        void reset();
+
+    private:
+        friend class BufferPool;
+        Buffer(BufferPool* pool, uint8_t* data, size_t size, size_t capacity)
+            : pool_(pool), data_(data), size_(size), capacity_(capacity)
+        {}
+
+        BufferPool* pool_;
+        uint8_t* data_;
+        size_t size_;
+        size_t capacity_;
+    };
+
+    // returned buffers not reused within maxIdle are freed
+    explicit BufferPool(std::chrono::steady_clock::duration maxIdle = std::chrono::seconds(10)) : maxIdle_(maxIdle) {}
+    ~BufferPool();   // every Buffer must have been returned
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // at least size bytes aligned to kAlignment, with undefined contents; the smallest returned
+    // buffer that is large enough is reused, unless it is over kMaxSlack times size, so that a
+    // small request doesn't hold a full frame. May be called from several threads at once.
+    Buffer acquire(size_t size);
+
+    BufferPoolStats stats() const;
+
+private:
+    struct FreeBuffer
+    {
+        uint8_t* data;
+        std::chrono::steady_clock::time_point released;
+    };
+
+    void release(uint8_t* data, size_t capacity);
+    // takes the buffers idle past maxIdle_ out of free_, into expired, to be freed outside the lock
+    void expire(std::chrono::steady_clock::time_point now, std::vector<uint8_t*>& expired);
+    static void freeAll(const std::vector<uint8_t*>& buffers);
+
+    const std::chrono::steady_clock::duration maxIdle_;
+    mutable std::mutex mutex_;
+    std::multimap<size_t, FreeBuffer> free_;   // by capacity
+    BufferPoolStats stats_;
+    size_t residentBytes_{ 0 };
+};
@@ -0,0 +1,257 @@
+#include <algorithm>
+#include <cfloat>
+#include <smmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "cluster_fit.hpp"
+#include "cluster_fit_search.hpp"
+#include "squish.h"
+#include "alpha.h"
+#include "colourblock.h"
+#include "colourset.h"
+#include "maths.h"
+
+static const int kGroupBlocks = 16;   // blocks sorted by colour count to fill the lanes
+
+// squish::ComputeWeightedCovariance with every weight one, which it gives the same to the bit,
+// multiplying by one being exact
+static squish::Sym3x3 computeCovariance(int count, const squish::Vec3* points)
+{
+    squish::Vec3 centroid(0.0f);
+    for (int i = 0; i < count; ++i)
+        centroid += points[i];
+    centroid /= float(count);
+
+    squish::Sym3x3 covariance(0.0f);
+    for (int i = 0; i < count; ++i)
+    {
+        squish::Vec3 a = points[i] - centroid;
+        covariance[0] += a.X() * a.X();
+        covariance[1] += a.X() * a.Y();
+        covariance[2] += a.X() * a.Z();
+        covariance[3] += a.Y() * a.Y();
+        covariance[4] += a.Y() * a.Z();
+        covariance[5] += a.Z() * a.Z();
+    }
+    return covariance;
+}
+
+// true if every colour of the set has a weight of one. Squish weights a colour by the square
+// root of the count of pixels with it, times their alpha with kWeightColourByAlpha, so this
+// holds for blocks whose colours are all distinct and, if weighted, opaque: most blocks of
+// photographic footage
+static bool unitWeights(const squish::ColourSet& colours)
+{
+    const float* weights = colours.GetWeights();
+    for (int i = 0; i < colours.GetCount(); ++i)
+        if (weights[i] != 1.0f)
+            return false;
+    return true;
+}
+
+// kWeighted false for a set with unitWeights, leaving out the multiplies by its weights
+template <bool kWeighted>
+static void orderColours(const squish::ColourSet& colours, OrderedColours& ordered)
+{
+    int count = colours.GetCount();
+    const squish::Vec3* values = colours.GetPoints();
+    const float* weights = colours.GetWeights();
+
+    squish::Sym3x3 covariance = kWeighted ? squish::ComputeWeightedCovariance(count, values, weights) : computeCovariance(count, values);
+    squish::Vec3 axis = squish::ComputePrincipleComponent(covariance);
+
+    // stable sort on the dot products
+    float dps[16];
+    for (int i = 0; i < count; ++i)
+    {
+        dps[i] = Dot(values[i], axis);
+        ordered.order[i] = (uint8_t)i;
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        for (int j = i; j > 0 && dps[j] < dps[j - 1]; --j)
+        {
+            std::swap(dps[j], dps[j - 1]);
+            std::swap(ordered.order[j], ordered.order[j - 1]);
+        }
+    }
+
+    ordered.count = count;
+    std::fill(ordered.sum, ordered.sum + 4, 0.0f);
+    for (int i = 0; i < count; ++i)
+    {
+        int j = ordered.order[i];
+        float point[4] = { values[j].X(), values[j].Y(), values[j].Z(), 1.0f };
+        for (int c = 0; c < 4; ++c)
+        {
+            ordered.points[i][c] = kWeighted ? point[c] * weights[j] : point[c];
+            ordered.sum[c] += ordered.points[i][c];
+        }
+    }
+}
+
+struct Sse41
+{
+    typedef __m128 F;
+    typedef __m128i I;
+    static const int kLanes = 4;
+
+    static F set(float f) { return _mm_set1_ps(f); }
+    static I set(int i) { return _mm_set1_epi32(i); }
+    static F load(const float* p) { return _mm_load_ps(p); }
+    static I load(const int32_t* p) { return _mm_load_si128((const __m128i*)p); }
+    static void store(float* p, F v) { _mm_store_ps(p, v); }
+    static void store(int32_t* p, I v) { _mm_store_si128((__m128i*)p, v); }
+
+    static F add(F a, F b) { return _mm_add_ps(a, b); }
+    static F sub(F a, F b) { return _mm_sub_ps(a, b); }
+    static F mul(F a, F b) { return _mm_mul_ps(a, b); }
+    static F div(F a, F b) { return _mm_div_ps(a, b); }
+    static F min(F a, F b) { return _mm_min_ps(a, b); }
+    static F max(F a, F b) { return _mm_max_ps(a, b); }
+    static F rcp(F a) { return _mm_rcp_ps(a); }
+    static F truncate(F a) { return _mm_cvtepi32_ps(_mm_cvttps_epi32(a)); }
+
+    static F less(F a, F b) { return _mm_cmplt_ps(a, b); }
+    static F and_(F a, F b) { return _mm_and_ps(a, b); }
+    static bool any(F mask) { return _mm_movemask_ps(mask) != 0; }
+    static F select(F a, F b, F mask) { return _mm_blendv_ps(a, b, mask); }
+    static I select(I a, I b, F mask) { return _mm_blendv_epi8(a, b, _mm_castps_si128(mask)); }
+
+    static I greater(I a, I b) { return _mm_cmpgt_epi32(a, b); }
+    static I andNot(I a, I b) { return _mm_andnot_si128(a, b); }
+    static F asFloat(I a) { return _mm_castsi128_ps(a); }
+};
+
+// the split search over four blocks at once with SSE4.1, or eight with AVX2
+struct SearchSse41
+{
+    static const int kLanes = 4;
+    static void search(const OrderedColours* const ordered[4], ClusterFitResult<4>& result) { searchSplits<Sse41>(ordered, result); }
+};
+
+struct SearchAvx2
+{
+    static const int kLanes = 8;
+    static void search(const OrderedColours* const ordered[8], ClusterFitResult<8>& result) { searchSplitsAvx2(ordered, result); }
+};
+
+static bool hasAvx2()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    __cpuid(info, 1);
+    // the OS must save the YMM registers (OSXSAVE, AVX, XCR0 bits 1 and 2)
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+// compresses up to kGroupBlocks blocks, kFormat being the one of kDxt1, kDxt3 and kDxt5 in
+// squishFlags, with Search::kLanes blocks to a search
+template <class Search, int kFormat>
+static void compressGroup(const uint8_t (*rgba)[64], const int* masks, int blockCount, uint8_t* blocks, int squishFlags)
+{
+    const int kLanes = Search::kLanes;
+    const bool withAlpha = (kFormat != squish::kDxt1);
+    const int bytesPerBlock = withAlpha ? 16 : 8;
+
+    // blocks of one colour, or of none, are fit by squish; the rest are searched in lanes,
+    // grouped by their count of colours so that the lanes of a search finish together
+    OrderedColours ordered[kGroupBlocks];
+    int searched[kGroupBlocks];
+    int searchCount = 0;
+    for (int b = 0; b < blockCount; ++b)
+    {
+        squish::ColourSet colours(rgba[b], masks[b], squishFlags);
+        if (colours.GetCount() <= 1)
+        {
+            squish::CompressMasked(rgba[b], masks[b], blocks + b * bytesPerBlock, squishFlags, nullptr);
+            continue;
+        }
+        if (unitWeights(colours))
+            orderColours<false>(colours, ordered[b]);
+        else
+            orderColours<true>(colours, ordered[b]);
+        searched[searchCount++] = b;
+    }
+    std::stable_sort(searched, searched + searchCount, [&](int l, int r) { return ordered[l].count < ordered[r].count; });
+
+    for (int first = 0; first < searchCount; first += kLanes)
+    {
+        // a short final group repeats its last block
+        const OrderedColours* lanes[kLanes];
+        for (int lane = 0; lane < kLanes; ++lane)
+            lanes[lane] = &ordered[searched[std::min(first + lane, searchCount - 1)]];
+
+        ClusterFitResult<kLanes> result;
+        Search::search(lanes, result);
+
+        for (int lane = 0; lane < kLanes && first + lane < searchCount; ++lane)
+        {
+            int b = searched[first + lane];
+            uint8_t* block = blocks + b * bytesPerBlock;
+
+            // squish writes nothing if no split improves on FLT_MAX; let it decide what to do
+            if (!(result.error[lane] < FLT_MAX))
+            {
+                squish::CompressMasked(rgba[b], masks[b], block, squishFlags, nullptr);
+                continue;
+            }
+
+            const OrderedColours& colours = ordered[b];
+            int besti = result.split[lane][0], bestj = result.split[lane][1], bestk = result.split[lane][2];
+            uint8_t unordered[16];
+            for (int m = 0; m < besti; ++m)
+                unordered[colours.order[m]] = 0;
+            for (int m = besti; m < bestj; ++m)
+                unordered[colours.order[m]] = 2;
+            for (int m = bestj; m < bestk; ++m)
+                unordered[colours.order[m]] = 3;
+            for (int m = bestk; m < colours.count; ++m)
+                unordered[colours.order[m]] = 1;
+
+            uint8_t indices[16];
+            squish::ColourSet(rgba[b], masks[b], squishFlags).RemapIndices(unordered, indices);
+            squish::Vec3 start(result.start[0][lane], result.start[1][lane], result.start[2][lane]);
+            squish::Vec3 end(result.end[0][lane], result.end[1][lane], result.end[2][lane]);
+            squish::WriteColourBlock4(start, end, indices, withAlpha ? block + 8 : block);
+
+            if (kFormat == squish::kDxt3)
+                squish::CompressAlphaDxt3(rgba[b], masks[b], block);
+            else if (kFormat == squish::kDxt5)
+                squish::CompressAlphaDxt5(rgba[b], masks[b], block);
+        }
+    }
+}
+
+typedef void (*CompressGroup)(const uint8_t (*rgba)[64], const int* masks, int blockCount, uint8_t* blocks, int squishFlags);
+
+template <class Search>
+static CompressGroup selectFormat(int squishFlags)
+{
+    if ((squishFlags & squish::kDxt3) != 0)
+        return compressGroup<Search, squish::kDxt3>;
+    if ((squishFlags & squish::kDxt5) != 0)
+        return compressGroup<Search, squish::kDxt5>;
+    return compressGroup<Search, squish::kDxt1>;
+}
+
+void compressClusterFit(const uint8_t (*rgba)[64], const int* masks, int blockCount, uint8_t* blocks, int squishFlags)
+{
+    static const bool avx2 = hasAvx2();
+    CompressGroup compress = avx2 ? selectFormat<SearchAvx2>(squishFlags) : selectFormat<SearchSse41>(squishFlags);
+
+    int bytesPerBlock = (squishFlags & (squish::kDxt3 | squish::kDxt5)) ? 16 : 8;
+    for (int first = 0; first < blockCount; first += kGroupBlocks)
+        compress(rgba + first, masks + first, std::min(kGroupBlocks, blockCount - first), blocks + first * bytesPerBlock, squishFlags);
+}
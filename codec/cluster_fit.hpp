@@ -0,0 +1,17 @@
+#pragma once
+
+// squish's cluster fit for the colours of DXT1, DXT3 and DXT5 blocks, searching four or eight
+// blocks at once
+
+#include <cstdint>
+
+// Compress blockCount blocks of 16 rgba pixels, with masks of the pixels to use, to consecutive
+// blocks at blocks. squishFlags are those of squish::CompressMasked, and must ask for
+// kColourClusterFit; each block comes out exactly as squish::CompressMasked would give it.
+//
+// Squish spends nearly all of its time trying every split of a block's colours, ordered along
+// their principal axis, into the four palette entries. Here that search runs with one block in
+// each lane of SSE4.1, or of AVX2 where the CPU has it, repeating squish's arithmetic operation
+// for operation, including its Reciprocal as squish is built with or without SSE, so that the
+// rounding is the same. Blocks of one colour, and the alpha of every block, are left to squish.
+void compressClusterFit(const uint8_t (*rgba)[64], const int* masks, int blockCount, uint8_t* blocks, int squishFlags);
@@ -0,0 +1,44 @@
+// The cluster fit split search with eight blocks in the lanes of AVX2. This file is built for
+// AVX2, and only called when the CPU has it; see cluster_fit_search.hpp.
+
+#include <immintrin.h>
+
+#include "cluster_fit_search.hpp"
+
+struct Avx2
+{
+    typedef __m256 F;
+    typedef __m256i I;
+    static const int kLanes = 8;
+
+    static F set(float f) { return _mm256_set1_ps(f); }
+    static I set(int i) { return _mm256_set1_epi32(i); }
+    static F load(const float* p) { return _mm256_load_ps(p); }
+    static I load(const int32_t* p) { return _mm256_load_si256((const __m256i*)p); }
+    static void store(float* p, F v) { _mm256_store_ps(p, v); }
+    static void store(int32_t* p, I v) { _mm256_store_si256((__m256i*)p, v); }
+
+    static F add(F a, F b) { return _mm256_add_ps(a, b); }
+    static F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+    static F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+    static F div(F a, F b) { return _mm256_div_ps(a, b); }
+    static F min(F a, F b) { return _mm256_min_ps(a, b); }
+    static F max(F a, F b) { return _mm256_max_ps(a, b); }
+    static F rcp(F a) { return _mm256_rcp_ps(a); }
+    static F truncate(F a) { return _mm256_cvtepi32_ps(_mm256_cvttps_epi32(a)); }
+
+    static F less(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LT_OS); }
+    static F and_(F a, F b) { return _mm256_and_ps(a, b); }
+    static bool any(F mask) { return _mm256_movemask_ps(mask) != 0; }
+    static F select(F a, F b, F mask) { return _mm256_blendv_ps(a, b, mask); }
+    static I select(I a, I b, F mask) { return _mm256_blendv_epi8(a, b, _mm256_castps_si256(mask)); }
+
+    static I greater(I a, I b) { return _mm256_cmpgt_epi32(a, b); }
+    static I andNot(I a, I b) { return _mm256_andnot_si256(a, b); }
+    static F asFloat(I a) { return _mm256_castsi256_ps(a); }
+};
+
+void searchSplitsAvx2(const OrderedColours* const ordered[8], ClusterFitResult<8>& result)
+{
+    searchSplits<Avx2>(ordered, result);
+}
@@ -0,0 +1,243 @@
+#pragma once
+
+// The split search of cluster_fit.cpp, written once for the vectors of SSE4.1 and of AVX2. This
+// is included by cluster_fit.cpp and by cluster_fit_avx2.cpp, which is built for AVX2 and only
+// called on CPUs with it, so the code here is all static templates: an inline function built in
+// both files could be linked to the AVX2 copy and reach a CPU without it.
+//
+// V gives the vector of floats F and of int32s I with kLanes lanes, and the operations on them.
+
+#include <cfloat>
+#include <cstdint>
+
+#include "config.h"
+
+// a block's distinct colours in the order of their projection on the principal axis, each
+// scaled by its weight and with that weight in w, as squish's ClusterFit::ConstructOrdering
+// gives them
+struct OrderedColours
+{
+    int count;
+    uint8_t order[16];
+    float points[16][4];
+    float sum[4];
+};
+
+// the best endpoints of each lane, their error and the split [0,i), [i,j), [j,k), [k,count)
+template <int kLanes>
+struct ClusterFitResult
+{
+    alignas(32) float start[3][kLanes];
+    alignas(32) float end[3][kLanes];
+    alignas(32) float error[kLanes];
+    int split[kLanes][3];
+};
+
+// searches eight blocks at once; in cluster_fit_avx2.cpp
+void searchSplitsAvx2(const OrderedColours* const ordered[8], ClusterFitResult<8>& result);
+
+// x, y, z and w of one vector in each of the lanes' blocks
+template <class V>
+struct Lanes
+{
+    typename V::F v[4];
+};
+
+template <class V>
+static inline Lanes<V> operator+(const Lanes<V>& a, const Lanes<V>& b)
+{
+    return { { V::add(a.v[0], b.v[0]), V::add(a.v[1], b.v[1]), V::add(a.v[2], b.v[2]), V::add(a.v[3], b.v[3]) } };
+}
+
+template <class V>
+static inline Lanes<V> operator-(const Lanes<V>& a, const Lanes<V>& b)
+{
+    return { { V::sub(a.v[0], b.v[0]), V::sub(a.v[1], b.v[1]), V::sub(a.v[2], b.v[2]), V::sub(a.v[3], b.v[3]) } };
+}
+
+// the least squares endpoints of ClusterFit::Compress4 for a split of the ordered colours into
+// [0,i), [i,j), [j,k) and [k,count), given the weighted sums of each of the first three, and
+// their error less the constant xxsum; each operation is as squish orders it, so the rounding
+// is the same, and the metric is one
+template <class V>
+static inline typename V::F fitSplit(const Lanes<V>& part0, const Lanes<V>& part1, const Lanes<V>& part2, const Lanes<V>& sum,
+    typename V::F start[3], typename V::F end[3])
+{
+    typedef typename V::F F;
+    const F one = V::set(1.0f);
+    const F two = V::set(2.0f);
+    const F zero = V::set(0.0f);
+    const F half = V::set(0.5f);
+    const F onethird = V::set(1.0f / 3.0f);
+    const F twothirds = V::set(2.0f / 3.0f);
+    const F oneninth = V::set(1.0f / 9.0f);
+    const F fourninths = V::set(4.0f / 9.0f);
+    const F twoninths = V::set(2.0f / 9.0f);
+    const F grid[3] = { V::set(31.0f), V::set(63.0f), V::set(31.0f) };
+    const F gridrcp[3] = { V::set(1.0f / 31.0f), V::set(1.0f / 63.0f), V::set(1.0f / 31.0f) };
+
+    Lanes<V> part3 = sum - part2 - part1 - part0;
+
+    F alpha2 = V::add(V::mul(part2.v[3], oneninth), V::add(V::mul(part1.v[3], fourninths), part0.v[3]));
+    F beta2 = V::add(V::mul(part1.v[3], oneninth), V::add(V::mul(part2.v[3], fourninths), part3.v[3]));
+    F alphabeta = V::mul(twoninths, V::add(part1.v[3], part2.v[3]));
+
+    // squish's Reciprocal, as squish is built: with SSE the estimate and one Newton-Raphson
+    // step, otherwise a division
+    F determinant = V::sub(V::mul(alpha2, beta2), V::mul(alphabeta, alphabeta));
+#if SQUISH_USE_SSE
+    F estimate = V::rcp(determinant);
+    F factor = V::add(V::mul(V::sub(one, V::mul(estimate, determinant)), estimate), estimate);
+#else
+    F factor = V::div(one, determinant);
+#endif
+
+    F error = zero;
+    for (int c = 0; c < 3; ++c)
+    {
+        F alphax = V::add(V::mul(part2.v[c], onethird), V::add(V::mul(part1.v[c], twothirds), part0.v[c]));
+        F betax = V::add(V::mul(part1.v[c], onethird), V::add(V::mul(part2.v[c], twothirds), part3.v[c]));
+
+        // the optimal endpoints, clamped to the grid
+        F a = V::mul(V::sub(V::mul(alphax, beta2), V::mul(betax, alphabeta)), factor);
+        F b = V::mul(V::sub(V::mul(betax, alpha2), V::mul(alphax, alphabeta)), factor);
+        a = V::min(one, V::max(zero, a));
+        b = V::min(one, V::max(zero, b));
+        a = V::mul(V::truncate(V::add(V::mul(grid[c], a), half)), gridrcp[c]);
+        b = V::mul(V::truncate(V::add(V::mul(grid[c], b), half)), gridrcp[c]);
+        start[c] = a;
+        end[c] = b;
+
+        F e1 = V::add(V::mul(V::mul(a, a), alpha2), V::mul(V::mul(b, b), beta2));
+        F e2 = V::sub(V::mul(V::mul(a, b), alphabeta), V::mul(a, alphax));
+        F e3 = V::sub(e2, V::mul(b, betax));
+        F e4 = V::add(V::mul(two, e3), e1);
+        error = (c == 0) ? e4 : V::add(error, e4);
+    }
+    return error;
+}
+
+// tries every split of the ordered colours of each lane's block; splits beyond a block's own
+// count of colours are excluded, so each lane sees the splits, in the order, that squish would try
+template <class V>
+static void searchSplits(const OrderedColours* const ordered[V::kLanes], ClusterFitResult<V::kLanes>& result)
+{
+    typedef typename V::F F;
+    typedef typename V::I I;
+    const int kLanes = V::kLanes;
+
+    // transpose to one register of the lanes' blocks for each component of each point
+    int maxCount = 0;
+    alignas(32) int32_t counts[kLanes];
+    alignas(32) float points[16][4][kLanes];
+    alignas(32) float sums[4][kLanes];
+    for (int lane = 0; lane < kLanes; ++lane)
+    {
+        const OrderedColours& colours = *ordered[lane];
+        counts[lane] = colours.count;
+        maxCount = (colours.count > maxCount) ? colours.count : maxCount;
+        for (int i = 0; i < 16; ++i)
+            for (int c = 0; c < 4; ++c)
+                points[i][c][lane] = (i < colours.count) ? colours.points[i][c] : 0.0f;
+        for (int c = 0; c < 4; ++c)
+            sums[c][lane] = colours.sum[c];
+    }
+    Lanes<V> point[16], sum;
+    for (int i = 0; i < 16; ++i)
+        for (int c = 0; c < 4; ++c)
+            point[i].v[c] = V::load(points[i][c]);
+    for (int c = 0; c < 4; ++c)
+        sum.v[c] = V::load(sums[c]);
+    const I count = V::load(counts);
+
+    // only the error and the split are kept while searching; the split is packed as
+    // i | j << 8 | k << 16
+    F bestError = V::set(FLT_MAX);
+    I bestSplit = V::set(0);
+
+    // first cluster [0,i) is at the start
+    const F zero = V::set(0.0f);
+    const Lanes<V> none = { { zero, zero, zero, zero } };
+    Lanes<V> part0 = none;
+    for (int i = 0; i < maxCount; ++i)
+    {
+        I validI = V::greater(count, V::set(i));
+
+        // second cluster [i,j) is one third along
+        Lanes<V> part1 = none;
+        for (int j = i;;)
+        {
+            I validJ = V::andNot(V::greater(V::set(j), count), validI);
+
+            // third cluster [j,k) is two thirds along
+            Lanes<V> part2 = (j == 0) ? point[0] : none;
+            int kmin = (j == 0) ? 1 : j;
+            for (int k = kmin;;)
+            {
+                F valid = V::asFloat(V::andNot(V::greater(V::set(k), count), validJ));
+
+                F start[3], end[3];
+                F error = fitSplit<V>(part0, part1, part2, sum, start, end);
+
+                // keep the split where it wins
+                F wins = V::and_(V::less(error, bestError), valid);
+                if (V::any(wins))
+                {
+                    bestError = V::select(bestError, error, wins);
+                    bestSplit = V::select(bestSplit, V::set(i | j << 8 | k << 16), wins);
+                }
+
+                if (k == maxCount)
+                    break;
+                part2 = part2 + point[k];
+                ++k;
+            }
+
+            if (j == maxCount)
+                break;
+            part1 = part1 + point[j];
+            ++j;
+        }
+
+        part0 = part0 + point[i];
+    }
+
+    // fit the winning splits again for their endpoints, summing the clusters of each as the
+    // search did
+    alignas(32) int32_t splits[kLanes];
+    V::store(splits, bestSplit);
+    alignas(32) float parts[3][4][kLanes];
+    for (int lane = 0; lane < kLanes; ++lane)
+    {
+        int& i = result.split[lane][0];
+        int& j = result.split[lane][1];
+        int& k = result.split[lane][2];
+        i = splits[lane] & 0xff;
+        j = (splits[lane] >> 8) & 0xff;
+        k = splits[lane] >> 16;
+        int bounds[3][2] = { { 0, i }, { i, j }, { j, k } };
+        for (int part = 0; part < 3; ++part)
+        {
+            for (int c = 0; c < 4; ++c)
+            {
+                float total = 0.0f;
+                for (int m = bounds[part][0]; m < bounds[part][1]; ++m)
+                    total += points[m][c][lane];
+                parts[part][c][lane] = total;
+            }
+        }
+    }
+    Lanes<V> part[3];
+    for (int p = 0; p < 3; ++p)
+        for (int c = 0; c < 4; ++c)
+            part[p].v[c] = V::load(parts[p][c]);
+    F start[3], end[3];
+    fitSplit<V>(part[0], part[1], part[2], sum, start, end);
+
+    V::store(result.error, bestError);
+    for (int c = 0; c < 3; ++c)
+    {
+        V::store(result.start[c], start[c]);
+        V::store(result.end[c], end[c]);
+    }
+}
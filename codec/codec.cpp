@@ -1,10 +1,17 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <tmmintrin.h>
+#include <vector>
 
 #include "hap.h"
 
 #include "codec.hpp"
+#include "downscale.hpp"
 #include "util.hpp"
 
 int roundUpToMultipleOf4(int n)
@@ -17,6 +24,7 @@ const Codec4CC kHapAlphaCodecSubType{ 'H', 'a', 'p', '5' };
 const Codec4CC kHapYCoCgCodecSubType{ 'H', 'a', 'p', 'Y' };
 const Codec4CC kHapYCoCgACodecSubType{ 'H', 'a', 'p', 'M' };
 const Codec4CC kHapAOnlyCodecSubType{ 'H', 'a', 'p', 'A' };
+const Codec4CC kHap7CodecSubType{ 'H', 'a', 'p', '7' };
 
 const CodecDetails& CodecRegistry::details()
 {
@@ -25,7 +33,8 @@ const CodecDetails& CodecRegistry::details()
         CodecNamedSubType{kHapAlphaCodecSubType, "Hap Alpha"},
         CodecNamedSubType{kHapYCoCgCodecSubType,"Hap Q"},
         CodecNamedSubType{kHapYCoCgACodecSubType,"Hap Q Alpha"},
-        CodecNamedSubType{kHapAOnlyCodecSubType, "Hap Alpha-Only"} };
+        CodecNamedSubType{kHapAOnlyCodecSubType, "Hap Alpha-Only"},
+        CodecNamedSubType{kHap7CodecSubType, "Hap 7"} };
     
     static CodecDetails details{
         "HAP", // productName
@@ -45,7 +54,8 @@ const CodecDetails& CodecRegistry::details()
               { kHapAlphaCodecSubType, withAlpha },
               { kHapYCoCgCodecSubType, withoutAlpha },
               { kHapYCoCgACodecSubType, withAlpha },
-              { kHapAOnlyCodecSubType, withAlpha } },
+              { kHapAOnlyCodecSubType, withAlpha },
+              { kHap7CodecSubType, withAlpha } },
         },
         QualityCodecDetails{
             true,
@@ -53,8 +63,10 @@ const CodecDetails& CodecRegistry::details()
               { kHapAlphaCodecSubType, true },
               { kHapYCoCgCodecSubType, false },
               { kHapYCoCgACodecSubType, false },
-              { kHapAOnlyCodecSubType, false } },  // presentForSubtype
-            { { kSquishEncoderFastQuality, "Fast" },
+              { kHapAOnlyCodecSubType, false },
+              { kHap7CodecSubType, true } },  // presentForSubtype
+            { { kSquishEncoderRealtimeQuality, "Realtime" },
+              { kSquishEncoderFastQuality, "Fast" },
               {kSquishEncoderNormalQuality, "Normal" } }, // descriptions
             kSquishEncoderNormalQuality},  // defaultQuality
         6,                        // premiereParamsVersion
@@ -81,10 +93,11 @@ CodecRegistry::CodecRegistry()
             [](Encoder* encoder) { delete encoder; });
     };
 
-    // createDecoder = [=](std::unique_ptr<DecoderParametersBase> parameters) -> UniqueDecoder
-    // {
-    //     return nullptr;
-    // };
+    createDecoder = [=](std::unique_ptr<DecoderParametersBase> parameters) -> UniqueDecoder
+    {
+        return UniqueDecoder(new HapDecoder(parameters),
+            [](Decoder* decoder) { delete decoder; });
+    };
 }
 
 std::shared_ptr<CodecRegistry>& CodecRegistry::codec()
@@ -93,12 +106,17 @@ std::shared_ptr<CodecRegistry>& CodecRegistry::codec()
     return codecRegistry;
 }
 
+// Bytes per pixel of encoded frames, for the host's data-rate and file size estimates. Texture
+// sizes are exact; chunk compression is as predicted by HapEncoder::estimateFrameSize, and so is
+// taken to be none until frames of subType have been encoded.
 double CodecRegistry::getPixelFormatSize(
         CodecAlpha alpha,
         Codec4CC subType,
         int quality)
 {
-    return 4; // !!! not correct, for bitrate estimation; should be moved to encoder
+    const FrameSize nominal{ 1920, 1080 };
+    HapFrameSizeEstimate estimate = HapEncoder::estimateFrameSize(nominal, subType);
+    return estimate.predictedFrameBytes / (double(nominal.width) * nominal.height);
 }
 
 std::string CodecRegistry::logName_;
@@ -107,45 +125,98 @@ std::string CodecRegistry::logName()
     return logName_;
 }
 
-HapEncoder::HapEncoder(std::unique_ptr<EncoderParametersBase>& params)
-    : Encoder(std::move(params)),
-      count_(parameters().codec4CC == kHapYCoCgACodecSubType ? 2 : 1),
-      chunkCounts_((parameters().chunkCounts == HapChunkCounts{ 0, 0 })
-                   ? HapChunkCounts{ 1, 1 }
-                   : parameters().chunkCounts),     // auto represented as 0, 0
-      textureFormats_(getTextureFormats(parameters().codec4CC)),
-      compressors_{ HapCompressorSnappy, HapCompressorSnappy }
-{
-    SquishEncoderQuality quality = (SquishEncoderQuality)parameters().quality;
-    for (size_t i = 0; i < count_; ++i)
-    {
-        converters_[i] = TextureConverter::create(parameters().frameSize, textureFormats_[i], quality);
-        sizes_[i] = (unsigned long)converters_[i]->size();
-    }
+// a thread count from the environment; unset is 0
+static unsigned int getThreadCountSetting(const char* name)
+{
+    const char* setting = std::getenv(name);
+    if (!setting)
+        return 0;
+
+    char* end;
+    unsigned long threads = std::strtoul(setting, &end, 10);
+    if (end == setting || *end != '\0')
+        throw std::runtime_error(std::string("invalid ") + name + ": " + setting);
+
+    return (unsigned int)threads;
 }
 
-HapEncoder::~HapEncoder()
+// Threads used to compress or decompress each frame, set through HAP_ENCODER_THREADS so that CPU
+// use can be capped on shared render nodes. Unset or 0 uses every hardware thread; 1 works on the
+// calling thread only.
+static unsigned int getThreadCount()
 {
+    return getThreadCountSetting("HAP_ENCODER_THREADS");
 }
 
-std::unique_ptr<EncoderJob> HapEncoder::create()
+// Threads that automatic chunk counts aim to keep busy when the movie is played back, set through
+// HAP_DECODER_THREADS for the playback machines. Unset or 0 assumes they match this machine.
+static unsigned int getDecoderThreadCount()
 {
-    std::array<TextureConverter*, 2> converters;
-    for (size_t i = 0; i < count_; ++i)
-        converters[i] = converters_[i].get();   //!!! should probably move things like this back on HapEncoder
+    unsigned int threads = getThreadCountSetting("HAP_DECODER_THREADS");
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    return std::max(threads, 1u);
+}
 
-    return std::make_unique<HapEncoderJob>(
-            parameters().frameSize,
-            count_,
-            chunkCounts_,
-            textureFormats_,
-            compressors_,
-            converters,
-            sizes_
-        );
+// A switch set through the environment variable name, HAP_ENCODER_REUSE_BLOCKS for encoders to
+// reuse unchanged blocks or HAP_ENCODER_SAMPLE_CHUNKS to sample chunks; unset is 0
+static bool getSwitchSetting(const char* name)
+{
+    const char* setting = std::getenv(name);
+    if (!setting || std::strcmp(setting, "0") == 0)
+        return false;
+    if (std::strcmp(setting, "1") == 0)
+        return true;
+    throw std::runtime_error(std::string("invalid ") + name + ": " + setting);
 }
 
-std::array<unsigned int, 2> HapEncoder::getTextureFormats(Codec4CC subType)
+// Prefix of the trace files written by each encoder, set through HAP_ENCODER_TRACE; unset or
+// empty does not trace
+static std::string getTraceSetting()
+{
+    const char* setting = std::getenv("HAP_ENCODER_TRACE");
+    return setting ? setting : "";
+}
+
+// Chunks smaller than this compress noticeably worse with snappy, whose blocks are 64KB, and
+// spend proportionally more of their decode time on per-chunk overheads
+static const size_t kMinAutoChunkBytes = 256 * 1024;
+
+// The chunk count for 'auto': up to one chunk per decoder thread, none smaller than
+// kMinAutoChunkBytes. A count that gives every chunk the same whole block rows is favoured
+// if it keeps at least half the chunks, otherwise one that splits the blocks evenly.
+static unsigned int getAutoChunkCount(const FrameSize& frameSize, size_t bytes, unsigned int decoderThreads)
+{
+    unsigned int blockRows = (unsigned int)(roundUpToMultipleOf4(frameSize.height) / 4);
+    size_t blocks = size_t(blockRows) * (roundUpToMultipleOf4(frameSize.width) / 4);
+
+    unsigned int limit = (unsigned int)std::max<size_t>(1, std::min<size_t>(decoderThreads, bytes / kMinAutoChunkBytes));
+
+    for (unsigned int count = limit; count * 2 >= limit; --count)
+    {
+        if (blockRows % count == 0)
+            return count;
+    }
+    for (unsigned int count = limit; count > 1; --count)
+    {
+        if (blocks % count == 0)
+            return count;
+    }
+    return 1;
+}
+
+// The chunk count hap_encode will actually use, which is reduced until it divides the blocks
+static unsigned int getEffectiveChunkCount(const FrameSize& frameSize, unsigned int requested)
+{
+    size_t blocks = size_t(roundUpToMultipleOf4(frameSize.height) / 4) * (roundUpToMultipleOf4(frameSize.width) / 4);
+
+    unsigned int count = (unsigned int)std::min<size_t>(requested, blocks);
+    while (blocks % count != 0)
+        --count;
+    return count;
+}
+
+static std::array<unsigned int, 2> getTextureFormats(Codec4CC subType)
 {
     if (subType == kHapCodecSubType) {
         return { HapTextureFormat_RGB_DXT1 };
@@ -162,10 +233,176 @@ std::array<unsigned int, 2> HapEncoder::getTextureFormats(Codec4CC subType)
     else if (subType == kHapAOnlyCodecSubType) {
         return { HapTextureFormat_A_RGTC1 };
     }
+    else if (subType == kHap7CodecSubType) {
+        return { HapTextureFormat_RGBA_BPTC_UNORM };
+    }
     else
         throw std::runtime_error("unknown codec");
 }
 
+HapEncoderTextures::HapEncoderTextures(FrameSize frameSize, Codec4CC subType, HapChunkCounts chunkCounts,
+                                       SquishEncoderQuality quality, ThreadPool* threadPool)
+    : frameSize_(frameSize),
+      subType_(subType),
+      dataRate_(subType),
+      count_(subType == kHapYCoCgACodecSubType ? 2 : 1),
+      chunkCounts_{ 1, 1 },
+      textureFormats_(getTextureFormats(subType))
+{
+    for (size_t i = 0; i < count_; ++i)
+    {
+        converters_[i] = TextureConverter::create(frameSize_, textureFormats_[i], quality, threadPool);
+        sizes_[i] = (unsigned long)converters_[i]->size();
+    }
+
+    // auto represented as 0, 0
+    bool automatic = (chunkCounts == HapChunkCounts{ 0, 0 });
+    unsigned int decoderThreads = automatic ? getDecoderThreadCount() : 0;
+    for (size_t i = 0; i < count_; ++i)
+    {
+        chunkCounts_[i] = automatic
+            ? getAutoChunkCount(frameSize_, sizes_[i], decoderThreads)
+            : getEffectiveChunkCount(frameSize_, std::max(chunkCounts[i], 1u));
+    }
+
+    maxEncodedSize_ = HapMaxEncodedLength(count_, &sizes_[0], &textureFormats_[0], &chunkCounts_[0]);
+}
+
+std::unique_ptr<HapEncoderJob> HapEncoderTextures::createJob(
+    std::array<unsigned int, 2> compressors,
+    ThreadPool* threadPool,
+    BufferPool* bufferPool,
+    std::vector<std::unique_ptr<HapEncoderJob>> proxies)
+{
+    std::array<TextureConverter*, 2> converters;
+    for (size_t i = 0; i < count_; ++i)
+        converters[i] = converters_[i].get();
+
+    return std::make_unique<HapEncoderJob>(
+            frameSize_,
+            count_,
+            chunkCounts_,
+            textureFormats_,
+            compressors,
+            converters,
+            sizes_,
+            maxEncodedSize_,
+            threadPool,
+            bufferPool,
+            blockReuse_.get(),
+            &dataRate_,
+            std::move(proxies)
+        );
+}
+
+HapFrameSizeEstimate HapEncoderTextures::frameSizeEstimate() const
+{
+    size_t textureBytes = 0;
+    for (size_t i = 0; i < count_; ++i)
+        textureBytes += sizes_[i];
+    return ::estimateFrameSize(subType_, textureBytes, maxEncodedSize_);
+}
+
+void HapEncoderTextures::enableBlockReuse()
+{
+    if (!blockReuse_)
+        blockReuse_ = std::make_unique<BlockReuseCache>();
+}
+
+BlockReuseStats HapEncoderTextures::blockReuseStats() const
+{
+    return blockReuse_ ? blockReuse_->stats() : BlockReuseStats{};
+}
+
+HapEncoder::HapEncoder(std::unique_ptr<EncoderParametersBase>& params)
+    : Encoder(std::move(params)),
+      threadPool_(std::make_unique<ThreadPool>(getThreadCount())),
+      compressors_{ HapCompressorSnappy, HapCompressorSnappy },
+      textures_(parameters().frameSize, parameters().codec4CC, parameters().chunkCounts,
+                (SquishEncoderQuality)parameters().quality, threadPool_.get())
+{
+    if (getSwitchSetting("HAP_ENCODER_REUSE_BLOCKS"))
+        enableBlockReuse();
+    if (getSwitchSetting("HAP_ENCODER_SAMPLE_CHUNKS"))
+        enableChunkSampling();
+
+    std::string tracePrefix = getTraceSetting();
+    if (!tracePrefix.empty())
+        enableTracing(tracePrefix);
+}
+
+HapEncoder::~HapEncoder()
+{
+}
+
+std::unique_ptr<EncoderJob> HapEncoder::create()
+{
+    return createJob();
+}
+
+std::unique_ptr<HapEncoderJob> HapEncoder::createJob()
+{
+    std::vector<std::unique_ptr<HapEncoderJob>> proxies;
+    for (auto& proxy : proxies_)
+        proxies.push_back(proxy->createJob(compressors_, threadPool_.get(), &bufferPool_, {}));
+
+    return textures_.createJob(compressors_, threadPool_.get(), &bufferPool_, std::move(proxies));
+}
+
+HapFrameSizeEstimate HapEncoder::estimateFrameSize(const FrameSize& frameSize, Codec4CC subType)
+{
+    std::array<unsigned int, 2> textureFormats = getTextureFormats(subType);
+    unsigned int count = (subType == kHapYCoCgACodecSubType) ? 2 : 1;
+    HapChunkCounts chunkCounts{ 1, 1 };
+
+    std::array<unsigned long, 2> sizes{};
+    size_t textureBytes = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        sizes[i] = (unsigned long)TextureConverter::create(frameSize, textureFormats[i], kSquishEncoderNormalQuality)->size();
+        textureBytes += sizes[i];
+    }
+
+    return ::estimateFrameSize(subType, textureBytes,
+        HapMaxEncodedLength(count, &sizes[0], &textureFormats[0], &chunkCounts[0]));
+}
+
+void HapEncoder::enableBlockReuse()
+{
+    textures_.enableBlockReuse();
+    for (auto& proxy : proxies_)
+        proxy->enableBlockReuse();
+}
+
+void HapEncoder::enableChunkSampling()
+{
+    compressors_.fill(HapCompressorSnappySampled);
+}
+
+void HapEncoder::enableProxies(unsigned int count)
+{
+    while (proxies_.size() < count)
+    {
+        const FrameSize& size = proxies_.empty() ? textures_.frameSize() : proxies_.back()->frameSize();
+        FrameSize halved{ (size.width + 1) / 2, (size.height + 1) / 2 };
+        proxies_.push_back(std::make_unique<HapEncoderTextures>(halved, parameters().codec4CC, parameters().chunkCounts,
+            (SquishEncoderQuality)parameters().quality, threadPool_.get()));
+        if (textures_.reusesBlocks())
+            proxies_.back()->enableBlockReuse();
+    }
+}
+
+void HapEncoder::enableTracing(const std::string& prefix)
+{
+    if (!trace_)
+        trace_ = std::make_unique<TraceSession>(prefix);
+}
+
+BlockReuseStats HapEncoder::blockReuseStats() const
+{
+    return textures_.blockReuseStats();
+}
+
 HapEncoderJob::HapEncoderJob(
     FrameSize frameSize,
     unsigned int count,
@@ -173,67 +410,437 @@ HapEncoderJob::HapEncoderJob(
     std::array<unsigned int, 2> textureFormats,
     std::array<unsigned int, 2> compressors,
     std::array<TextureConverter*, 2> converters,
-    std::array<unsigned long, 2> sizes)
+    std::array<unsigned long, 2> sizes,
+    size_t maxEncodedSize,
+    ThreadPool* threadPool,
+    BufferPool* bufferPool,
+    BlockReuseCache* blockReuse,
+    DataRateMeter* dataRate,
+    std::vector<std::unique_ptr<HapEncoderJob>> proxies)
     : frameSize_(frameSize),
       count_(count),
       chunkCounts_(chunkCounts),
       textureFormats_(textureFormats),
       compressors_(compressors),
       converters_(converters),
-      sizes_(sizes)
+      sizes_(sizes),
+      maxEncodedSize_(maxEncodedSize),
+      threadPool_(threadPool),
+      bufferPool_(bufferPool),
+      blockReuse_(blockReuse),
+      dataRate_(dataRate),
+      proxies_(std::move(proxies))
 {
+    // a segment for the frame's header, and for each texture its header, and each chunk or the
+    // whole texture
+    size_t segments = 1;
+    for (unsigned int i = 0; i < count_; ++i)
+        segments += 2 + chunkCounts_[i];
+    segments_.resize(segments);
+}
+
+// describes an 8-bit host frame for converters to read in place
+static bool getSourceFrame(const uint8_t* data, size_t stride, FrameFormat format, int height, SourceFrame& source)
+{
+    if (!(format & ChannelFormat_U8))
+        return false;
+
+    if (format & ChannelLayout_RGBA)
+        source.order = kSourceChannelOrderRgba;
+    else if (format & ChannelLayout_BGRA)
+        source.order = kSourceChannelOrderBgra;
+    else if (format & ChannelLayout_ARGB)
+        source.order = kSourceChannelOrderArgb;
+    else
+        return false;
+
+    if (format & FrameOrigin_BottomLeft)
+    {
+        source.data = data + (size_t)(height - 1) * stride;
+        source.stride = -(ptrdiff_t)stride;
+    }
+    else
+    {
+        source.data = data;
+        source.stride = (ptrdiff_t)stride;
+    }
+    return true;
 }
 
 void HapEncoderJob::doCopyExternalToLocal(
     const uint8_t *data, size_t stride, FrameFormat format)
 {
-    rgbaTopLeftOrigin_.resize(frameSize_.width * frameSize_.height * 4);
+    copy(data, stride, format, false);
+}
+
+void HapEncoderJob::doReferenceExternal(const uint8_t* data, size_t stride, FrameFormat format)
+{
+    copy(data, stride, format, true);
+}
+
+// sets source_ for doConvert. Conversion is left to doConvert even for 8-bit frames, so that
+// a pipeline converts on its own thread while the host renders the next frame; the copy is
+// only a memcpy of each row, the swizzle and flip being left to the converters.
+void HapEncoderJob::copy(const uint8_t* data, size_t stride, FrameFormat format, bool reference)
+{
+    frame_ = Trace::active() ? Trace::nextFrame() : -1;
+
+    SourceFrame host;
+    bool u8 = getSourceFrame(data, stride, format, frameSize_.height, host);
+    if (u8 && reference)
+    {
+        source_ = host;
+        return;
+    }
+
+    TraceScope scope("copy", frame_);
+    auto start = std::chrono::steady_clock::now();
+
+    size_t rowBytes = size_t(frameSize_.width) * 4;
+    if (!copied_)
+        copied_ = bufferPool_->acquire(rowBytes * frameSize_.height);
+
+    if (u8)
+    {
+        for (int y = 0; y < frameSize_.height; ++y)
+            std::memcpy(copied_.data() + y * rowBytes, host.data + y * host.stride, rowBytes);
+        source_ = SourceFrame{ copied_.data(), (ptrdiff_t)rowBytes, host.order };
+    }
+    else
+    {
+        // convert host format to rgba top left origin
+        FrameDef frameDef(frameSize_, format);
+        convertHostFrameTo_RGBA_Top_Left_U8(data, stride, frameDef, copied_.data(), rowBytes);
+        source_ = SourceFrame{ copied_.data(), (ptrdiff_t)rowBytes, kSourceChannelOrderRgba };
+    }
+
+    timings_.copy += std::chrono::steady_clock::now() - start;
+}
 
-    // convert host format to rgba top left origin
-    FrameDef frameDef(frameSize_, format);
-    convertHostFrameTo_RGBA_Top_Left_U8(data, stride, frameDef, (uint8_t*)& rgbaTopLeftOrigin_[0], frameSize_.width * 4);
+// halves source for the first proxy, that for the next, and so on, converting each in turn.
+// The reduced frames keep the source's channel order and are only needed until converted.
+void HapEncoderJob::convertProxies(const SourceFrame& source)
+{
+    SourceFrame reduced = source;
+    FrameSize reducedSize = frameSize_;
+    BufferPool::Buffer buffer;
+    for (auto& proxy : proxies_)
+    {
+        proxy->frame_ = frame_;
+        {
+            TraceScope scope("reduce", frame_);
+            auto start = std::chrono::steady_clock::now();
+
+            size_t stride = size_t(proxy->frameSize_.width) * 4;
+            BufferPool::Buffer halved = bufferPool_->acquire(stride * proxy->frameSize_.height);
+            halveFrame(reduced.data, reduced.stride, reducedSize.width, reducedSize.height, halved.data(), stride, threadPool_);
+
+            reduced = SourceFrame{ halved.data(), (ptrdiff_t)stride, source.order };
+            reducedSize = proxy->frameSize_;
+            buffer = std::move(halved);
+            proxy->timings_.copy += std::chrono::steady_clock::now() - start;
+        }
+        proxy->convert(reduced);
+        proxy->converted_ = true;
+    }
+}
+
+// passed through HapEncodeWithCallback to hapEncodeCallback
+struct HapEncodeContext
+{
+    ThreadPool* threadPool;
+    std::chrono::steady_clock::duration compress;   // time spent compressing chunks
+};
+
+// spreads compression of a texture's chunks across the encoder's threads
+static void hapEncodeCallback(HapEncodeWorkFunction function, void* p, unsigned int count, void* info)
+{
+    HapEncodeContext* context = static_cast<HapEncodeContext*>(info);
+
+    auto start = std::chrono::steady_clock::now();
+    int64_t frame = Trace::currentFrame();
+    context->threadPool->parallelFor(count, [&](unsigned int i) {
+        TraceScope scope("compress chunk", frame);
+        function(p, i);
+    });
+    context->compress += std::chrono::steady_clock::now() - start;
 }
 
 void HapEncoderJob::doEncode(EncodeOutput& out)
 {
-    // convert input texture from rgba to <subcodec defined> dxt [+ dxt]
+    doConvert();
+    doPack(out);
+}
+
+void HapEncoderJob::doConvert()
+{
+    if (converted_)
+        return;
+
+    convert(source_);
+    converted_ = true;
+    convertProxies(source_);
+
+    // the textures are all that packing needs, so the copy can serve the next frame now
+    source_ = SourceFrame{};
+    copied_.reset();
+}
+
+void HapEncoderJob::convert(const SourceFrame& source)
+{
+    TraceScope scope("convert", frame_);
+    auto start = std::chrono::steady_clock::now();
+
+    std::array<uint8_t*, 2> outputs{};
     for (unsigned int i = 0; i < count_; ++i)
     {
-        converters_[i]->convert(
-            &rgbaTopLeftOrigin_[0],
-            ycocg_,
-            buffers_[i]);
+        if (!buffers_[i])
+            buffers_[i] = bufferPool_->acquire(sizes_[i]);
+        outputs[i] = buffers_[i].data();
+    }
+
+    // convert input texture from rgba to <subcodec defined> dxt [+ dxt], in one pass
+    TextureConverter::convert(converters_, count_, source, outputs, blockReuse_);
+
+    timings_.convert += std::chrono::steady_clock::now() - start;
+}
+
+void HapEncoderJob::doPack(EncodeOutput& out)
+{
+    TraceScope scope("pack", frame_);
+    auto start = std::chrono::steady_clock::now();
+
+    // hap_encode needs room for the worst case, which is only partly written. Its chunks are
+    // left in a pooled buffer where they were compressed, and textures it stores uncompressed
+    // in buffers_, and gathered from there; so the frame is copied once on its way to the host,
+    // and out.buffer is never zero-filled for the worst case
+    if (!encoded_)
+        encoded_ = bufferPool_->acquire(maxEncodedSize_);
+
+    HapEncodeChunkStats chunkStats{};
+    std::chrono::steady_clock::duration compress{};
+    unsigned long encodedBytes = encodeFrame(encoded_.data(), encoded_.size(), true, chunkStats, compress);
+
+    {
+        TraceScope copyOut("copy output", frame_);
+        out.buffer.clear();
+        out.buffer.reserve(encodedBytes);
+        for (unsigned int i = 0; i < segmentCount_; ++i)
+        {
+            const uint8_t* data = static_cast<const uint8_t*>(segments_[i].data);
+            out.buffer.insert(out.buffer.end(), data, data + segments_[i].length);
+        }
     }
 
-    // encode textures for output stream
+    finishPack(encodedBytes, chunkStats, start, compress);
+}
+
+size_t HapEncoderJob::doPack(uint8_t* output, size_t size)
+{
+    TraceScope scope("pack", frame_);
+    auto start = std::chrono::steady_clock::now();
+
+    HapEncodeChunkStats chunkStats{};
+    std::chrono::steady_clock::duration compress{};
+    unsigned long encodedBytes = encodeFrame(output, size, false, chunkStats, compress);
+
+    finishPack(encodedBytes, chunkStats, start, compress);
+    return encodedBytes;
+}
+
+// encodes the converted textures into output, or with gather as segments_ of output and
+// buffers_, and returns the length of the frame
+unsigned long HapEncoderJob::encodeFrame(uint8_t* output, size_t size, bool gather,
+    HapEncodeChunkStats& chunkStats, std::chrono::steady_clock::duration& compress)
+{
     std::array<void*, 2> bufferPtrs;              // for hap_encode
     std::array<unsigned long, 2> buffersBytes;    // for hap_encode
-    out.buffer.resize(getMaxEncodedSize());
     unsigned long outputBufferBytesUsed;
     for (unsigned int i = 0; i < count_; ++i)
     {
-        bufferPtrs[i] = const_cast<uint8_t *>(&(buffers_[i][0]));
+        bufferPtrs[i] = buffers_[i].data();
         buffersBytes[i] = (unsigned long)buffers_[i].size();
     }
 
-    auto result = HapEncode(
-        count_,
-        const_cast<const void **>(&bufferPtrs[0]), const_cast<unsigned long *>(&buffersBytes[0]),
-        const_cast<unsigned int *>(&textureFormats_[0]),
-        const_cast<unsigned int *>(&compressors_[0]),
-        const_cast<unsigned int *>(&chunkCounts_[0]),
-        &out.buffer[0], (unsigned long)out.buffer.size(),
-        &outputBufferBytesUsed);
+    HapEncodeContext context{ threadPool_, {} };
+    unsigned int result;
+    if (gather)
+    {
+        result = HapEncodeSegmentsWithCallback(
+            count_,
+            const_cast<const void **>(&bufferPtrs[0]), const_cast<unsigned long *>(&buffersBytes[0]),
+            const_cast<unsigned int *>(&textureFormats_[0]),
+            const_cast<unsigned int *>(&compressors_[0]),
+            const_cast<unsigned int *>(&chunkCounts_[0]),
+            hapEncodeCallback, &context,
+            output, (unsigned long)size,
+            segments_.data(), (unsigned int)segments_.size(), &segmentCount_,
+            &outputBufferBytesUsed,
+            &chunkStats);
+    }
+    else
+    {
+        result = HapEncodeWithCallback(
+            count_,
+            const_cast<const void **>(&bufferPtrs[0]), const_cast<unsigned long *>(&buffersBytes[0]),
+            const_cast<unsigned int *>(&textureFormats_[0]),
+            const_cast<unsigned int *>(&compressors_[0]),
+            const_cast<unsigned int *>(&chunkCounts_[0]),
+            hapEncodeCallback, &context,
+            output, (unsigned long)size,
+            &outputBufferBytesUsed,
+            &chunkStats);
+    }
 
     if (HapResult_No_Error != result)
     {
         throw std::runtime_error("failed to encode frame");
     }
 
-    out.buffer.resize(outputBufferBytesUsed);
+    compress = context.compress;
+    return outputBufferBytesUsed;
+}
+
+void HapEncoderJob::finishPack(unsigned long encodedBytes, const HapEncodeChunkStats& chunkStats,
+    std::chrono::steady_clock::time_point start, std::chrono::steady_clock::duration compress)
+{
+    size_t textureBytes = 0;
+    for (unsigned int i = 0; i < count_; ++i)
+        textureBytes += buffers_[i].size();
+    dataRate_->record(textureBytes, encodedBytes, chunkStats);
+
+    // the frame is done with, so its buffers can serve whichever job encodes next
+    converted_ = false;
+    for (unsigned int i = 0; i < count_; ++i)
+        buffers_[i].reset();
+    encoded_.reset();
+
+    // everything that was not snappy is packing
+    timings_.compress += compress;
+    timings_.pack += (std::chrono::steady_clock::now() - start) - compress;
+    ++timings_.frames;
+}
+
+HapDecoder::HapDecoder(std::unique_ptr<DecoderParametersBase>& params)
+    : Decoder(std::move(params)),
+      threadPool_(std::make_unique<ThreadPool>(getThreadCount()))
+{
+}
+
+HapDecoder::~HapDecoder()
+{
+}
+
+std::unique_ptr<DecoderJob> HapDecoder::create()
+{
+    return std::make_unique<HapDecoderJob>(parameters().frameSize, threadPool_.get());
+}
+
+HapDecoderJob::HapDecoderJob(FrameSize frameSize, ThreadPool* threadPool)
+    : frameSize_(frameSize),
+      threadPool_(threadPool),
+      count_(0),
+      textureFormats_{ 0, 0 }
+{
+}
+
+// spreads decompression of a texture's chunks across the decoder's threads
+static void hapDecodeCallback(HapDecodeWorkFunction function, void* p, unsigned int count, void* info)
+{
+    static_cast<ThreadPool*>(info)->parallelFor(count, [&](unsigned int i) { function(p, i); });
 }
 
-size_t HapEncoderJob::getMaxEncodedSize() const
+void HapDecoderJob::doDecode(const DecodeInput& in)
 {
-    return HapMaxEncodedLength(count_, const_cast<unsigned long*>(&sizes_[0]), const_cast<unsigned int*>(&textureFormats_[0]), const_cast<unsigned int*>(&chunkCounts_[0]));
+    const void* input = &in.buffer[0];
+    unsigned long inputBytes = (unsigned long)in.buffer.size();
+
+    unsigned int count;
+    if (HapResult_No_Error != HapGetFrameTextureCount(input, inputBytes, &count) || count == 0 || count > 2)
+    {
+        throw std::runtime_error("failed to decode frame");
+    }
+
+    std::array<const TextureDecoder*, 2> decoders;
+    std::array<const uint8_t*, 2> textures;
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        unsigned int textureFormat;
+        if (HapResult_No_Error != HapGetFrameTextureFormat(input, inputBytes, i, &textureFormat))
+        {
+            throw std::runtime_error("failed to decode frame");
+        }
+
+        if (i >= count_ || textureFormat != textureFormats_[i])
+        {
+            decoders_[i] = TextureDecoder::create(frameSize_, textureFormat, threadPool_);
+            textureFormats_[i] = textureFormat;
+        }
+
+        // decompress chunks into the texture
+        buffers_[i].resize(decoders_[i]->size());
+        unsigned long bytesUsed;
+        auto result = HapDecode(
+            input, inputBytes,
+            i,
+            hapDecodeCallback, threadPool_,
+            &buffers_[i][0], (unsigned long)buffers_[i].size(),
+            &bytesUsed,
+            &textureFormat);
+
+        if (HapResult_No_Error != result || bytesUsed < buffers_[i].size())
+        {
+            throw std::runtime_error("failed to decode frame");
+        }
+
+        decoders[i] = decoders_[i].get();
+        textures[i] = &buffers_[i][0];
+    }
+    count_ = count;
+
+    // convert textures from <subcodec defined> dxt [+ dxt] to rgba, in one pass
+    rgbaTopLeftOrigin_.resize(frameSize_.width * frameSize_.height * 4);
+    TextureDecoder::decode(decoders, count_, textures, &rgbaTopLeftOrigin_[0]);
 }
+
+void HapDecoderJob::doCopyLocalToExternal(
+    uint8_t* data, size_t stride, FrameFormat format)
+{
+    if (!(format & ChannelFormat_U8))
+    {
+        throw std::runtime_error("unsupported host frame format");
+    }
+
+    // convert rgba top left origin to host format, 4 pixels at a time
+    __m128i order;
+    if (format & ChannelLayout_RGBA)
+        order = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    else if (format & ChannelLayout_BGRA)
+        order = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    else if (format & ChannelLayout_ARGB)
+        order = _mm_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+    else
+        throw std::runtime_error("unsupported host frame format");
+
+    bool bottomLeft = (format & FrameOrigin_BottomLeft) != 0;
+    int width = frameSize_.width;
+    for (int y = 0; y < frameSize_.height; ++y)
+    {
+        const uint8_t* source = &rgbaTopLeftOrigin_[(size_t)y * width * 4];
+        uint8_t* dest = data + (bottomLeft ? frameSize_.height - 1 - y : y) * stride;
+
+        int x = 0;
+        for (; x + 4 <= width; x += 4)
+        {
+            __m128i pixels = _mm_loadu_si128((const __m128i*)(source + x * 4));
+            _mm_storeu_si128((__m128i*)(dest + x * 4), _mm_shuffle_epi8(pixels, order));
+        }
+        for (; x < width; ++x)
+        {
+            alignas(16) uint8_t pixels[16] = {};
+            std::memcpy(pixels, source + x * 4, 4);
+            _mm_store_si128((__m128i*)pixels, _mm_shuffle_epi8(_mm_load_si128((const __m128i*)pixels), order));
+            std::memcpy(dest + x * 4, pixels, 4);
+        }
+    }
+}
\ No newline at end of file
@@ -3,12 +3,40 @@
 // base class for different kinds of Hap encoders
 
 #include <array>
+#include <chrono>
 #include <memory>
 #include <vector>
 
 #include "codec_registration.hpp"
+#include "hap.h"
 
+#include "buffer_pool.hpp"
+#include "data_rate.hpp"
 #include "texture_converter.hpp"
+#include "texture_decoder.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+
+// Time spent in each stage of encoding, accumulated over every frame a job has encoded
+
+struct HapEncoderTimings
+{
+    std::chrono::steady_clock::duration copy{};      // host frame to local memory
+    std::chrono::steady_clock::duration convert{};   // rgba to dxt textures
+    std::chrono::steady_clock::duration compress{};  // second-stage (snappy) compression of chunks
+    std::chrono::steady_clock::duration pack{};      // output sizing, headers and packing of chunks
+    unsigned int frames{ 0 };
+
+    HapEncoderTimings& operator+=(const HapEncoderTimings& other)
+    {
+        copy += other.copy;
+        convert += other.convert;
+        compress += other.compress;
+        pack += other.pack;
+        frames += other.frames;
+        return *this;
+    }
+};
 
 // Placeholders for inputs, processing and outputs for encode process
 
@@ -22,18 +50,58 @@ public:
         std::array<unsigned int, 2> textureFormats,
         std::array<unsigned int, 2> compressors,
         std::array<TextureConverter*, 2> converters,
-        std::array<unsigned long, 2> sizes
+        std::array<unsigned long, 2> sizes,
+        size_t maxEncodedSize,
+        ThreadPool* threadPool,
+        BufferPool* bufferPool,
+        BlockReuseCache* blockReuse,
+        DataRateMeter* dataRate,
+        std::vector<std::unique_ptr<HapEncoderJob>> proxies
         );
     ~HapEncoderJob() {}
 
-private:
+    // the stages are public so that tools can drive a job directly, outside of a host.
+    // doCopyExternalToLocal is what the host wrappers call, and as the Adobe hosts only lend
+    // the frame for that call, their exports still copy every 8-bit frame, a memcpy of each row
     virtual void doCopyExternalToLocal(
         const uint8_t* data,
         size_t stride,
         FrameFormat format) override;
     virtual void doEncode(EncodeOutput& out) override;
 
-    size_t getMaxEncodedSize() const;
+    // doCopyExternalToLocal for a host whose frame stays valid and unchanged until doConvert or
+    // doEncode returns: 8-bit frames are then not copied, converters gathering their blocks from
+    // the host's pixels in place. Other formats are copied as before. Of the callers in this
+    // tree only hap_encode, without --pipeline, can use it.
+    void doReferenceExternal(const uint8_t* data, size_t stride, FrameFormat format);
+
+    // doEncode in two stages, so that a pipeline can overlap one frame's conversion with
+    // the packing of the frame before
+    void doConvert();
+    void doPack(EncodeOutput& out);
+
+    // doPack for a writer that owns the buffer frames go to, such as a pooled sample buffer of
+    // a muxer: the frame is encoded straight into output, which must have room for
+    // maxEncodedSize() bytes, and its length returned
+    size_t doPack(uint8_t* output, size_t size);
+    size_t maxEncodedSize() const { return maxEncodedSize_; }
+
+    // the jobs of the encoder's proxies, largest first. Each frame converted by this job is
+    // reduced and converted for every proxy in doConvert, and a proxy's doPack gives its frame; one
+    // that is not packed is replaced by the next frame. A proxy's copy timing is its reduction.
+    size_t proxyCount() const { return proxies_.size(); }
+    HapEncoderJob& proxy(size_t i) { return *proxies_[i]; }
+
+    const HapEncoderTimings& timings() const { return timings_; }
+
+private:
+    void copy(const uint8_t* data, size_t stride, FrameFormat format, bool reference);
+    void convert(const SourceFrame& source);
+    void convertProxies(const SourceFrame& source);
+    unsigned long encodeFrame(uint8_t* output, size_t size, bool gather,
+        HapEncodeChunkStats& chunkStats, std::chrono::steady_clock::duration& compress);
+    void finishPack(unsigned long encodedBytes, const HapEncodeChunkStats& chunkStats,
+        std::chrono::steady_clock::time_point start, std::chrono::steady_clock::duration compress);
 
     FrameSize frameSize_;
     unsigned int count_;
@@ -42,12 +110,70 @@ private:
     std::array<unsigned int, 2> compressors_;
     std::array<TextureConverter*, 2> converters_;
     std::array<unsigned long, 2> sizes_;
+    size_t maxEncodedSize_;
+    ThreadPool* threadPool_;
+    BufferPool* bufferPool_;
+    BlockReuseCache* blockReuse_;   // may be null
+    DataRateMeter* dataRate_;
+    std::vector<std::unique_ptr<HapEncoderJob>> proxies_;
+
+    // the host frame only lives for doCopyExternalToLocal, so it is copied to copied_: 8-bit
+    // frames row by row in the host's channel order, for converters to swizzle a strip at a
+    // time, and others converted to 8-bit rgba. source_ is the frame doConvert converts, copied_
+    // or the host's pixels. copied_ is given back to the encoder's pool once converted, and
+    // buffers_ and encoded_ once the frame is packed.
+    BufferPool::Buffer copied_;
+    SourceFrame source_{};
+    std::array<BufferPool::Buffer, 2> buffers_;  // for hap_encode
+    BufferPool::Buffer encoded_;                 // from hap_encode, before gathering to the output
+    std::vector<HapEncodeSegment> segments_;     // the pieces of encoded_ and buffers_ making a frame
+    unsigned int segmentCount_{ 0 };
+    bool converted_{ false };                    // buffers_ hold this frame's textures
+    int64_t frame_{ -1 };                        // this frame's number in traces
+
+    HapEncoderTimings timings_;
+};
+
+// The textures of a codec at one frame size, as a HapEncoder encodes them: their converters and
+// chunks, and the data rate of the frames encoded at that size. A HapEncoder has one for its own
+// frame size and one for each of its proxies, which are not host encoders.
+
+class HapEncoderTextures
+{
+public:
+    // chunkCounts as the host gives them, 0, 0 for auto
+    HapEncoderTextures(FrameSize frameSize, Codec4CC subType, HapChunkCounts chunkCounts,
+        SquishEncoderQuality quality, ThreadPool* threadPool);
+
+    HapEncoderTextures(const HapEncoderTextures&) = delete;
+    HapEncoderTextures& operator=(const HapEncoderTextures&) = delete;
+
+    std::unique_ptr<HapEncoderJob> createJob(
+        std::array<unsigned int, 2> compressors,
+        ThreadPool* threadPool,
+        BufferPool* bufferPool,
+        std::vector<std::unique_ptr<HapEncoderJob>> proxies);
 
-    std::vector<uint8_t> rgbaTopLeftOrigin_;       // for squish
+    const FrameSize& frameSize() const { return frameSize_; }
+    const HapChunkCounts& chunkCounts() const { return chunkCounts_; }
+    HapFrameSizeEstimate frameSizeEstimate() const;
+    HapDataRateStats dataRateStats() const { return dataRate_.stats(); }
 
-    // not all of these are used by all codecs
-    std::vector<uint8_t> ycocg_;                   // for ycog -> ycog_dxt
-    std::array<std::vector<uint8_t>, 2> buffers_;  // for hap_encode
+    void enableBlockReuse();
+    bool reusesBlocks() const { return blockReuse_ != nullptr; }
+    BlockReuseStats blockReuseStats() const;
+
+private:
+    FrameSize frameSize_;
+    Codec4CC subType_;
+	std::unique_ptr<BlockReuseCache> blockReuse_;   // null unless enabled
+	DataRateMeter dataRate_;                   // shared by all jobs
+	unsigned int count_;
+	HapChunkCounts chunkCounts_;
+	std::array<unsigned int, 2> textureFormats_;
+	std::array<std::unique_ptr<TextureConverter>, 2> converters_;
+    std::array<unsigned long, 2> sizes_;
+    size_t maxEncodedSize_;
 };
 
 // Instantiate once per input frame definition
@@ -61,13 +187,96 @@ public:
 
     virtual std::unique_ptr<EncoderJob> create() override;
 
+    BufferPoolStats bufferPoolStats() const { return bufferPool_.stats(); }
+
+    // compress only the blocks that changed since the previous frame, for jobs created from now
+    // on. Also enabled by setting HAP_ENCODER_REUSE_BLOCKS to 1.
+    void enableBlockReuse();
+    BlockReuseStats blockReuseStats() const;
+
+    // compress in full only the chunks that samples of them show will shrink, storing the rest
+    // uncompressed, for jobs created from now on; see HapCompressorSnappySampled. How chunks were
+    // stored is counted in dataRateStats. Also enabled by setting HAP_ENCODER_SAMPLE_CHUNKS to 1.
+    void enableChunkSampling();
+
+    // trace the stages of every frame until the encoder is destroyed, then write the trace and a
+    // summary of it to files starting with prefix; see TraceSession. Also enabled by setting
+    // HAP_ENCODER_TRACE to the prefix.
+    void enableTracing(const std::string& prefix);
+    const TraceSession* traceSession() const { return trace_.get(); }   // null unless enabled
+
+    // chunks per texture as written, after choosing them for 'auto' or reducing them to divide
+    // each texture's blocks evenly
+    const HapChunkCounts& chunkCounts() const { return textures_.chunkCounts(); }
+
+    // the size of this encoder's frames, predicted from those encoded so far in the process
+    HapFrameSizeEstimate frameSizeEstimate() const { return textures_.frameSizeEstimate(); }
+
+    // the size of the frames its jobs have encoded so far
+    HapDataRateStats dataRateStats() const { return textures_.dataRateStats(); }
+
+    // the size of frames of frameSize in subType, with one chunk per texture
+    static HapFrameSizeEstimate estimateFrameSize(const FrameSize& frameSize, Codec4CC subType);
+
+    // also encode every frame at half size, and at half that, and so on for count proxies, for
+    // jobs created from now on; see HapEncoderJob::proxy. Each proxy is reduced from the one
+    // before, so the host renders a frame once for all of them. The proxies have the codec,
+    // quality, requested chunks and settings of this encoder.
+    void enableProxies(unsigned int count);
+    size_t proxyCount() const { return proxies_.size(); }
+    const HapEncoderTextures& proxy(size_t i) const { return *proxies_[i]; }
+
 private:
-    static std::array<unsigned int, 2> getTextureFormats(Codec4CC subType);
+    std::unique_ptr<HapEncoderJob> createJob();
 
-	unsigned int count_;
-	HapChunkCounts chunkCounts_;
-	std::array<unsigned int, 2> textureFormats_;
+	std::unique_ptr<TraceSession> trace_;      // null unless enabled; written once the pool has stopped
+	std::unique_ptr<ThreadPool> threadPool_;   // shared by all jobs and proxies; must outlive converters
+	BufferPool bufferPool_;                    // shared by all jobs and proxies, which must not outlive it
 	std::array<unsigned int, 2> compressors_;
-	std::array<std::unique_ptr<TextureConverter>, 2> converters_;
-    std::array<unsigned long, 2> sizes_;
+	HapEncoderTextures textures_;
+    std::vector<std::unique_ptr<HapEncoderTextures>> proxies_;   // each half the size of the one before
+};
+
+// Placeholders for inputs, processing and outputs for decode process
+
+class HapDecoderJob : public DecoderJob
+{
+public:
+    HapDecoderJob(FrameSize frameSize, ThreadPool* threadPool);
+    ~HapDecoderJob() {}
+
+    // the stages are public so that tools can drive a job directly, outside of a host
+    virtual void doDecode(const DecodeInput& in) override;
+    virtual void doCopyLocalToExternal(
+        uint8_t* data,
+        size_t stride,
+        FrameFormat format) override;
+
+private:
+    FrameSize frameSize_;
+    ThreadPool* threadPool_;
+
+    // a movie's frames all have the same textures, so decoders are made for the first frame
+    // and only replaced if the formats change
+    unsigned int count_;
+    std::array<unsigned int, 2> textureFormats_;
+    std::array<std::unique_ptr<TextureDecoder>, 2> decoders_;
+
+    std::array<std::vector<uint8_t>, 2> buffers_;  // from hap_decode
+    std::vector<uint8_t> rgbaTopLeftOrigin_;
+};
+
+// Instantiate once per input movie
+//
+
+class HapDecoder : public Decoder
+{
+public:
+    HapDecoder(std::unique_ptr<DecoderParametersBase>& params);
+    ~HapDecoder();
+
+    virtual std::unique_ptr<DecoderJob> create() override;
+
+private:
+    std::unique_ptr<ThreadPool> threadPool_;   // shared by all jobs
 };
@@ -0,0 +1,78 @@
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "data_rate.hpp"
+
+// frames of a subtype that must have been encoded before their compression ratio is relied on
+static const unsigned int kMinSampleFrames = 4;
+
+// frames of every encoder in the process, by subtype
+static std::mutex sampleMutex;
+static std::vector<std::pair<Codec4CC, HapDataRateStats>> samples;
+
+static HapDataRateStats& sampleFor(Codec4CC subType)
+{
+    for (auto& sample : samples)
+    {
+        if (sample.first == subType)
+            return sample.second;
+    }
+    samples.emplace_back(subType, HapDataRateStats{});
+    return samples.back().second;
+}
+
+static void accumulate(HapDataRateStats& stats, size_t textureBytes, size_t encodedBytes, const HapEncodeChunkStats& chunks)
+{
+    ++stats.frames;
+    stats.textureBytes += textureBytes;
+    stats.encodedBytes += encodedBytes;
+    stats.peakFrameBytes = std::max(stats.peakFrameBytes, encodedBytes);
+    stats.compressedChunks += chunks.compressedChunks;
+    stats.storedChunks += chunks.storedChunks;
+    stats.skippedChunks += chunks.skippedChunks;
+    stats.sampledBytes += chunks.sampledBytes;
+    stats.skippedBytes += chunks.skippedBytes;
+}
+
+void DataRateMeter::record(size_t textureBytes, size_t encodedBytes, const HapEncodeChunkStats& chunks)
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        accumulate(stats_, textureBytes, encodedBytes, chunks);
+    }
+
+    std::lock_guard<std::mutex> guard(sampleMutex);
+    accumulate(sampleFor(subType_), textureBytes, encodedBytes, chunks);
+}
+
+HapDataRateStats DataRateMeter::stats() const
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    return stats_;
+}
+
+HapFrameSizeEstimate estimateFrameSize(Codec4CC subType, size_t textureBytes, size_t maxFrameBytes)
+{
+    HapDataRateStats sample;
+    {
+        std::lock_guard<std::mutex> guard(sampleMutex);
+        sample = sampleFor(subType);
+    }
+
+    HapFrameSizeEstimate estimate;
+    estimate.textureBytes = textureBytes;
+    estimate.maxFrameBytes = maxFrameBytes;
+    if (sample.frames >= kMinSampleFrames)
+    {
+        estimate.compressionRatio = sample.compressionRatio();
+        estimate.predictedFrameBytes = std::min(textureBytes / estimate.compressionRatio, (double)maxFrameBytes);
+    }
+    else
+    {
+        // as though no chunk compressed; chunks that would grow are stored uncompressed
+        estimate.compressionRatio = 1.0;
+        estimate.predictedFrameBytes = (double)textureBytes;
+    }
+    return estimate;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+// the size of encoded frames: predicted before encoding, so that hosts can show the data-rate of
+// an export, and measured while encoding, so that it can be checked against the read bandwidth of
+// the machines that will play it back
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#include "codec_registration.hpp"
+#include "hap.h"
+
+struct HapFrameSizeEstimate
+{
+    size_t textureBytes{ 0 };           // every frame's textures before chunk compression; exact
+    size_t maxFrameBytes{ 0 };          // no encoded frame can be larger
+    double compressionRatio{ 1.0 };     // predicted, of texture bytes to encoded bytes; 1 until
+                                        // frames of the subtype have been sampled
+    double predictedFrameBytes{ 0.0 };  // textureBytes at compressionRatio
+};
+
+// Sizes of the frames encoded so far
+
+struct HapDataRateStats
+{
+    unsigned int frames{ 0 };
+    uint64_t textureBytes{ 0 };    // before chunk compression
+    uint64_t encodedBytes{ 0 };    // as written, headers included
+    size_t peakFrameBytes{ 0 };    // the largest frame written
+
+    // chunks by how they were stored; see HapEncodeChunkStats
+    uint64_t compressedChunks{ 0 };
+    uint64_t storedChunks{ 0 };    // after compressing them in full
+    uint64_t skippedChunks{ 0 };   // on the evidence of samples
+    uint64_t sampledBytes{ 0 };
+    uint64_t skippedBytes{ 0 };
+
+    double meanFrameBytes() const { return frames ? double(encodedBytes) / frames : 0.0; }
+    double compressionRatio() const { return encodedBytes ? double(textureBytes) / encodedBytes : 1.0; }
+};
+
+// Accumulates the sizes of an encoder's frames, from all of its jobs. The frames also refine the
+// compression ratio predicted for later estimates of the same subtype.
+class DataRateMeter
+{
+public:
+    explicit DataRateMeter(Codec4CC subType) : subType_(subType) {}
+
+    DataRateMeter(const DataRateMeter&) = delete;
+    DataRateMeter& operator=(const DataRateMeter&) = delete;
+
+    // may be called from several threads at once
+    void record(size_t textureBytes, size_t encodedBytes, const HapEncodeChunkStats& chunks);
+
+    HapDataRateStats stats() const;
+
+private:
+    Codec4CC subType_;
+    mutable std::mutex mutex_;
+    HapDataRateStats stats_;
+};
+
+// The size of frames of subType whose textures take textureBytes, at the chunk compression ratio of
+// the frames encoded with subType so far in this process, once there are enough to go on
+HapFrameSizeEstimate estimateFrameSize(Codec4CC subType, size_t textureBytes, size_t maxFrameBytes);
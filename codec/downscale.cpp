@@ -0,0 +1,59 @@
+#include <algorithm>
+#include <smmintrin.h>
+
+#include "downscale.hpp"
+#include "thread_pool.hpp"
+
+// the rounded means of the 2x2 boxes of the eight pixels at top and bottom, as four pixels
+static inline __m128i halveEight(const uint8_t* top, const uint8_t* bottom)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+
+    __m128i half[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        __m128i upper = _mm_loadu_si128((const __m128i*)(top + i * 16));
+        __m128i lower = _mm_loadu_si128((const __m128i*)(bottom + i * 16));
+
+        // pixels 0, 1 and 2, 3 summed over the two rows
+        __m128i first = _mm_add_epi16(_mm_unpacklo_epi8(upper, zero), _mm_unpacklo_epi8(lower, zero));
+        __m128i second = _mm_add_epi16(_mm_unpackhi_epi8(upper, zero), _mm_unpackhi_epi8(lower, zero));
+
+        // and across each pair
+        __m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(first, second), _mm_unpackhi_epi64(first, second));
+        half[i] = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+    }
+    return _mm_packus_epi16(half[0], half[1]);
+}
+
+static void halveRow(const uint8_t* top, const uint8_t* bottom, int width, uint8_t* output)
+{
+    int x = 0;
+    for (; x + 8 <= width; x += 8)
+        _mm_storeu_si128((__m128i*)(output + x * 2), halveEight(top + x * 4, bottom + x * 4));
+
+    for (; x < width; x += 2)
+    {
+        int right = std::min(x + 1, width - 1);
+        for (int c = 0; c < 4; ++c)
+        {
+            int sum = top[x * 4 + c] + top[right * 4 + c] + bottom[x * 4 + c] + bottom[right * 4 + c];
+            output[x * 2 + c] = (uint8_t)((sum + 2) >> 2);
+        }
+    }
+}
+
+void halveFrame(const uint8_t* source, ptrdiff_t stride, int width, int height,
+    uint8_t* output, size_t outputStride, ThreadPool* pool)
+{
+    int outputHeight = (height + 1) / 2;
+    parallelForBlockRows(pool, outputHeight, [&](int firstRow, int rowCount) {
+        for (int y = firstRow; y < firstRow + rowCount; ++y)
+        {
+            const uint8_t* top = source + (ptrdiff_t)(y * 2) * stride;
+            const uint8_t* bottom = source + (ptrdiff_t)std::min(y * 2 + 1, height - 1) * stride;
+            halveRow(top, bottom, width, output + y * outputStride);
+        }
+    });
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+// reduced copies of frames, for proxies encoded alongside the full-size frame
+
+#include <cstddef>
+#include <cstdint>
+
+class ThreadPool;
+
+// Halve height rows of width 8-bit, four-channel pixels at source, whose rows are stride bytes
+// apart (negative when they run bottom up), to (width + 1) / 2 by (height + 1) / 2 pixels at
+// output, outputStride bytes apart, keeping the channel order. Each pixel is the rounded mean of
+// a 2x2 box, eight source pixels at a time with SSE; a last odd column or row is averaged with
+// itself. Rows are spread across pool, which may be null.
+void halveFrame(const uint8_t* source, ptrdiff_t stride, int width, int height,
+    uint8_t* output, size_t outputStride, ThreadPool* pool);
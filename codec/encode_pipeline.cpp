@@ -0,0 +1,256 @@
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <stdexcept>
+
+#include "encode_pipeline.hpp"
+#include "trace.hpp"
+
+// jobs passed between stages, recording how long the consumer waited and how deep the queue ran
+class HapEncodePipeline::JobQueue
+{
+public:
+    // waits in pop are traced as waitName
+    explicit JobQueue(const char* waitName) : waitName_(waitName) {}
+
+    // false, leaving job with the caller, once the queue has been aborted
+    bool push(HapEncoderJob* job)
+    {
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            if (aborted_)
+                return false;
+            depthSum_ += jobs_.size();
+            maxDepth_ = std::max(maxDepth_, (unsigned int)jobs_.size());
+            ++pushes_;
+            jobs_.push_back(job);
+        }
+        ready_.notify_one();
+        return true;
+    }
+
+    // the next job, or nullptr once the queue is closed and empty, or aborted
+    HapEncoderJob* pop()
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(mutex_);
+        {
+            TraceScope wait(waitName_);
+            ready_.wait(lock, [&] { return closed_ || aborted_ || !jobs_.empty(); });
+        }
+        stalled_ += std::chrono::steady_clock::now() - start;
+
+        if (aborted_ || jobs_.empty())
+            return nullptr;
+        HapEncoderJob* job = jobs_.front();
+        jobs_.pop_front();
+        return job;
+    }
+
+    // no more jobs will be pushed; those queued are still popped
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            closed_ = true;
+        }
+        ready_.notify_all();
+    }
+
+    // the pipeline has failed: jobs queued are dropped, and no more are taken
+    void abort()
+    {
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            aborted_ = true;
+        }
+        ready_.notify_all();
+    }
+
+    std::chrono::steady_clock::duration stalled() const
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        return stalled_;
+    }
+
+    double meanDepth() const
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        return pushes_ ? double(depthSum_) / pushes_ : 0.0;
+    }
+
+    unsigned int maxDepth() const
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        return maxDepth_;
+    }
+
+private:
+    const char* waitName_;
+    mutable std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<HapEncoderJob*> jobs_;
+    bool closed_{ false };
+    bool aborted_{ false };
+
+    std::chrono::steady_clock::duration stalled_{};
+    size_t depthSum_{ 0 };
+    size_t pushes_{ 0 };
+    unsigned int maxDepth_{ 0 };
+};
+
+HapEncodePipeline::HapEncodePipeline(HapEncoder& encoder, unsigned int depth, std::function<void(const EncodeOutput&)> output)
+    : output_(std::move(output)),
+      free_(std::make_unique<JobQueue>("wait for job")),
+      toConvert_(std::make_unique<JobQueue>("wait to convert")),
+      toPack_(std::make_unique<JobQueue>("wait to pack")),
+      finished_(false)
+{
+    if (depth == 0)
+        throw std::runtime_error("pipeline depth must be at least 1");
+
+    for (unsigned int i = 0; i < depth; ++i)
+    {
+        jobs_.push_back(encoder.create());
+        free_->push(static_cast<HapEncoderJob*>(jobs_.back().get()));
+    }
+
+    converter_ = std::thread(&HapEncodePipeline::convertLoop, this);
+    packer_ = std::thread(&HapEncodePipeline::packLoop, this);
+}
+
+HapEncodePipeline::~HapEncodePipeline()
+{
+    if (!finished_)
+    {
+        free_->close();
+        toConvert_->close();
+        toPack_->close();
+        converter_.join();
+        packer_.join();
+    }
+}
+
+void HapEncodePipeline::push(const uint8_t* data, size_t stride, FrameFormat format)
+{
+    if (finished_)
+        throw std::runtime_error("pipeline has finished");
+
+    // a failed pipeline takes no more frames, reporting the failure instead
+    {
+        std::lock_guard<std::mutex> guard(errorMutex_);
+        if (error_)
+            std::rethrow_exception(error_);
+    }
+
+    HapEncoderJob* job = free_->pop();
+    if (!job)
+        rethrowError();
+
+    try
+    {
+        job->doCopyExternalToLocal(data, stride, format);
+    }
+    catch (...)
+    {
+        free_->push(job);
+        throw;
+    }
+    if (!toConvert_->push(job))
+        rethrowError();
+}
+
+void HapEncodePipeline::finish()
+{
+    if (finished_)
+        return;
+    finished_ = true;
+
+    toConvert_->close();
+    converter_.join();
+    packer_.join();
+
+    std::lock_guard<std::mutex> guard(errorMutex_);
+    if (error_)
+        std::rethrow_exception(error_);
+}
+
+void HapEncodePipeline::convertLoop()
+{
+    try
+    {
+        while (HapEncoderJob* job = toConvert_->pop())
+        {
+            job->doConvert();
+            if (!toPack_->push(job))
+                break;
+        }
+    }
+    catch (...)
+    {
+        fail();
+    }
+    toPack_->close();
+}
+
+void HapEncodePipeline::packLoop()
+{
+    try
+    {
+        EncodeOutput out;
+        while (HapEncoderJob* job = toPack_->pop())
+        {
+            job->doPack(out);
+            TraceScope scope("output");
+            output_(out);
+            if (!free_->push(job))
+                break;
+        }
+    }
+    catch (...)
+    {
+        fail();
+    }
+}
+
+// records the exception being handled and stops every stage, dropping the frames in flight
+void HapEncodePipeline::fail()
+{
+    {
+        std::lock_guard<std::mutex> guard(errorMutex_);
+        if (!error_)
+            error_ = std::current_exception();
+    }
+    free_->abort();
+    toConvert_->abort();
+    toPack_->abort();
+}
+
+void HapEncodePipeline::rethrowError()
+{
+    std::lock_guard<std::mutex> guard(errorMutex_);
+    if (error_)
+        std::rethrow_exception(error_);
+    throw std::runtime_error("pipeline has stopped");
+}
+
+HapEncodePipelineStats HapEncodePipeline::stats() const
+{
+    HapEncodePipelineStats stats;
+    stats.copyStall = free_->stalled();
+    stats.convertStall = toConvert_->stalled();
+    stats.packStall = toPack_->stalled();
+    stats.convertQueueMean = toConvert_->meanDepth();
+    stats.convertQueueMax = toConvert_->maxDepth();
+    stats.packQueueMean = toPack_->meanDepth();
+    stats.packQueueMax = toPack_->maxDepth();
+    return stats;
+}
+
+HapEncoderTimings HapEncodePipeline::timings() const
+{
+    HapEncoderTimings timings;
+    for (const auto& job : jobs_)
+        timings += static_cast<const HapEncoderJob&>(*job).timings();
+    return timings;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+// encodes a stream of frames through HapEncoderJobs with host copy, conversion and packing
+// overlapped, for hosts and tools that hand over frames one after another
+
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "codec.hpp"
+
+// Where a pipeline's stages spent their time waiting, and how full the queues between them ran
+
+struct HapEncodePipelineStats
+{
+    std::chrono::steady_clock::duration copyStall{};     // push waiting for a free job; the pipeline was full
+    std::chrono::steady_clock::duration convertStall{};  // conversion waiting for a copied frame
+    std::chrono::steady_clock::duration packStall{};     // packing waiting for a converted frame
+    double convertQueueMean{ 0.0 };   // frames waiting for conversion, as each frame arrived
+    unsigned int convertQueueMax{ 0 };
+    double packQueueMean{ 0.0 };      // frames waiting for packing, as each frame arrived
+    unsigned int packQueueMax{ 0 };
+};
+
+// Frame N + 1 is copied on the caller's thread while frame N is converted to textures on one
+// thread and frame N - 1 is compressed and packed on another; conversion and compression still
+// spread across the encoder's thread pool. Frames are passed to output in the order pushed.
+
+class HapEncodePipeline
+{
+public:
+    // depth is the number of frames in flight, at least 1; output is called on the packing thread
+    HapEncodePipeline(HapEncoder& encoder, unsigned int depth, std::function<void(const EncodeOutput&)> output);
+    ~HapEncodePipeline();
+
+    HapEncodePipeline(const HapEncodePipeline&) = delete;
+    HapEncodePipeline& operator=(const HapEncodePipeline&) = delete;
+
+    // copies the host frame and queues it for encoding, waiting while depth frames are in flight.
+    // An exception from an earlier frame's encoding or output stops the pipeline, dropping the frames in
+    // flight, and is rethrown by every later push and by finish.
+    void push(const uint8_t* data, size_t stride, FrameFormat format);
+
+    // waits until every pushed frame has been output
+    void finish();
+
+    // once finished
+    HapEncodePipelineStats stats() const;
+    HapEncoderTimings timings() const;   // over every job in the pipeline
+
+private:
+    class JobQueue;
+
+    void convertLoop();
+    void packLoop();
+    void fail();
+    void rethrowError();
+
+    std::vector<std::unique_ptr<EncoderJob>> jobs_;
+    std::function<void(const EncodeOutput&)> output_;
+
+    std::unique_ptr<JobQueue> free_;
+    std::unique_ptr<JobQueue> toConvert_;
+    std::unique_ptr<JobQueue> toPack_;
+
+    mutable std::mutex errorMutex_;
+    std::exception_ptr error_;
+
+    std::thread converter_;
+    std::thread packer_;
+    bool finished_;
+};
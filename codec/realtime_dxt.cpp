@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <cstring>
+#include <smmintrin.h>
+
+#include "realtime_dxt.hpp"
+
+static const int kInsetColourShift = 4;   // inset colour bounding box
+static const int kInsetAlphaShift = 5;    // inset alpha bounding box
+
+// loads the 4x4 block at column x of a strip of rows, one row per register
+static inline void loadBlock(const uint8_t* rgba, size_t stride, int x, int width, int rows, __m128i block[4])
+{
+    if (x + 4 <= width && rows == 4)
+    {
+        for (int j = 0; j < 4; ++j)
+            block[j] = _mm_loadu_si128((const __m128i*)(rgba + j * stride + x * 4));
+        return;
+    }
+
+    alignas(16) uint8_t pixels[64];
+    for (int j = 0; j < 4; ++j)
+    {
+        const uint8_t* row = rgba + std::min(j, rows - 1) * stride;
+        for (int i = 0; i < 4; ++i)
+            std::memcpy(pixels + j * 16 + i * 4, row + std::min(x + i, width - 1) * 4, 4);
+    }
+    for (int j = 0; j < 4; ++j)
+        block[j] = _mm_load_si128((const __m128i*)(pixels + j * 16));
+}
+
+static inline int to565(const int colour[3])
+{
+    return ((colour[0] >> 3) << 11) | ((colour[1] >> 2) << 5) | (colour[2] >> 3);
+}
+
+// the colour the decoder gives for a 565 endpoint
+static inline void from565(int value, int colour[3])
+{
+    int red = (value >> 11) & 0x1f;
+    int green = (value >> 5) & 0x3f;
+    int blue = value & 0x1f;
+
+    colour[0] = (red << 3) | (red >> 2);
+    colour[1] = (green << 2) | (green >> 4);
+    colour[2] = (blue << 3) | (blue >> 2);
+}
+
+static inline void emitColourBlock(const __m128i block[4], uint8_t* out)
+{
+    // bounding box of the block's colours
+    __m128i lo = _mm_min_epu8(_mm_min_epu8(block[0], block[1]), _mm_min_epu8(block[2], block[3]));
+    __m128i hi = _mm_max_epu8(_mm_max_epu8(block[0], block[1]), _mm_max_epu8(block[2], block[3]));
+    lo = _mm_min_epu8(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(1, 0, 3, 2)));
+    hi = _mm_max_epu8(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(1, 0, 3, 2)));
+    lo = _mm_min_epu8(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+    hi = _mm_max_epu8(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 3, 0, 1)));
+    uint32_t loPixel = (uint32_t)_mm_cvtsi128_si32(lo);
+    uint32_t hiPixel = (uint32_t)_mm_cvtsi128_si32(hi);
+
+    int minColour[3], maxColour[3];
+    for (int c = 0; c < 3; ++c)
+    {
+        int low = (loPixel >> (8 * c)) & 0xff;
+        int high = (hiPixel >> (8 * c)) & 0xff;
+        int inset = (high - low) >> kInsetColourShift;
+        minColour[c] = low + inset;
+        maxColour[c] = high - inset;
+    }
+
+    // max is never below min, so the decoder always uses four colours
+    int colour0 = to565(maxColour);
+    int colour1 = to565(minColour);
+
+    int palette[4][3];
+    from565(colour0, palette[0]);
+    from565(colour1, palette[1]);
+    int direction[3];
+    for (int c = 0; c < 3; ++c)
+    {
+        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        direction[c] = palette[0][c] - palette[1][c];
+    }
+
+    // positions of the palette along the diagonal, and the points halfway between them
+    int stops[4];
+    for (int i = 0; i < 4; ++i)
+        stops[i] = palette[i][0] * direction[0] + palette[i][1] * direction[1] + palette[i][2] * direction[2];
+    __m128i between13 = _mm_set1_epi32(stops[1] + stops[3]);
+    __m128i between32 = _mm_set1_epi32(stops[3] + stops[2]);
+    __m128i between20 = _mm_set1_epi32(stops[2] + stops[0]);
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i axis = _mm_setr_epi16(
+        (short)direction[0], (short)direction[1], (short)direction[2], 0,
+        (short)direction[0], (short)direction[1], (short)direction[2], 0);
+
+    // index 1, 3, 2 or 0 as the pixel lies further along the diagonal
+    __m128i indices[4];
+    for (int j = 0; j < 4; ++j)
+    {
+        __m128i dots = _mm_hadd_epi32(
+            _mm_madd_epi16(_mm_unpacklo_epi8(block[j], zero), axis),
+            _mm_madd_epi16(_mm_unpackhi_epi8(block[j], zero), axis));
+        dots = _mm_slli_epi32(dots, 1);
+
+        __m128i below13 = _mm_cmplt_epi32(dots, between13);
+        __m128i below32 = _mm_cmplt_epi32(dots, between32);
+        __m128i below20 = _mm_cmplt_epi32(dots, between20);
+        indices[j] = _mm_or_si128(
+            _mm_and_si128(_mm_xor_si128(below20, below13), _mm_set1_epi32(2)),
+            _mm_and_si128(below32, _mm_set1_epi32(1)));
+    }
+
+    // 2 bits per pixel, a byte per row
+    __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(indices[0], indices[1]), _mm_packs_epi32(indices[2], indices[3]));
+    __m128i pairs = _mm_maddubs_epi16(bytes, _mm_set1_epi16(0x0401));
+    __m128i rows = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00100001));
+    rows = _mm_packus_epi16(_mm_packs_epi32(rows, rows), rows);
+    uint32_t packed = (uint32_t)_mm_cvtsi128_si32(rows);
+
+    out[0] = (uint8_t)colour0;
+    out[1] = (uint8_t)(colour0 >> 8);
+    out[2] = (uint8_t)colour1;
+    out[3] = (uint8_t)(colour1 >> 8);
+    std::memcpy(out + 4, &packed, 4);
+}
+
+static inline void emitAlphaBlock(const __m128i block[4], uint8_t* out)
+{
+    // the block's alphas in pixel order
+    __m128i alphas = _mm_setzero_si128();
+    for (int j = 0; j < 4; ++j)
+    {
+        const int alphaBytes = 0x0f0b0703;
+        __m128i gather = _mm_setr_epi32(
+            (j == 0) ? alphaBytes : -1, (j == 1) ? alphaBytes : -1, (j == 2) ? alphaBytes : -1, (j == 3) ? alphaBytes : -1);
+        alphas = _mm_or_si128(alphas, _mm_shuffle_epi8(block[j], gather));
+    }
+
+    __m128i lo = _mm_min_epu8(alphas, _mm_srli_si128(alphas, 8));
+    __m128i hi = _mm_max_epu8(alphas, _mm_srli_si128(alphas, 8));
+    lo = _mm_min_epu8(lo, _mm_srli_si128(lo, 4));
+    hi = _mm_max_epu8(hi, _mm_srli_si128(hi, 4));
+    lo = _mm_min_epu8(lo, _mm_srli_si128(lo, 2));
+    hi = _mm_max_epu8(hi, _mm_srli_si128(hi, 2));
+    lo = _mm_min_epu8(lo, _mm_srli_si128(lo, 1));
+    hi = _mm_max_epu8(hi, _mm_srli_si128(hi, 1));
+    int low = _mm_cvtsi128_si32(lo) & 0xff;
+    int high = _mm_cvtsi128_si32(hi) & 0xff;
+
+    int inset = (high - low) >> kInsetAlphaShift;
+    int alpha0 = high - inset;
+    int alpha1 = low + inset;
+
+    // the eight-alpha palette in ascending order, and the count of the points halfway between its
+    // entries that each pixel reaches gives its place in that order
+    int values[8];
+    for (int k = 0; k < 8; ++k)
+        values[k] = (k * alpha0 + (7 - k) * alpha1) / 7;
+
+    __m128i place = _mm_setzero_si128();
+    for (int k = 1; k < 8; ++k)
+    {
+        __m128i threshold = _mm_set1_epi8((char)((values[k - 1] + values[k] + 1) / 2));
+        __m128i reached = _mm_cmpeq_epi8(_mm_max_epu8(alphas, threshold), alphas);
+        place = _mm_sub_epi8(place, reached);
+    }
+    __m128i codes = _mm_shuffle_epi8(_mm_setr_epi8(1, 7, 6, 5, 4, 3, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0), place);
+
+    // 3 bits per pixel, 12 bits per row
+    __m128i pairs = _mm_maddubs_epi16(codes, _mm_set1_epi16(0x0801));
+    __m128i rows = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00400001));
+    alignas(16) uint32_t rowBits[4];
+    _mm_store_si128((__m128i*)rowBits, rows);
+    uint64_t packed = (uint64_t)rowBits[0] | ((uint64_t)rowBits[1] << 12)
+        | ((uint64_t)rowBits[2] << 24) | ((uint64_t)rowBits[3] << 36);
+
+    out[0] = (uint8_t)alpha0;
+    out[1] = (uint8_t)alpha1;
+    for (int i = 0; i < 6; ++i)
+        out[2 + i] = (uint8_t)(packed >> (8 * i));
+}
+
+void compressRealtimeDxt1(const uint8_t* rgba, int width, int height, size_t stride, uint8_t* blocks)
+{
+    for (int y = 0; y < height; y += 4, rgba += 4 * stride)
+    {
+        int rows = std::min(4, height - y);
+        for (int x = 0; x < width; x += 4, blocks += 8)
+        {
+            __m128i block[4];
+            loadBlock(rgba, stride, x, width, rows, block);
+            emitColourBlock(block, blocks);
+        }
+    }
+}
+
+void compressRealtimeDxt5(const uint8_t* rgba, int width, int height, size_t stride, uint8_t* blocks)
+{
+    for (int y = 0; y < height; y += 4, rgba += 4 * stride)
+    {
+        int rows = std::min(4, height - y);
+        for (int x = 0; x < width; x += 4, blocks += 16)
+        {
+            __m128i block[4];
+            loadBlock(rgba, stride, x, width, rows, block);
+            emitAlphaBlock(block, blocks);
+            emitColourBlock(block, blocks + 8);
+        }
+    }
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+// real-time DXT1 and DXT5 compression, in the manner of J.M.P. van Waveren's "Real-Time DXT
+// Compression" and stb_dxt, for when speed matters far more than quality
+
+#include <cstddef>
+#include <cstdint>
+
+// Compress the height rows of 8-bit rgba at rgba, which are stride bytes apart, to consecutive
+// blocks at blocks. Blocks that overhang the image repeat its last row and column.
+//
+// Endpoints are the inset bounding box of each block's colours, and pixels are given the nearest
+// palette entry along the box's diagonal, all in integer SSE. The DXT1 encoder ignores alpha, as
+// the squish qualities of DXT1 do (see SquishTextureConverter), and emits only four-colour blocks.
+void compressRealtimeDxt1(const uint8_t* rgba, int width, int height, size_t stride, uint8_t* blocks);
+void compressRealtimeDxt5(const uint8_t* rgba, int width, int height, size_t stride, uint8_t* blocks);
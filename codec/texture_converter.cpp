@@ -1,6 +1,14 @@
+#include <algorithm>
+#include <cstring>
+#include <smmintrin.h>
 #include <stdexcept>
 
 #include "texture_converter.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+#include "realtime_dxt.hpp"
+#include "bc7.hpp"
+#include "cluster_fit.hpp"
 #include "hap.h"
 #include "squish.h"
 
@@ -19,8 +27,8 @@ static int roundUpToMultipleOf4(int n)
 class SquishTextureConverter : public TextureConverter
 {
 public:
-	SquishTextureConverter(const FrameSize& frameSize, int squishFlags)
-		: TextureConverter(frameSize), squishFlags_(squishFlags)
+	SquishTextureConverter(const FrameSize& frameSize, ThreadPool* pool, int squishFlags)
+		: TextureConverter(frameSize, pool), squishFlags_(squishFlags), opaque_((squishFlags & squish::kDxt1) != 0)
 	{}
 	virtual ~SquishTextureConverter() {};
 
@@ -30,26 +38,139 @@ private:
         return squish::GetStorageRequirements(frameSize().width, frameSize().height, squishFlags_);
     }
 
-	virtual void doConvert(
-		const uint8_t* in_rgba,
-		std::vector<uint8_t> &ycocg,
-		std::vector<uint8_t> &outputBuffer) override
+	virtual void doConvertBlocks(
+		const SourceFrame& source,
+		int row, int rowCount,
+		int firstBlock, int blockCount,
+		uint8_t* output) const override
 	{
-		outputBuffer.resize(size());
+		int width = frameSize().width;
+		size_t bytesPerBlockRow = squish::GetStorageRequirements(width, 4, squishFlags_);
+		size_t bytesPerBlock = squish::GetStorageRequirements(4, 4, squishFlags_);
 
-		void *blocks = &(outputBuffer[0]);
-		float *metric = nullptr;
-		squish::CompressImage(in_rgba, frameSize().width, frameSize().height, blocks, squishFlags_, metric);
+		// each block is gathered from the source as squish::CompressImage would gather it from
+		// packed rgba, so the blocks are the same
+		uint8_t* block = output + (row / 4) * bytesPerBlockRow + firstBlock * bytesPerBlock;
+		if (usesClusterFit())
+		{
+			// a run of blocks at a time, for compressClusterFit to search in parallel
+			const int kRunBlocks = 16;
+			alignas(16) uint8_t rgba[kRunBlocks][64];
+			int masks[kRunBlocks];
+			for (int b = firstBlock; b < firstBlock + blockCount; b += kRunBlocks)
+			{
+				int runBlocks = std::min(kRunBlocks, firstBlock + blockCount - b);
+				for (int i = 0; i < runBlocks; ++i)
+					masks[i] = gatherBlock(source, (b + i) * 4, row, std::min(4, width - (b + i) * 4), rowCount, rgba[i], opaque_);
+				compressClusterFit(rgba, masks, runBlocks, block, squishFlags_);
+				block += runBlocks * bytesPerBlock;
+			}
+			return;
+		}
+		for (int b = firstBlock; b < firstBlock + blockCount; ++b, block += bytesPerBlock)
+		{
+			alignas(16) uint8_t rgba[64];
+			int mask = gatherBlock(source, b * 4, row, std::min(4, width - b * 4), rowCount, rgba, opaque_);
+			squish::CompressMasked(rgba, mask, block, squishFlags_, nullptr);
+		}
+	}
+
+	// the single pass cluster fit of the default quality; the iterative fit stays with squish
+	bool usesClusterFit() const
+	{
+		return (squishFlags_ & (squish::kDxt1 | squish::kDxt3 | squish::kDxt5)) != 0
+			&& (squishFlags_ & (squish::kColourRangeFit | squish::kColourIterativeClusterFit)) == 0;
 	}
 
 	int squishFlags_;
+
+	// Hap's DXT1 has no alpha, and the squish built here never emits three-colour blocks, so
+	// DXT1 gathers every pixel as opaque: squish would otherwise leave pixels of alpha below
+	// 128 out of the fit, giving them whatever palette entry index 3 holds. Realtime ignores
+	// alpha in the same way.
+	bool opaque_;
+};
+
+
+// integer SSE DXT1 or DXT5, for previews where speed matters more than quality
+class RealtimeTextureConverter : public TextureConverter
+{
+public:
+	RealtimeTextureConverter(const FrameSize& frameSize, ThreadPool* pool, bool withAlpha)
+		: TextureConverter(frameSize, pool), bytesPerBlock_(withAlpha ? 16 : 8)
+	{}
+	~RealtimeTextureConverter() {}
+
+    size_t size() const override
+    {
+        return (size_t)(roundUpToMultipleOf4(frameSize().width) / 4) * (roundUpToMultipleOf4(frameSize().height) / 4) * bytesPerBlock_;
+    }
+
+	void doConvertBlocks(
+		const SourceFrame& source,
+		int row, int rowCount,
+		int firstBlock, int blockCount,
+		uint8_t* output) const override
+	{
+		int width = frameSize().width;
+		size_t bytesPerBlockRow = (size_t)(roundUpToMultipleOf4(width) / 4) * bytesPerBlock_;
+
+		int x = firstBlock * 4;
+		int runWidth = std::min(blockCount * 4, width - x);
+		thread_local std::vector<uint8_t> run;
+		size_t rowbytes;
+		const uint8_t* rgba = rgbaRows(source, x, row, runWidth, rowCount, run, rowbytes);
+
+		auto compress = (bytesPerBlock_ == 16) ? compressRealtimeDxt5 : compressRealtimeDxt1;
+		compress(rgba, runWidth, rowCount, rowbytes, output + (row / 4) * bytesPerBlockRow + firstBlock * bytesPerBlock_);
+	}
+
+private:
+	int bytesPerBlock_;
+};
+
+
+// BC7, for Hap 7
+class Bc7TextureConverter : public TextureConverter
+{
+public:
+	Bc7TextureConverter(const FrameSize& frameSize, ThreadPool* pool, Bc7Effort effort)
+		: TextureConverter(frameSize, pool), effort_(effort)
+	{}
+	~Bc7TextureConverter() {}
+
+    size_t size() const override
+    {
+        return (size_t)(roundUpToMultipleOf4(frameSize().width) / 4) * (roundUpToMultipleOf4(frameSize().height) / 4) * 16;
+    }
+
+	void doConvertBlocks(
+		const SourceFrame& source,
+		int row, int rowCount,
+		int firstBlock, int blockCount,
+		uint8_t* output) const override
+	{
+		int width = frameSize().width;
+		size_t bytesPerBlockRow = (size_t)(roundUpToMultipleOf4(width) / 4) * 16;
+
+		int x = firstBlock * 4;
+		int runWidth = std::min(blockCount * 4, width - x);
+		thread_local std::vector<uint8_t> run;
+		size_t rowbytes;
+		const uint8_t* rgba = rgbaRows(source, x, row, runWidth, rowCount, run, rowbytes);
+
+		compressBc7(rgba, runWidth, rowCount, rowbytes, output + (row / 4) * bytesPerBlockRow + firstBlock * 16, effort_);
+	}
+
+private:
+	Bc7Effort effort_;
 };
 
 
 class TextureConverterToYCoCg_Dxt5 : public TextureConverter
 {
 public:
-	TextureConverterToYCoCg_Dxt5(const FrameSize& frameSize) : TextureConverter(frameSize) {}
+	TextureConverterToYCoCg_Dxt5(const FrameSize& frameSize, ThreadPool* pool) : TextureConverter(frameSize, pool) {}
 	~TextureConverterToYCoCg_Dxt5() {}
 
     size_t size() const override
@@ -57,32 +178,29 @@ public:
         return roundUpToMultipleOf4(frameSize().width) * roundUpToMultipleOf4(frameSize().height);
     }
 
-    void doConvert(
-		const uint8_t* in_rgba,
-		std::vector<uint8_t> &ycocg,
-		std::vector<uint8_t> &outputBuffer) override
-	{
-		int rowbytes = frameSize().width * 4;
-		ycocg.resize(rowbytes * frameSize().height);
-
-		ConvertRGB_ToCoCg_Y8888(
-			in_rgba,                // const uint8_t *src,
-			&ycocg[0],              // uint8_t *dst
-			frameSize().width,       // unsigned long width,
-			frameSize().height,      // unsigned long height,
-			rowbytes,               // size_t src_rowbytes
-			rowbytes,               // size_t dst_rowbytes,
-			false                   // int allow_tile
-		);
-
-		outputBuffer.resize(size());
-
-		CompressYCoCgDXT5(
-			&(ycocg[0]),
-			&(outputBuffer[0]),
-			frameSize().width, frameSize().height,
-			frameSize().width * 4  // stride
-		);
+	// the YCoCg pixels of each strip are still in cache when they are compressed, rather than
+	// the conversion making a full-frame pass
+	void doConvertBlocks(
+		const SourceFrame& source,
+		int row, int rowCount,
+		int firstBlock, int blockCount,
+		uint8_t* output) const override
+	{
+		int width = frameSize().width;
+		size_t bytesPerBlockRow = roundUpToMultipleOf4(width) * 4;
+
+		int x = firstBlock * 4;
+		int runWidth = std::min(blockCount * 4, width - x);
+		thread_local std::vector<uint8_t> gathered;
+		size_t rowbytes;
+		const uint8_t* rgba = rgbaRows(source, x, row, runWidth, rowCount, gathered, rowbytes);
+
+		size_t runRowbytes = (size_t)runWidth * 4;
+		thread_local std::vector<uint8_t> run;
+		run.resize(runRowbytes * 4);
+
+		ConvertRGB_ToCoCg_Y8888(rgba, &run[0], runWidth, rowCount, rowbytes, runRowbytes, false);
+		CompressYCoCgDXT5(&run[0], output + (row / 4) * bytesPerBlockRow + firstBlock * 16, runWidth, rowCount, (int)runRowbytes);
 	}
 };
 
@@ -97,7 +215,7 @@ size_t TextureConverter::size() const
 }
 
 
-std::unique_ptr<TextureConverter> TextureConverter::create(const FrameSize& frameSize, unsigned int destFormat, SquishEncoderQuality quality)
+std::unique_ptr<TextureConverter> TextureConverter::create(const FrameSize& frameSize, unsigned int destFormat, SquishEncoderQuality quality, ThreadPool* pool)
 {
 	int flag_quality;
 	switch (quality)
@@ -116,30 +234,277 @@ std::unique_ptr<TextureConverter> TextureConverter::create(const FrameSize& fram
 	switch (destFormat)
 	{
 	case HapTextureFormat_RGB_DXT1:
-		return std::make_unique<SquishTextureConverter>(frameSize, squish::kDxt1 | flag_quality);
+		if (quality == kSquishEncoderRealtimeQuality)
+			return std::make_unique<RealtimeTextureConverter>(frameSize, pool, false);
+		return std::make_unique<SquishTextureConverter>(frameSize, pool, squish::kDxt1 | flag_quality);
 	case HapTextureFormat_RGBA_DXT5:
-		return std::make_unique<SquishTextureConverter>(frameSize, squish::kDxt5 | flag_quality);
+		if (quality == kSquishEncoderRealtimeQuality)
+			return std::make_unique<RealtimeTextureConverter>(frameSize, pool, true);
+		return std::make_unique<SquishTextureConverter>(frameSize, pool, squish::kDxt5 | flag_quality);
 	case HapTextureFormat_YCoCg_DXT5:
-		return std::make_unique<TextureConverterToYCoCg_Dxt5>(frameSize);
+		return std::make_unique<TextureConverterToYCoCg_Dxt5>(frameSize, pool);
 	case HapTextureFormat_A_RGTC1:
-		return std::make_unique<SquishTextureConverter>(frameSize, squish::kRgtc1A);
+		return std::make_unique<SquishTextureConverter>(frameSize, pool, squish::kRgtc1A);
+	case HapTextureFormat_RGBA_BPTC_UNORM:
+		return std::make_unique<Bc7TextureConverter>(frameSize, pool,
+			(quality == kSquishEncoderRealtimeQuality) ? kBc7EffortFastest
+			: (quality == kSquishEncoderFastQuality) ? kBc7EffortFast
+			: kBc7EffortNormal);
 	default:
 		throw std::runtime_error("unknown conversion");
 	}
 }
 
 
-void TextureConverter::convert(const uint8_t* in_rgba,
-							   std::vector<uint8_t> &intermediate_ycocg,
-							   std::vector<uint8_t> &outputBuffer)
+void TextureConverter::convert(const SourceFrame& source, uint8_t* output)
+{
+	forEachBand([&](int firstRow, int rowCount) {
+		convertRows(source, firstRow, rowCount, output);
+	});
+}
+
+
+void TextureConverter::convertRows(const SourceFrame& source, int firstRow, int rowCount, uint8_t* output) const
+{
+	int blocksPerRow = roundUpToMultipleOf4(frameSize_.width) / 4;
+	int endRow = firstRow + rowCount;
+	for (int row = firstRow; row < endRow; row += 4)
+		doConvertBlocks(source, row, std::min(4, endRow - row), 0, blocksPerRow, output);
+}
+
+
+void TextureConverter::convert(const std::array<TextureConverter*, 2>& converters,
+							   unsigned int count,
+							   const SourceFrame& source,
+							   const std::array<uint8_t*, 2>& outputs,
+							   BlockReuseCache* cache)
+{
+	if (cache)
+	{
+		std::unique_lock<std::mutex> lock(cache->mutex_, std::try_to_lock);
+		if (lock)
+		{
+			convertReusingBlocks(converters, count, source, outputs, *cache);
+			return;
+		}
+		++cache->busyFrames_;
+	}
+
+	if (count == 1)
+	{
+		converters[0]->convert(source, outputs[0]);
+		return;
+	}
+
+	converters[0]->forEachBand([&](int firstRow, int rowCount) {
+		int endRow = firstRow + rowCount;
+		for (int row = firstRow; row < endRow; row += 4)
+		{
+			int stripRows = std::min(4, endRow - row);
+			for (unsigned int i = 0; i < count; ++i)
+				converters[i]->convertRows(source, row, stripRows, outputs[i]);
+		}
+	});
+}
+
+
+// flags the blocks of the strip of rows at row whose pixels differ between source and previous,
+// which holds the strip's rows rowbytes apart
+static void findChangedBlocks(const SourceFrame& source, int row, const uint8_t* previous, size_t rowbytes,
+							  int width, int rows, uint8_t* changed)
+{
+	int wholeBlocks = width / 4;
+	for (int b = 0; b < wholeBlocks; ++b)
+	{
+		__m128i difference = _mm_setzero_si128();
+		for (int j = 0; j < rows; ++j)
+		{
+			size_t offset = (size_t)b * 16;
+			difference = _mm_or_si128(difference, _mm_xor_si128(
+				_mm_loadu_si128((const __m128i*)(source.row(row + j) + offset)),
+				_mm_loadu_si128((const __m128i*)(previous + j * rowbytes + offset))));
+		}
+		changed[b] = !_mm_testz_si128(difference, difference);
+	}
+
+	if (wholeBlocks * 4 < width)
+	{
+		size_t offset = (size_t)wholeBlocks * 16;
+		size_t bytes = (size_t)(width - wholeBlocks * 4) * 4;
+		changed[wholeBlocks] = 0;
+		for (int j = 0; j < rows; ++j)
+			changed[wholeBlocks] |= (std::memcmp(source.row(row + j) + offset, previous + j * rowbytes + offset, bytes) != 0);
+	}
+}
+
+
+void TextureConverter::convertReusingBlocks(const std::array<TextureConverter*, 2>& converters,
+											 unsigned int count,
+											 const SourceFrame& source,
+											 const std::array<uint8_t*, 2>& outputs,
+											 BlockReuseCache& cache)
+{
+	int width = converters[0]->frameSize().width;
+	int height = converters[0]->frameSize().height;
+	size_t rowbytes = (size_t)width * 4;
+	int blocksPerRow = roundUpToMultipleOf4(width) / 4;
+
+	// the first frame compresses every block, and fills the cache. Until this frame completes the
+	// cache may hold some of its blocks and not others.
+	bool valid = cache.valid_ && cache.order_ == source.order;
+	cache.valid_ = false;
+	cache.order_ = source.order;
+	std::array<size_t, 2> bytesPerBlock;
+	cache.pixels_.resize(rowbytes * height);
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		cache.textures_[i].resize(converters[i]->size());
+		bytesPerBlock[i] = converters[i]->size() / ((size_t)blocksPerRow * (roundUpToMultipleOf4(height) / 4));
+	}
+
+	converters[0]->forEachBand([&](int firstRow, int rowCount) {
+		thread_local std::vector<uint8_t> changed;
+		changed.resize(blocksPerRow);
+		uint64_t reused = 0;
+
+		int endRow = firstRow + rowCount;
+		for (int row = firstRow; row < endRow; row += 4)
+		{
+			int stripRows = std::min(4, endRow - row);
+			uint8_t* previous = &cache.pixels_[row * rowbytes];
+
+			if (valid)
+				findChangedBlocks(source, row, previous, rowbytes, width, stripRows, &changed[0]);
+			else
+				std::fill(changed.begin(), changed.end(), (uint8_t)1);
+
+			// runs of changed or unchanged blocks
+			for (int first = 0, end; first < blocksPerRow; first = end)
+			{
+				for (end = first + 1; end < blocksPerRow && changed[end] == changed[first]; ++end)
+					;
+
+				for (unsigned int i = 0; i < count; ++i)
+				{
+					size_t offset = ((size_t)(row / 4) * blocksPerRow + first) * bytesPerBlock[i];
+					size_t bytes = (end - first) * bytesPerBlock[i];
+
+					if (!changed[first])
+						std::memcpy(outputs[i] + offset, &cache.textures_[i][offset], bytes);
+					else
+					{
+						converters[i]->doConvertBlocks(source, row, stripRows, first, end - first, outputs[i]);
+						std::memcpy(&cache.textures_[i][offset], outputs[i] + offset, bytes);
+					}
+				}
+
+				if (!changed[first])
+					reused += end - first;
+				else
+				{
+					size_t x = (size_t)first * 16;
+					size_t bytes = std::min((size_t)end * 16, rowbytes) - x;
+					for (int j = 0; j < stripRows; ++j)
+						std::memcpy(previous + j * rowbytes + x, source.row(row + j) + x, bytes);
+				}
+			}
+		}
+
+		cache.blocks_ += (uint64_t)((rowCount + 3) / 4) * blocksPerRow * count;
+		cache.reusedBlocks_ += reused * count;
+	});
+
+	cache.valid_ = true;
+	++cache.frames_;
+}
+
+
+// the shuffle that puts 4 pixels of a source in order into rgba
+static __m128i rgbaShuffle(SourceChannelOrder order)
+{
+	switch (order)
+	{
+	case kSourceChannelOrderBgra:
+		return _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+	case kSourceChannelOrderArgb:
+		return _mm_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+	default:
+		return _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	}
+}
+
+// up to 4 pixels as rgba, reading no further than the last of them
+static inline __m128i loadRgba(const uint8_t* pixels, int count, __m128i order)
+{
+	if (count == 4)
+		return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)pixels), order);
+
+	alignas(16) uint8_t partial[16] = {};
+	std::memcpy(partial, pixels, (size_t)count * 4);
+	return _mm_shuffle_epi8(_mm_load_si128((const __m128i*)partial), order);
+}
+
+
+int TextureConverter::gatherBlock(const SourceFrame& source, int x, int row, int columns, int rows, uint8_t rgba[64], bool opaque)
+{
+	__m128i order = rgbaShuffle(source.order);
+	__m128i alpha = _mm_set1_epi32(opaque ? (int)0xff000000 : 0);
+	int mask = 0;
+	for (int j = 0; j < rows; ++j)
+	{
+		_mm_storeu_si128((__m128i*)(rgba + j * 16), _mm_or_si128(loadRgba(source.row(row + j) + x * 4, columns, order), alpha));
+		mask |= ((1 << columns) - 1) << (j * 4);
+	}
+	return mask;
+}
+
+
+const uint8_t* TextureConverter::rgbaRows(const SourceFrame& source, int x, int row, int width, int rowCount,
+										   std::vector<uint8_t>& scratch, size_t& rowbytes)
+{
+	if (source.order == kSourceChannelOrderRgba && source.stride > 0)
+	{
+		rowbytes = (size_t)source.stride;
+		return source.row(row) + x * 4;
+	}
+
+	rowbytes = (size_t)width * 4;
+	scratch.resize(rowbytes * rowCount);
+	__m128i order = rgbaShuffle(source.order);
+	for (int j = 0; j < rowCount; ++j)
+	{
+		const uint8_t* in = source.row(row + j) + x * 4;
+		uint8_t* out = &scratch[j * rowbytes];
+		int i = 0;
+		for (; i + 4 <= width; i += 4)
+			_mm_storeu_si128((__m128i*)(out + i * 4), loadRgba(in + i * 4, 4, order));
+		if (i < width)
+		{
+			alignas(16) uint8_t partial[16];
+			_mm_store_si128((__m128i*)partial, loadRgba(in + i * 4, width - i, order));
+			std::memcpy(out + i * 4, partial, (size_t)(width - i) * 4);
+		}
+	}
+	return &scratch[0];
+}
+
+
+BlockReuseStats BlockReuseCache::stats() const
 {
-	doConvert(in_rgba, intermediate_ycocg, outputBuffer);
+	BlockReuseStats stats;
+	stats.blocks = blocks_;
+	stats.reusedBlocks = reusedBlocks_;
+	stats.frames = frames_;
+	stats.busyFrames = busyFrames_;
+	return stats;
 }
 
 
-void TextureConverter::doConvert(
-	const uint8_t* in_rgba,
-	std::vector<uint8_t> &intermediate_ycocg,
-	std::vector<uint8_t> &outputBuffer)
+void TextureConverter::forEachBand(const std::function<void(int, int)>& work) const
 {
+	int64_t frame = Trace::currentFrame();
+	parallelForBlockRows(pool_, frameSize_.height, [&](int firstRow, int rowCount) {
+		TraceScope scope("convert band", frame);
+		work(firstRow, rowCount);
+	});
 }
\ No newline at end of file
@@ -3,15 +3,76 @@
 // base class for different kinds of Hap encoders
 
 #include <array>
+#include <atomic>
+#include <cstddef>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 #include "codec_registration.hpp"
 
+class ThreadPool;
+
 enum SquishEncoderQuality {
     kSquishEncoderFastQuality = 0,
     kSquishEncoderNormalQuality = 1,
-    kSquishEncoderBestQuality = 2
+    kSquishEncoderBestQuality = 2,
+    kSquishEncoderRealtimeQuality = 3   // not squish; see realtime_dxt.hpp
+};
+
+// channel order of a source frame's 8-bit pixels in memory
+enum SourceChannelOrder {
+    kSourceChannelOrderRgba = 0,
+    kSourceChannelOrderBgra = 1,
+    kSourceChannelOrderArgb = 2
+};
+
+// 8-bit pixels to convert, read where the host left them. Row y of the image, counting down from
+// the top, starts at data + y * stride, so a frame with a bottom left origin is described by the
+// address of its top row and a negative stride.
+struct SourceFrame
+{
+	const uint8_t* data;
+	ptrdiff_t stride;
+	SourceChannelOrder order;
+
+	const uint8_t* row(int y) const { return data + y * stride; }
+};
+
+// Blocks converted through a BlockReuseCache, and how many of them it saved compressing
+
+struct BlockReuseStats
+{
+	uint64_t blocks{ 0 };            // blocks of every texture converted with the cache
+	uint64_t reusedBlocks{ 0 };      // of those, copied from the previous frame
+	unsigned int frames{ 0 };        // frames converted with the cache
+	unsigned int busyFrames{ 0 };    // frames converted without it, as another frame held it
+};
+
+// The source pixels and compressed blocks of the last frame converted, so that blocks whose
+// pixels have not changed since are copied rather than compressed again. Every converter
+// compresses each block on its own, so textures are identical to converting without the cache.
+// A cache must always be used with the same converters. Pixels are kept in the source's channel
+// order; a frame in a different order from the last compresses every block.
+class BlockReuseCache
+{
+public:
+	BlockReuseStats stats() const;
+
+private:
+	friend class TextureConverter;
+
+	std::mutex mutex_;    // held for a whole frame; frames that find it held go without
+	bool valid_{ false };
+	SourceChannelOrder order_{ kSourceChannelOrderRgba };
+	std::vector<uint8_t> pixels_;
+	std::array<std::vector<uint8_t>, 2> textures_;
+
+	std::atomic<uint64_t> blocks_{ 0 };
+	std::atomic<uint64_t> reusedBlocks_{ 0 };
+	std::atomic<unsigned int> frames_{ 0 };
+	std::atomic<unsigned int> busyFrames_{ 0 };
 };
 
 // texture conversion from adobe-preferred to hap_encode required
@@ -19,26 +80,67 @@ enum SquishEncoderQuality {
 class TextureConverter
 {
 public:
-	TextureConverter(const FrameSize& frameSize)
-		: frameSize_(frameSize)
+	TextureConverter(const FrameSize& frameSize, ThreadPool* pool)
+		: frameSize_(frameSize), pool_(pool)
 	{}
 	virtual ~TextureConverter();
 
-	static std::unique_ptr<TextureConverter> create(const FrameSize& frameSize, unsigned int destFormat, SquishEncoderQuality quality);
+	// pool may be null, in which case conversion runs on the calling thread
+	static std::unique_ptr<TextureConverter> create(const FrameSize& frameSize, unsigned int destFormat, SquishEncoderQuality quality, ThreadPool* pool = nullptr);
 
 	const FrameSize& frameSize() const { return frameSize_; }
 
     virtual size_t size() const;   // storage required
 
-	void convert(const uint8_t* in_rgba,
-		std::vector<uint8_t> &intermediate_ycocg,
-		std::vector<uint8_t> &outputBuffer);
+	// output holds size() bytes
+	void convert(const SourceFrame& source, uint8_t* output);
+
+	// converts one frame to the first count textures in a single pass. Each 4-row strip of the
+	// source is converted by every converter in turn while it is in cache, rather than each
+	// converter streaming the whole frame. The converters must share a frame size and pool.
+	// With a cache, only blocks that differ from the last frame converted with it are compressed.
+	static void convert(const std::array<TextureConverter*, 2>& converters,
+		unsigned int count,
+		const SourceFrame& source,
+		const std::array<uint8_t*, 2>& outputs,
+		BlockReuseCache* cache = nullptr);
+
+protected:
+	// splits the frame into bands of whole 4-pixel block rows and calls work(firstRow, rowCount)
+	// for each, spread across the pool. Each band's output depends only on its own rows, so the
+	// result is identical to converting the frame in one piece.
+	void forEachBand(const std::function<void(int, int)>& work) const;
+
+	// gathers the block of source at (x, row), of which columns by rows pixels are inside the frame,
+	// as 16 rgba pixels in row order and gives the mask of those inside, as squish::CompressMasked
+	// takes them; the others are undefined. With opaque, every alpha is 255.
+	static int gatherBlock(const SourceFrame& source, int x, int row, int columns, int rows, uint8_t rgba[64], bool opaque = false);
+
+	// the pixels [x, x + width) of the rowCount rows at row as rgba, rowbytes apart, for
+	// compressors that take packed rows: the source itself when it already is rgba, otherwise
+	// gathered into scratch
+	static const uint8_t* rgbaRows(const SourceFrame& source, int x, int row, int width, int rowCount,
+		std::vector<uint8_t>& scratch, size_t& rowbytes);
 
 private:
-	virtual void doConvert(
-		const uint8_t* in_rgba,
-		std::vector<uint8_t> &intermediate_ycocg,
-		std::vector<uint8_t> &outputBuffer)=0;
+	// converts the strips of rows [firstRow, firstRow + rowCount) to their blocks in output, which
+	// holds size() bytes. firstRow is a multiple of 4; called concurrently for different rows.
+	void convertRows(const SourceFrame& source, int firstRow, int rowCount, uint8_t* output) const;
+
+	// converts blocks [firstBlock, firstBlock + blockCount) of the strip of rowCount (at most 4)
+	// rows at row, which is a multiple of 4, to their places in output
+	virtual void doConvertBlocks(
+		const SourceFrame& source,
+		int row, int rowCount,
+		int firstBlock, int blockCount,
+		uint8_t* output) const = 0;
+
+	static void convertReusingBlocks(const std::array<TextureConverter*, 2>& converters,
+		unsigned int count,
+		const SourceFrame& source,
+		const std::array<uint8_t*, 2>& outputs,
+		BlockReuseCache& cache);
 
 	FrameSize frameSize_;
+	ThreadPool* pool_;
 };
@@ -0,0 +1,356 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <smmintrin.h>
+
+#include "texture_decoder.hpp"
+#include "thread_pool.hpp"
+#include "bc7.hpp"
+#include "hap.h"
+
+// Each block decoder produces the four rows of a 4x4 block as rgba, one row per register.
+// The DXT1, DXT5 and RGTC1 decoders give exactly the colours of squish::Decompress; the
+// YCoCg-DXT5 decoder gives exactly those of DeCompressYCoCgDXT5 followed by
+// ConvertCoCgAY8888ToRGBA, with the colour space conversion done while the block is in registers.
+// BC7 blocks are decoded by decompressBc7Block.
+
+// 2-bit indices of a colour block, one byte per pixel
+static inline __m128i unpackIndices2(const uint8_t* bytes)
+{
+    uint32_t bits = (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+    alignas(16) uint8_t indices[16];
+    for (int i = 0; i < 16; ++i)
+        indices[i] = (uint8_t)((bits >> (2 * i)) & 3);
+    return _mm_load_si128((const __m128i*)indices);
+}
+
+// 3-bit indices of an alpha block, one byte per pixel
+static inline __m128i unpackIndices3(const uint8_t* bytes)
+{
+    uint64_t bits = 0;
+    for (int i = 0; i < 6; ++i)
+        bits |= (uint64_t)bytes[i] << (8 * i);
+    alignas(16) uint8_t indices[16];
+    for (int i = 0; i < 16; ++i)
+        indices[i] = (uint8_t)((bits >> (3 * i)) & 7);
+    return _mm_load_si128((const __m128i*)indices);
+}
+
+// shuffle control selecting the 4-byte palette entry of each pixel in row j
+static inline __m128i paletteRowShuffle(__m128i indices, int j)
+{
+    __m128i spread = _mm_shuffle_epi8(indices, _mm_set_epi8(
+        4 * j + 3, 4 * j + 3, 4 * j + 3, 4 * j + 3, 4 * j + 2, 4 * j + 2, 4 * j + 2, 4 * j + 2,
+        4 * j + 1, 4 * j + 1, 4 * j + 1, 4 * j + 1, 4 * j, 4 * j, 4 * j, 4 * j));
+    return _mm_add_epi8(_mm_slli_epi16(spread, 2), _mm_set1_epi32(0x03020100));
+}
+
+// moves the alpha of each pixel in row j of a register of 16 alphas to the top byte of its pixel
+static inline __m128i alphaRow(__m128i alphas, int j)
+{
+    return _mm_shuffle_epi8(alphas, _mm_set_epi8(
+        4 * j + 3, -1, -1, -1, 4 * j + 2, -1, -1, -1, 4 * j + 1, -1, -1, -1, 4 * j, -1, -1, -1));
+}
+
+static inline void unpack565(const uint8_t* packed, uint8_t* colour)
+{
+    int value = (int)packed[0] | ((int)packed[1] << 8);
+    int red = (value >> 11) & 0x1f;
+    int green = (value >> 5) & 0x3f;
+    int blue = value & 0x1f;
+
+    colour[0] = (uint8_t)((red << 3) | (red >> 2));
+    colour[1] = (uint8_t)((green << 2) | (green >> 4));
+    colour[2] = (uint8_t)((blue << 3) | (blue >> 2));
+}
+
+// decodes the 8-byte colour part of a DXT block. alpha is the alpha of every palette entry
+static inline void decodeColourBlock(const uint8_t* bytes, bool isDxt1, uint8_t alpha, __m128i rows[4])
+{
+    alignas(16) uint8_t codes[16];
+    unpack565(bytes, codes);
+    unpack565(bytes + 2, codes + 4);
+    bool threeColour = isDxt1 && ((bytes[0] | (bytes[1] << 8)) <= (bytes[2] | (bytes[3] << 8)));
+
+    for (int i = 0; i < 3; ++i)
+    {
+        int c = codes[i];
+        int d = codes[4 + i];
+        if (threeColour)
+        {
+            codes[8 + i] = (uint8_t)((c + d) / 2);
+            codes[12 + i] = 0;
+        }
+        else
+        {
+            codes[8 + i] = (uint8_t)((2 * c + d) / 3);
+            codes[12 + i] = (uint8_t)((c + 2 * d) / 3);
+        }
+    }
+    codes[3] = codes[7] = codes[11] = codes[15] = alpha;
+
+    __m128i palette = _mm_load_si128((const __m128i*)codes);
+    __m128i indices = unpackIndices2(bytes + 4);
+    for (int j = 0; j < 4; ++j)
+        rows[j] = _mm_shuffle_epi8(palette, paletteRowShuffle(indices, j));
+}
+
+// decodes an 8-byte DXT5 alpha or RGTC1 block to one alpha per pixel
+static inline __m128i decodeAlphaBlock(const uint8_t* bytes)
+{
+    int alpha0 = bytes[0];
+    int alpha1 = bytes[1];
+
+    alignas(16) uint8_t codes[16] = {};
+    codes[0] = (uint8_t)alpha0;
+    codes[1] = (uint8_t)alpha1;
+    if (alpha0 <= alpha1)
+    {
+        for (int i = 1; i < 5; ++i)
+            codes[1 + i] = (uint8_t)(((5 - i) * alpha0 + i * alpha1) / 5);
+        codes[6] = 0;
+        codes[7] = 255;
+    }
+    else
+    {
+        for (int i = 1; i < 7; ++i)
+            codes[1 + i] = (uint8_t)(((7 - i) * alpha0 + i * alpha1) / 7);
+    }
+
+    return _mm_shuffle_epi8(_mm_load_si128((const __m128i*)codes), unpackIndices3(bytes + 2));
+}
+
+static void decodeDxt1Block(const uint8_t* block, __m128i rows[4])
+{
+    // Hap DXT1 is RGB, so the transparent entry of three-colour blocks is opaque black
+    decodeColourBlock(block, true, 255, rows);
+}
+
+static void decodeDxt5Block(const uint8_t* block, __m128i rows[4])
+{
+    decodeColourBlock(block + 8, false, 0, rows);
+    __m128i alphas = decodeAlphaBlock(block);
+    for (int j = 0; j < 4; ++j)
+        rows[j] = _mm_or_si128(rows[j], alphaRow(alphas, j));
+}
+
+static void decodeRgtc1Block(const uint8_t* block, __m128i rows[4])
+{
+    // on its own, as Hap Alpha-Only, the colour is white
+    __m128i alphas = decodeAlphaBlock(block);
+    for (int j = 0; j < 4; ++j)
+        rows[j] = _mm_or_si128(alphaRow(alphas, j), _mm_set1_epi32(0x00ffffff));
+}
+
+static void decodeYCoCgDxt5Block(const uint8_t* block, __m128i rows[4])
+{
+    // luma palette, as RestoreLumaAlphaBlock
+    alignas(16) uint8_t luma[16] = {};
+    int luma0 = block[0];
+    int luma1 = block[1];
+    luma[0] = (uint8_t)luma0;
+    luma[1] = (uint8_t)luma1;
+    for (int i = 2; i < 8; ++i)
+        luma[i] = (uint8_t)(((8 - i) * luma0 + (i - 1) * luma1 + 3) / 7);
+
+    // chroma palette, as RestoreChromaBlock, less the 128 bias
+    int endpoints[2][3];
+    for (int e = 0; e < 2; ++e)
+    {
+        int value = (int)block[8 + 2 * e] | ((int)block[9 + 2 * e] << 8);
+        endpoints[e][0] = (value >> 11) << 3;
+        endpoints[e][1] = ((value >> 5) & 0x3f) << 2;
+        endpoints[e][2] = (value & 0x1f) << 3;
+    }
+    int shift = ((endpoints[0][2] >> 3) + 1) >> 1;
+
+    alignas(16) int8_t co[16] = {};
+    alignas(16) int8_t cg[16] = {};
+    for (int c = 0; c < 2; ++c)
+    {
+        int8_t* palette = (c == 0) ? co : cg;
+        int e0 = endpoints[0][c];
+        int e1 = endpoints[1][c];
+        int entries[4] = { e0, e1, (3 * e0 + e1) >> 2, (e0 + 3 * e1) >> 2 };
+        for (int i = 0; i < 4; ++i)
+            palette[i] = (int8_t)((entries[i] - 128) >> shift);
+    }
+
+    __m128i y = _mm_shuffle_epi8(_mm_load_si128((const __m128i*)luma), unpackIndices3(block + 2));
+    __m128i chromaIndices = unpackIndices2(block + 12);
+    __m128i co8 = _mm_shuffle_epi8(_mm_load_si128((const __m128i*)co), chromaIndices);
+    __m128i cg8 = _mm_shuffle_epi8(_mm_load_si128((const __m128i*)cg), chromaIndices);
+
+    // R = Y + Co - Cg, G = Y + Cg, B = Y - Co - Cg, eight pixels at a time
+    __m128i rgb[3][2];
+    for (int half = 0; half < 2; ++half)
+    {
+        __m128i y16 = _mm_cvtepu8_epi16(half ? _mm_srli_si128(y, 8) : y);
+        __m128i co16 = _mm_cvtepi8_epi16(half ? _mm_srli_si128(co8, 8) : co8);
+        __m128i cg16 = _mm_cvtepi8_epi16(half ? _mm_srli_si128(cg8, 8) : cg8);
+
+        rgb[0][half] = _mm_sub_epi16(_mm_add_epi16(y16, co16), cg16);
+        rgb[1][half] = _mm_add_epi16(y16, cg16);
+        rgb[2][half] = _mm_sub_epi16(_mm_sub_epi16(y16, co16), cg16);
+    }
+    __m128i r = _mm_packus_epi16(rgb[0][0], rgb[0][1]);
+    __m128i g = _mm_packus_epi16(rgb[1][0], rgb[1][1]);
+    __m128i b = _mm_packus_epi16(rgb[2][0], rgb[2][1]);
+    __m128i a = _mm_set1_epi8(-1);
+
+    __m128i rg = _mm_unpacklo_epi8(r, g);
+    __m128i ba = _mm_unpacklo_epi8(b, a);
+    rows[0] = _mm_unpacklo_epi16(rg, ba);
+    rows[1] = _mm_unpackhi_epi16(rg, ba);
+    rg = _mm_unpackhi_epi8(r, g);
+    ba = _mm_unpackhi_epi8(b, a);
+    rows[2] = _mm_unpacklo_epi16(rg, ba);
+    rows[3] = _mm_unpackhi_epi16(rg, ba);
+}
+
+static void decodeBc7Block(const uint8_t* block, __m128i rows[4])
+{
+    alignas(16) uint8_t pixels[64];
+    decompressBc7Block(block, pixels);
+    for (int j = 0; j < 4; ++j)
+        rows[j] = _mm_load_si128((const __m128i*)(pixels + j * 16));
+}
+
+// decodes a texture of bytesPerBlock-byte blocks with decodeBlock
+class BlockTextureDecoder : public TextureDecoder
+{
+public:
+    typedef void (*DecodeBlock)(const uint8_t* block, __m128i rows[4]);
+
+    BlockTextureDecoder(const FrameSize& frameSize, ThreadPool* pool, int bytesPerBlock, DecodeBlock decodeBlock)
+        : TextureDecoder(frameSize, pool), bytesPerBlock_(bytesPerBlock), decodeBlock_(decodeBlock)
+    {}
+    ~BlockTextureDecoder() {}
+
+    size_t size() const override
+    {
+        return (size_t)((frameSize().width + 3) / 4) * ((frameSize().height + 3) / 4) * bytesPerBlock_;
+    }
+
+private:
+    void doDecodeRows(
+        const uint8_t* texture,
+        int firstRow, int rowCount,
+        uint8_t* out_rgba,
+        bool alphaOnly) const override
+    {
+        int width = frameSize().width;
+        size_t stride = (size_t)width * 4;
+        size_t bytesPerBlockRow = (size_t)((width + 3) / 4) * bytesPerBlock_;
+        const __m128i alphaMask = _mm_set1_epi32((int)0xff000000);
+
+        int endRow = firstRow + rowCount;
+        for (int row = firstRow; row < endRow; row += 4)
+        {
+            int blockRows = std::min(4, endRow - row);
+            const uint8_t* block = texture + (row / 4) * bytesPerBlockRow;
+            uint8_t* out = out_rgba + row * stride;
+
+            for (int x = 0; x < width; x += 4, block += bytesPerBlock_)
+            {
+                __m128i rows[4];
+                decodeBlock_(block, rows);
+
+                int blockColumns = std::min(4, width - x);
+                if (blockRows == 4 && blockColumns == 4)
+                {
+                    for (int j = 0; j < 4; ++j)
+                    {
+                        __m128i* pixels = (__m128i*)(out + j * stride + x * 4);
+                        __m128i value = alphaOnly ? _mm_blendv_epi8(_mm_loadu_si128(pixels), rows[j], alphaMask) : rows[j];
+                        _mm_storeu_si128(pixels, value);
+                    }
+                }
+                else
+                {
+                    // only store the pixels that lie within the frame
+                    alignas(16) uint8_t pixels[64];
+                    for (int j = 0; j < 4; ++j)
+                        _mm_store_si128((__m128i*)(pixels + j * 16), rows[j]);
+
+                    for (int j = 0; j < blockRows; ++j)
+                    {
+                        uint8_t* dest = out + j * stride + x * 4;
+                        if (alphaOnly)
+                        {
+                            for (int i = 0; i < blockColumns; ++i)
+                                dest[i * 4 + 3] = pixels[j * 16 + i * 4 + 3];
+                        }
+                        else
+                        {
+                            std::memcpy(dest, pixels + j * 16, blockColumns * 4);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    int bytesPerBlock_;
+    DecodeBlock decodeBlock_;
+};
+
+
+TextureDecoder::~TextureDecoder()
+{
+}
+
+
+std::unique_ptr<TextureDecoder> TextureDecoder::create(const FrameSize& frameSize, unsigned int sourceFormat, ThreadPool* pool)
+{
+    switch (sourceFormat)
+    {
+    case HapTextureFormat_RGB_DXT1:
+        return std::make_unique<BlockTextureDecoder>(frameSize, pool, 8, decodeDxt1Block);
+    case HapTextureFormat_RGBA_DXT5:
+        return std::make_unique<BlockTextureDecoder>(frameSize, pool, 16, decodeDxt5Block);
+    case HapTextureFormat_YCoCg_DXT5:
+        return std::make_unique<BlockTextureDecoder>(frameSize, pool, 16, decodeYCoCgDxt5Block);
+    case HapTextureFormat_A_RGTC1:
+        return std::make_unique<BlockTextureDecoder>(frameSize, pool, 8, decodeRgtc1Block);
+    case HapTextureFormat_RGBA_BPTC_UNORM:
+        return std::make_unique<BlockTextureDecoder>(frameSize, pool, 16, decodeBc7Block);
+    case HapTextureFormat_RGB_BPTC_UNSIGNED_FLOAT:
+    case HapTextureFormat_RGB_BPTC_SIGNED_FLOAT:
+        throw std::runtime_error("Hap HDR (BC6H) frames are not supported");
+    default:
+        throw std::runtime_error("unknown texture format");
+    }
+}
+
+
+void TextureDecoder::decode(const uint8_t* texture, uint8_t* out_rgba) const
+{
+    parallelForBlockRows(pool_, frameSize_.height, [&](int firstRow, int rowCount) {
+        doDecodeRows(texture, firstRow, rowCount, out_rgba, false);
+    });
+}
+
+
+void TextureDecoder::decode(const std::array<const TextureDecoder*, 2>& decoders,
+                            unsigned int count,
+                            const std::array<const uint8_t*, 2>& textures,
+                            uint8_t* out_rgba)
+{
+    if (count == 1)
+    {
+        decoders[0]->decode(textures[0], out_rgba);
+        return;
+    }
+
+    // each strip is finished by every decoder in turn while it is in cache
+    parallelForBlockRows(decoders[0]->pool_, decoders[0]->frameSize_.height, [&](int firstRow, int rowCount) {
+        int endRow = firstRow + rowCount;
+        for (int row = firstRow; row < endRow; row += 4)
+        {
+            int stripRows = std::min(4, endRow - row);
+            for (unsigned int i = 0; i < count; ++i)
+                decoders[i]->doDecodeRows(textures[i], row, stripRows, out_rgba, i > 0);
+        }
+    });
+}
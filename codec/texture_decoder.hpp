@@ -0,0 +1,53 @@
+#pragma once
+
+// decompression of Hap textures to rgba, the reverse of TextureConverter
+
+#include <array>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "codec_registration.hpp"
+
+class ThreadPool;
+
+// decodes one Hap texture format to 8-bit rgba with a top left origin, a block at a time
+// with SSE, splitting the frame into bands of block rows across the pool
+class TextureDecoder
+{
+public:
+    TextureDecoder(const FrameSize& frameSize, ThreadPool* pool)
+        : frameSize_(frameSize), pool_(pool)
+    {}
+    virtual ~TextureDecoder();
+
+    // pool may be null, in which case decoding runs on the calling thread
+    static std::unique_ptr<TextureDecoder> create(const FrameSize& frameSize, unsigned int sourceFormat, ThreadPool* pool = nullptr);
+
+    const FrameSize& frameSize() const { return frameSize_; }
+
+    virtual size_t size() const = 0;   // bytes of texture expected
+
+    // decodes texture, which holds size() bytes, to out_rgba, which holds width * height * 4
+    void decode(const uint8_t* texture, uint8_t* out_rgba) const;
+
+    // decodes the first count textures to one frame in a single pass. Textures after the first
+    // supply only the alpha channel, as for Hap Q Alpha. The decoders must share a frame size and pool.
+    static void decode(const std::array<const TextureDecoder*, 2>& decoders,
+        unsigned int count,
+        const std::array<const uint8_t*, 2>& textures,
+        uint8_t* out_rgba);
+
+private:
+    // decodes the blocks for rows [firstRow, firstRow + rowCount) of texture to out_rgba. When
+    // alphaOnly, only the alpha channel is written. firstRow is a multiple of 4; called
+    // concurrently for different rows.
+    virtual void doDecodeRows(
+        const uint8_t* texture,
+        int firstRow, int rowCount,
+        uint8_t* out_rgba,
+        bool alphaOnly) const = 0;
+
+    FrameSize frameSize_;
+    ThreadPool* pool_;
+};
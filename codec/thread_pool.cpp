@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <atomic>
+#include <exception>
+
+#include "thread_pool.hpp"
+
+struct ThreadPool::Batch
+{
+    Batch(unsigned int count_, const std::function<void(unsigned int)>& work_)
+        : count(count_), work(work_), next(0), remaining(count_)
+    {}
+
+    // claim and run items until none are left
+    void run()
+    {
+        for (unsigned int i = next++; i < count; i = next++)
+        {
+            try
+            {
+                work(i);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> guard(doneMutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+
+            if (--remaining == 0)
+            {
+                std::lock_guard<std::mutex> guard(doneMutex);
+                done.notify_all();
+            }
+        }
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(doneMutex);
+        done.wait(lock, [&] { return remaining == 0; });
+    }
+
+    const unsigned int count;
+    const std::function<void(unsigned int)>& work;
+    std::atomic<unsigned int> next;
+    std::atomic<unsigned int> remaining;
+    std::mutex doneMutex;
+    std::condition_variable done;
+    std::exception_ptr error;
+};
+
+ThreadPool::ThreadPool(unsigned int threadCount)
+    : stopping_(false)
+{
+    if (threadCount == 0)
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+    for (unsigned int i = 1; i < threadCount; ++i)
+        workers_.emplace_back(&ThreadPool::workerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto& worker : workers_)
+        worker.join();
+}
+
+void ThreadPool::parallelFor(unsigned int count, const std::function<void(unsigned int)>& work)
+{
+    if (count == 0)
+        return;
+
+    if (count == 1 || workers_.empty())
+    {
+        for (unsigned int i = 0; i < count; ++i)
+            work(i);
+        return;
+    }
+
+    auto batch = std::make_shared<Batch>(count, work);
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        queue_.push_back(batch);
+    }
+    wake_.notify_all();
+
+    batch->run();
+    batch->wait();
+
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        auto it = std::find(queue_.begin(), queue_.end(), batch);
+        if (it != queue_.end())
+            queue_.erase(it);
+    }
+
+    if (batch->error)
+        std::rethrow_exception(batch->error);
+}
+
+void ThreadPool::workerLoop()
+{
+    for (;;)
+    {
+        std::shared_ptr<Batch> batch;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [&] { return stopping_ || !queue_.empty(); });
+            if (stopping_)
+                return;
+            batch = queue_.front();
+        }
+
+        batch->run();
+
+        // everything in the batch has been claimed; stop others picking it up
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (!queue_.empty() && queue_.front() == batch)
+            queue_.pop_front();
+    }
+}
+
+void parallelForBlockRows(ThreadPool* pool, int height, const std::function<void(int, int)>& work)
+{
+    unsigned int blockRows = (unsigned int)((height + 3) / 4);
+    unsigned int threads = pool ? pool->threadCount() : 1;
+
+    if (threads <= 1 || blockRows <= 1)
+    {
+        work(0, height);
+        return;
+    }
+
+    // a few bands per thread so that uneven bands still balance
+    unsigned int bandCount = std::min(blockRows, threads * 4);
+    pool->parallelFor(bandCount, [&](unsigned int band) {
+        int firstRow = (int)((blockRows * band) / bandCount) * 4;
+        int endRow = std::min((int)((blockRows * (band + 1)) / bandCount) * 4, height);
+        work(firstRow, endRow - firstRow);
+    });
+}
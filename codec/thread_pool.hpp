@@ -0,0 +1,46 @@
+#pragma once
+
+// fixed set of worker threads used to split the work for a single frame across cores
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+    // threadCount is the total number of threads that take part in parallelFor, including
+    // the caller; 0 picks one per hardware thread, 1 runs everything on the calling thread
+    explicit ThreadPool(unsigned int threadCount);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned int threadCount() const { return (unsigned int)workers_.size() + 1; }
+
+    // calls work(i) for every i in [0, count) and returns when all calls have completed.
+    // The calling thread takes part, so this may be used from several threads at once.
+    // The first exception thrown by work is rethrown here.
+    void parallelFor(unsigned int count, const std::function<void(unsigned int)>& work);
+
+private:
+    struct Batch;
+
+    void workerLoop();
+
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<std::shared_ptr<Batch>> queue_;
+    bool stopping_;
+};
+
+// splits rows [0, height) into bands of whole 4-row blocks and calls work(firstRow, rowCount) for
+// each, spread across pool. When pool is null or has one thread, or there is only one block row,
+// work is called once, with (0, height), on the calling thread.
+void parallelForBlockRows(ThreadPool* pool, int height, const std::function<void(int, int)>& work);
@@ -0,0 +1,317 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include "trace.hpp"
+
+std::atomic<int> Trace::sessions_{ 0 };
+
+namespace {
+
+struct TraceEvent
+{
+    const char* name;
+    int64_t frame;
+    int64_t start;
+    int64_t end;
+};
+
+// An event in a ring. Its thread may overwrite it while a session copies it, once the ring has
+// wrapped, so the fields are atomics and sequence numbers the event held: ~0 while it is being
+// written, then the event's index in the ring. A copy is good if sequence was the index wanted
+// both before and after it.
+struct TraceSlot
+{
+    static const uint64_t kWriting = ~uint64_t(0);
+
+    std::atomic<uint64_t> sequence{ kWriting };
+    std::atomic<const char*> name{ nullptr };
+    std::atomic<int64_t> frame{ 0 };
+    std::atomic<int64_t> start{ 0 };
+    std::atomic<int64_t> end{ 0 };
+
+    void store(uint64_t index, const TraceEvent& event)
+    {
+        sequence.store(kWriting, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        name.store(event.name, std::memory_order_relaxed);
+        frame.store(event.frame, std::memory_order_relaxed);
+        start.store(event.start, std::memory_order_relaxed);
+        end.store(event.end, std::memory_order_relaxed);
+        sequence.store(index, std::memory_order_release);
+    }
+
+    // false if the slot no longer, or not yet wholly, holds event index
+    bool load(uint64_t index, TraceEvent& event) const
+    {
+        if (sequence.load(std::memory_order_acquire) != index)
+            return false;
+        event.name = name.load(std::memory_order_relaxed);
+        event.frame = frame.load(std::memory_order_relaxed);
+        event.start = start.load(std::memory_order_relaxed);
+        event.end = end.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return sequence.load(std::memory_order_relaxed) == index;
+    }
+};
+
+// Spans recorded by one thread at a time. Only that thread writes events, publishing each by
+// advancing written, so sessions read events [written - kCapacity, written) without locking,
+// skipping any the thread overwrites meanwhile.
+struct TraceRing
+{
+    static const uint64_t kCapacity = 1 << 14;
+
+    TraceSlot events[kCapacity];
+    std::atomic<uint64_t> written{ 0 };
+    unsigned int thread{ 0 };   // tid in the trace; threads that reuse the ring share it
+    bool inUse{ true };         // guarded by ringsMutex
+};
+
+std::mutex ringsMutex;
+std::vector<std::unique_ptr<TraceRing>> rings;
+std::atomic<unsigned int> sessionCount{ 0 };
+
+// gives a thread's ring to the next thread that traces once this one exits, so that the short-
+// lived pools of successive exports don't each allocate rings
+struct RingOwner
+{
+    TraceRing* ring{ nullptr };
+
+    ~RingOwner()
+    {
+        if (ring)
+        {
+            std::lock_guard<std::mutex> guard(ringsMutex);
+            ring->inUse = false;
+        }
+    }
+};
+
+thread_local RingOwner ringOwner;
+thread_local int64_t threadFrame = -1;
+
+TraceRing* threadRing()
+{
+    if (!ringOwner.ring)
+    {
+        std::lock_guard<std::mutex> guard(ringsMutex);
+        for (auto& ring : rings)
+        {
+            if (!ring->inUse)
+            {
+                ring->inUse = true;
+                ringOwner.ring = ring.get();
+                break;
+            }
+        }
+        if (!ringOwner.ring)
+        {
+            rings.push_back(std::make_unique<TraceRing>());
+            rings.back()->thread = (unsigned int)rings.size();
+            ringOwner.ring = rings.back().get();
+        }
+    }
+    return ringOwner.ring;
+}
+
+double milliseconds(int64_t nanoseconds)
+{
+    return nanoseconds / 1e6;
+}
+
+}
+
+int64_t Trace::now()
+{
+    static const auto epoch = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+int64_t Trace::nextFrame()
+{
+    static std::atomic<int64_t> frames{ 0 };
+    return frames++;
+}
+
+int64_t Trace::currentFrame()
+{
+    return threadFrame;
+}
+
+void Trace::record(const char* name, int64_t frame, int64_t start, int64_t end)
+{
+    TraceRing* ring = threadRing();
+    uint64_t n = ring->written.load(std::memory_order_relaxed);
+    ring->events[n % TraceRing::kCapacity].store(n, TraceEvent{ name, frame, start, end });
+    ring->written.store(n + 1, std::memory_order_release);
+}
+
+TraceScope::TraceScope(const char* name, int64_t frame)
+    : name_(name), frame_(frame), outerFrame_(-1), start_(-1)
+{
+    if (!Trace::active())
+        return;
+
+    outerFrame_ = threadFrame;
+    if (frame_ < 0)
+        frame_ = threadFrame;
+    threadFrame = frame_;
+    start_ = Trace::now();
+}
+
+TraceScope::~TraceScope()
+{
+    if (start_ < 0)
+        return;
+
+    Trace::record(name_, frame_, start_, Trace::now());
+    threadFrame = outerFrame_;
+}
+
+TraceSession::TraceSession(std::string prefix)
+    : path_(prefix + "-" + std::to_string(++sessionCount)), start_(Trace::now())
+{
+    ++Trace::sessions_;
+}
+
+TraceSession::~TraceSession()
+{
+    --Trace::sessions_;
+    int64_t end = Trace::now();
+
+    // the spans that began and ended during the session, with the thread of each
+    struct Span
+    {
+        unsigned int thread;
+        TraceEvent event;
+    };
+    std::vector<Span> spans;
+    uint64_t dropped = 0;
+    {
+        std::lock_guard<std::mutex> guard(ringsMutex);
+        for (const auto& ring : rings)
+        {
+            uint64_t written = ring->written.load(std::memory_order_acquire);
+            uint64_t first = (written > TraceRing::kCapacity) ? written - TraceRing::kCapacity : 0;
+            bool overflowed = false;
+            for (uint64_t i = first; i < written; ++i)
+            {
+                // threads may still be tracing, for a scope begun before the session ended or
+                // for another session, and so overwriting the oldest events as they are read
+                TraceEvent event;
+                if (!ring->events[i % TraceRing::kCapacity].load(i, event))
+                {
+                    overflowed = true;
+                    continue;
+                }
+                if (event.start >= start_ && event.end <= end)
+                {
+                    overflowed = overflowed || (i == first && first > 0);
+                    spans.push_back(Span{ ring->thread, event });
+                }
+            }
+            // the ring wrapped within the session; how far is unknown, but at least one span
+            if (overflowed)
+                ++dropped;
+        }
+    }
+    std::sort(spans.begin(), spans.end(), [](const Span& a, const Span& b) { return a.event.start < b.event.start; });
+
+    // Chrome trace events, in microseconds from the start of the session
+    if (FILE* json = std::fopen((path_ + ".json").c_str(), "w"))
+    {
+        std::fprintf(json, "{\"traceEvents\":[\n");
+        std::set<unsigned int> threads;
+        for (const Span& span : spans)
+            threads.insert(span.thread);
+        bool first = true;
+        for (unsigned int thread : threads)
+        {
+            std::fprintf(json, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+                first ? "" : ",\n", thread, thread);
+            first = false;
+        }
+        for (const Span& span : spans)
+        {
+            std::fprintf(json, "%s{\"name\":\"%s\",\"cat\":\"hap\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+                first ? "" : ",\n", span.event.name, span.thread,
+                (span.event.start - start_) / 1e3, (span.event.end - span.event.start) / 1e3);
+            if (span.event.frame >= 0)
+                std::fprintf(json, ",\"args\":{\"frame\":%lld}", (long long)span.event.frame);
+            std::fprintf(json, "}");
+            first = false;
+        }
+        std::fprintf(json, "\n],\"displayTimeUnit\":\"ms\"}\n");
+        std::fclose(json);
+    }
+
+    // durations of each kind of span, those with the most time first
+    std::map<std::string, std::vector<int64_t>> durations;
+    std::set<int64_t> frames;
+    std::set<unsigned int> threads;
+    for (const Span& span : spans)
+    {
+        durations[span.event.name].push_back(span.event.end - span.event.start);
+        if (span.event.frame >= 0)
+            frames.insert(span.event.frame);
+        threads.insert(span.thread);
+    }
+
+    std::vector<std::pair<int64_t, std::string>> order;
+    for (auto& entry : durations)
+    {
+        std::sort(entry.second.begin(), entry.second.end());
+        int64_t total = 0;
+        for (int64_t duration : entry.second)
+            total += duration;
+        order.emplace_back(total, entry.first);
+    }
+    std::sort(order.rbegin(), order.rend());
+
+    if (FILE* summary = std::fopen((path_ + ".txt").c_str(), "w"))
+    {
+        std::fprintf(summary, "%zu frames over %.3f ms on %zu threads\n\n",
+            frames.size(), milliseconds(end - start_), threads.size());
+
+        std::fprintf(summary, "%-16s %8s %11s %9s %9s %9s %9s %9s\n",
+            "span", "count", "total ms", "mean ms", "p50 ms", "p90 ms", "p99 ms", "max ms");
+        for (const auto& entry : order)
+        {
+            const std::vector<int64_t>& sorted = durations[entry.second];
+            auto percentile = [&](double p) { return milliseconds(sorted[(size_t)(p * (sorted.size() - 1))]); };
+            std::fprintf(summary, "%-16s %8zu %11.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+                entry.second.c_str(), sorted.size(), milliseconds(entry.first), milliseconds(entry.first) / sorted.size(),
+                percentile(0.5), percentile(0.9), percentile(0.99), milliseconds(sorted.back()));
+        }
+
+        // counts of spans by duration, in steps of roughly a factor of three
+        static const double bounds[] = { 0.01, 0.03, 0.1, 0.3, 1, 3, 10, 30, 100, 300 };
+        static const char* labels[] = { "<0.01", "<0.03", "<0.1", "<0.3", "<1", "<3", "<10", "<30", "<100", "<300", ">=300" };
+        const size_t kBuckets = sizeof(labels) / sizeof(labels[0]);
+        std::fprintf(summary, "\n%-16s", "ms");
+        for (const char* label : labels)
+            std::fprintf(summary, " %6s", label);
+        std::fprintf(summary, "\n");
+        for (const auto& entry : order)
+        {
+            size_t counts[kBuckets] = {};
+            for (int64_t duration : durations[entry.second])
+                ++counts[std::upper_bound(std::begin(bounds), std::end(bounds), milliseconds(duration)) - std::begin(bounds)];
+            std::fprintf(summary, "%-16s", entry.second.c_str());
+            for (size_t count : counts)
+                std::fprintf(summary, " %6zu", count);
+            std::fprintf(summary, "\n");
+        }
+
+        if (dropped)
+            std::fprintf(summary, "\nthe earliest spans of %llu threads were overwritten before they could be written\n",
+                (unsigned long long)dropped);
+        std::fclose(summary);
+    }
+}
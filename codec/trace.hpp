@@ -0,0 +1,73 @@
+#pragma once
+
+// tracing of the encoder's hot paths, for finding out where a slow export spends its time: host
+// copy, conversion to textures, chunk compression or output. Scoped timers record spans of work
+// into a ring buffer per thread, written only by that thread, and a TraceSession writes the spans
+// recorded while it existed as Chrome trace events (chrome://tracing, Perfetto) and as a summary.
+// While no session exists a timer costs one relaxed atomic load.
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+class Trace
+{
+public:
+    static bool active() { return sessions_.load(std::memory_order_relaxed) != 0; }
+
+    // nanoseconds since the first use of tracing in the process
+    static int64_t now();
+
+    // a number for a frame that is starting to be encoded, unique in the process
+    static int64_t nextFrame();
+
+    // the frame the current thread is working on, or -1
+    static int64_t currentFrame();
+
+    static void record(const char* name, int64_t frame, int64_t start, int64_t end);
+
+private:
+    friend class TraceScope;
+    friend class TraceSession;
+
+    static std::atomic<int> sessions_;
+};
+
+// A span of work on the current thread, named by a string literal, recorded when the scope ends.
+// Scopes nested inside one for a frame, on the same thread, are recorded against that frame.
+class TraceScope
+{
+public:
+    explicit TraceScope(const char* name, int64_t frame = -1);
+    ~TraceScope();
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* name_;
+    int64_t frame_;
+    int64_t outerFrame_;
+    int64_t start_;   // -1 when not tracing
+};
+
+// Traces while it exists. When destroyed it writes the spans recorded meanwhile, on every thread,
+// to <prefix>-<n>.json as Chrome trace events and a summary of each kind of span, with a histogram
+// of their durations, to <prefix>-<n>.txt, where n counts the sessions in the process from 1.
+// Spans older than a thread's ring buffer holds are dropped, and counted in the summary.
+class TraceSession
+{
+public:
+    explicit TraceSession(std::string prefix);
+    ~TraceSession();
+
+    TraceSession(const TraceSession&) = delete;
+    TraceSession& operator=(const TraceSession&) = delete;
+
+    // the trace file, without its extension
+    const std::string& path() const { return path_; }
+
+private:
+    std::string path_;
+    int64_t start_;
+};
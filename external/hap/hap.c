@@ -46,6 +46,9 @@
 #define kHapFormatRGBADXT5 0xE
 #define kHapFormatYCoCgDXT5 0xF
 #define kHapFormatARGTC1 0x1
+#define kHapFormatRGBABC7 0xC
+#define kHapFormatRGBBC6U 0x2
+#define kHapFormatRGBBC6S 0x3
 
 /*
  Packed byte values for Hap
@@ -75,6 +78,18 @@
 #define kHapSectionChunkSizeTable 0x03
 #define kHapSectionChunkOffsetTable 0x04
 
+/*
+ HapCompressorSnappySampled compresses up to kHapSampleCount samples of a chunk, one from the middle of each of as many
+ equal parts, each a kHapSampleDivisor-th of the chunk but no longer than a Snappy block. The chunk is compressed in
+ full as soon as a sample shrinks by a kHapSampleMinSaving-th, and stored uncompressed if none does. Chunks too short
+ to give samples of kHapSampleMinLength are compressed in full.
+ */
+#define kHapSampleCount 4
+#define kHapSampleDivisor 32
+#define kHapSampleMinLength 1024
+#define kHapSampleMaxLength 65536
+#define kHapSampleMinSaving 64
+
 /*
  To decode we use a struct to store details of each chunk
  */
@@ -87,6 +102,55 @@ typedef struct HapChunkDecodeInfo {
     size_t uncompressed_chunk_size;
 } HapChunkDecodeInfo;
 
+/*
+ To encode we use a struct to store details of each chunk
+ */
+typedef struct HapChunkEncodeInfo {
+    unsigned int result;
+    unsigned int compressor;
+    unsigned int stored_compressor;
+    const char *uncompressed_chunk_data;
+    size_t uncompressed_chunk_size;
+    char *compressed_chunk_data;
+    size_t compressed_chunk_size;
+    unsigned int refer_to_input;    // when stored uncompressed, point compressed_chunk_data at the input
+    unsigned int skipped;           // stored uncompressed on the evidence of samples
+    size_t sampled_size;
+} HapChunkEncodeInfo;
+
+/*
+ The segments an encoded frame is gathered from, when it is not packed into one buffer
+ */
+typedef struct HapSegmentList {
+    HapEncodeSegment *segments;
+    unsigned int capacity;
+    unsigned int count;
+} HapSegmentList;
+
+/*
+ Appends a segment, joining it to the one before if that ends where it starts. Returns 0 if the list is full.
+ */
+static int hap_add_segment(HapSegmentList *list, const void *data, size_t length)
+{
+    if (list->count > 0)
+    {
+        HapEncodeSegment *last = &list->segments[list->count - 1];
+        if (((const uint8_t *)last->data) + last->length == (const uint8_t *)data)
+        {
+            last->length += length;
+            return 1;
+        }
+    }
+    if (list->count == list->capacity)
+    {
+        return 0;
+    }
+    list->segments[list->count].data = data;
+    list->segments[list->count].length = length;
+    list->count++;
+    return 1;
+}
+
 // TODO: rename the defines we use for codes used in stored frames
 // to better differentiate them from the enums used for the API
 
@@ -212,6 +276,12 @@ static unsigned int hap_texture_format_constant_for_format_identifier(unsigned i
             return HapTextureFormat_YCoCg_DXT5;
         case kHapFormatARGTC1:
             return HapTextureFormat_A_RGTC1;
+        case kHapFormatRGBABC7:
+            return HapTextureFormat_RGBA_BPTC_UNORM;
+        case kHapFormatRGBBC6U:
+            return HapTextureFormat_RGB_BPTC_UNSIGNED_FLOAT;
+        case kHapFormatRGBBC6S:
+            return HapTextureFormat_RGB_BPTC_SIGNED_FLOAT;
         default:
             return 0;
             
@@ -231,6 +301,12 @@ static unsigned int hap_texture_format_identifier_for_format_constant(unsigned i
             return kHapFormatYCoCgDXT5;
         case HapTextureFormat_A_RGTC1:
             return kHapFormatARGTC1;
+        case HapTextureFormat_RGBA_BPTC_UNORM:
+            return kHapFormatRGBABC7;
+        case HapTextureFormat_RGB_BPTC_UNSIGNED_FLOAT:
+            return kHapFormatRGBBC6U;
+        case HapTextureFormat_RGB_BPTC_SIGNED_FLOAT:
+            return kHapFormatRGBBC6S;
         default:
             return 0;
     }
@@ -283,7 +359,7 @@ static size_t hap_max_encoded_length(size_t input_bytes, unsigned int texture_fo
 
     decode_instructions_length = hap_decode_instructions_length(chunk_count);
 
-    if (compressor == HapCompressorSnappy)
+    if (compressor != HapCompressorNone)
     {
         size_t chunk_size = input_bytes / chunk_count;
         max_compressed_length = snappy_max_compressed_length(chunk_size) * chunk_count;
@@ -318,9 +394,102 @@ unsigned long HapMaxEncodedLength(unsigned int count,
     return total_length;
 }
 
+/*
+ Compresses samples of a chunk into its compressed_chunk_data, leaving that free for the chunk itself after, and returns
+ 1 if they show that the chunk would not shrink enough to be worth compressing in full
+ */
+static int hap_chunk_samples_incompressible(HapChunkEncodeInfo *chunk)
+{
+    size_t part_length = chunk->uncompressed_chunk_size / kHapSampleCount;
+    size_t sample_length = chunk->uncompressed_chunk_size / kHapSampleDivisor;
+    unsigned int i;
+
+    if (sample_length > kHapSampleMaxLength)
+    {
+        sample_length = kHapSampleMaxLength;
+    }
+    if (sample_length < kHapSampleMinLength)
+    {
+        return 0;
+    }
+    // whole DXT blocks, so that a sample compresses as it would within the chunk
+    sample_length &= ~(size_t)15;
+
+    for (i = 0; i < kHapSampleCount; i++)
+    {
+        size_t offset = (part_length * i + (part_length - sample_length) / 2) & ~(size_t)15;
+        size_t sample_packed_length = chunk->compressed_chunk_size;
+        if (snappy_compress(chunk->uncompressed_chunk_data + offset, sample_length, chunk->compressed_chunk_data, &sample_packed_length) != SNAPPY_OK)
+        {
+            return 0;
+        }
+        chunk->sampled_size += sample_length;
+        if (sample_packed_length + sample_length / kHapSampleMinSaving < sample_length)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ On entry compressed_chunk_size is the space available at compressed_chunk_data, on return it is the space used
+ */
+static void hap_encode_chunk(HapChunkEncodeInfo chunks[], unsigned int index)
+{
+    if (chunks)
+    {
+        HapChunkEncodeInfo *chunk = &chunks[index];
+        size_t chunk_packed_length = chunk->compressed_chunk_size;
+
+        chunk->result = HapResult_No_Error;
+        chunk->skipped = 0;
+        chunk->sampled_size = 0;
+
+        if (chunk->compressor == HapCompressorSnappySampled)
+        {
+            chunk->skipped = hap_chunk_samples_incompressible(chunk);
+        }
+
+        if (chunk->compressor != HapCompressorNone && !chunk->skipped)
+        {
+            snappy_status result = snappy_compress(chunk->uncompressed_chunk_data, chunk->uncompressed_chunk_size, chunk->compressed_chunk_data, &chunk_packed_length);
+            if (result != SNAPPY_OK)
+            {
+                chunk->result = HapResult_Internal_Error;
+                return;
+            }
+        }
+
+        if (chunk->compressor == HapCompressorNone || chunk->skipped || chunk_packed_length >= chunk->uncompressed_chunk_size)
+        {
+            // store the chunk uncompressed
+            if (chunk->refer_to_input)
+            {
+                chunk->compressed_chunk_data = (char *)chunk->uncompressed_chunk_data;
+            }
+            else
+            {
+                memcpy(chunk->compressed_chunk_data, chunk->uncompressed_chunk_data, chunk->uncompressed_chunk_size);
+            }
+            chunk_packed_length = chunk->uncompressed_chunk_size;
+            chunk->stored_compressor = kHapCompressorNone;
+        }
+        else
+        {
+            // ie we used snappy and saved some space
+            chunk->stored_compressor = kHapCompressorSnappy;
+        }
+        chunk->compressed_chunk_size = chunk_packed_length;
+    }
+}
+
 static unsigned int hap_encode_texture(const void *inputBuffer, unsigned long inputBufferBytes, unsigned int textureFormat,
-                                       unsigned int compressor, unsigned int chunkCount, void *outputBuffer,
-                                       unsigned long outputBufferBytes, unsigned long *outputBufferBytesUsed)
+                                       unsigned int compressor, unsigned int chunkCount,
+                                       HapEncodeCallback callback, void *info,
+                                       void *outputBuffer, unsigned long outputBufferBytes, unsigned long *outputBufferBytesUsed,
+                                       HapSegmentList *segments, HapEncodeChunkStats *chunkStats)
 {
     size_t top_section_header_length;
     size_t top_section_length;
@@ -336,9 +505,13 @@ static unsigned int hap_encode_texture(const void *inputBuffer, unsigned long in
             && textureFormat != HapTextureFormat_RGBA_DXT5
             && textureFormat != HapTextureFormat_YCoCg_DXT5
             && textureFormat != HapTextureFormat_A_RGTC1
+            && textureFormat != HapTextureFormat_RGBA_BPTC_UNORM
+            && textureFormat != HapTextureFormat_RGB_BPTC_UNSIGNED_FLOAT
+            && textureFormat != HapTextureFormat_RGB_BPTC_SIGNED_FLOAT
             )
         || (compressor != HapCompressorNone
             && compressor != HapCompressorSnappy
+            && compressor != HapCompressorSnappySampled
             )
         || outputBuffer == NULL
         || outputBufferBytesUsed == NULL
@@ -367,7 +540,7 @@ static unsigned int hap_encode_texture(const void *inputBuffer, unsigned long in
         top_section_header_length = 4U;
     }
 
-    if (compressor == HapCompressorSnappy)
+    if (compressor != HapCompressorNone)
     {
         /*
          We attempt to chunk as requested, and if resulting frame is larger than it is uncompressed then
@@ -379,6 +552,13 @@ static unsigned int hap_encode_texture(const void *inputBuffer, unsigned long in
         uint8_t *second_stage_compressor_table;
         void *chunk_size_table;
         char *compressed_data;
+        HapChunkEncodeInfo *chunk_info;
+        HapEncodeChunkStats texture_stats = { 0 };
+        unsigned char *decisions = NULL;    // this texture's in chunkStats->chunkDecisions
+        unsigned int decisions_length = 0;
+        unsigned int result = HapResult_No_Error;
+        unsigned int first_segment = 0;
+        unsigned long first_segment_length = 0;
         unsigned int i;
 
         chunkCount = hap_limited_chunk_count_for_frame(inputBufferBytes, textureFormat, chunkCount);
@@ -408,34 +588,144 @@ static unsigned int hap_encode_texture(const void *inputBuffer, unsigned long in
 
         top_section_length = 4 + decode_instructions_length;
 
+        if (segments)
+        {
+            // note where the list stood, in case the texture is stored uncompressed after all
+            first_segment = segments->count;
+            first_segment_length = first_segment ? segments->segments[first_segment - 1].length : 0;
+        }
+        if (segments && !hap_add_segment(segments, outputBuffer, top_section_header_length + top_section_length))
+        {
+            return HapResult_Buffer_Too_Small;
+        }
+
+        chunk_info = (HapChunkEncodeInfo *)malloc(sizeof(HapChunkEncodeInfo) * chunkCount);
+        if (chunk_info == NULL)
+        {
+            return HapResult_Internal_Error;
+        }
+
         for (i = 0; i < chunkCount; i++) {
-            size_t chunk_packed_length = compress_buffer_remaining;
-            const char *chunk_input_start = (const char *)(((uint8_t *)inputBuffer) + (chunk_size * i));
-            if (compressor == HapCompressorSnappy)
-            {
-                snappy_status result = snappy_compress(chunk_input_start, chunk_size, (char *)compressed_data, &chunk_packed_length);
-                if (result != SNAPPY_OK)
+            chunk_info[i].result = HapResult_No_Error;
+            chunk_info[i].compressor = compressor;
+            chunk_info[i].uncompressed_chunk_data = (const char *)(((uint8_t *)inputBuffer) + (chunk_size * i));
+            chunk_info[i].uncompressed_chunk_size = chunk_size;
+            chunk_info[i].refer_to_input = (segments != NULL);
+        }
+
+        if (callback == NULL)
+        {
+            /*
+             Compress each chunk directly into place after the one before it
+             */
+            for (i = 0; i < chunkCount; i++) {
+                chunk_info[i].compressed_chunk_data = compressed_data;
+                chunk_info[i].compressed_chunk_size = compress_buffer_remaining;
+                hap_encode_chunk(chunk_info, i);
+                if (chunk_info[i].result != HapResult_No_Error)
+                {
+                    result = chunk_info[i].result;
+                    break;
+                }
+                if (segments && !hap_add_segment(segments, chunk_info[i].compressed_chunk_data, chunk_info[i].compressed_chunk_size))
+                {
+                    result = HapResult_Buffer_Too_Small;
+                    break;
+                }
+                compressed_data += chunk_info[i].compressed_chunk_size;
+                compress_buffer_remaining -= chunk_info[i].compressed_chunk_size;
+            }
+        }
+        else
+        {
+            /*
+             Give each chunk its own worst-case sized region of the output so that they can be compressed
+             in parallel, then pack them down in order. A chunk never moves forward, so packing in order
+             does not overwrite any chunk that has yet to be moved. When gathering segments the chunks are
+             left where they are.
+             */
+            size_t chunk_region_length = snappy_max_compressed_length(chunk_size);
+
+            for (i = 0; i < chunkCount; i++) {
+                chunk_info[i].compressed_chunk_data = compressed_data + (chunk_region_length * i);
+                chunk_info[i].compressed_chunk_size = chunk_region_length;
+            }
+
+            callback((HapEncodeWorkFunction)hap_encode_chunk, chunk_info, chunkCount, info);
+
+            for (i = 0; i < chunkCount; i++) {
+                if (chunk_info[i].result != HapResult_No_Error)
                 {
-                    return HapResult_Internal_Error;
+                    result = chunk_info[i].result;
+                    break;
+                }
+                if (segments)
+                {
+                    if (!hap_add_segment(segments, chunk_info[i].compressed_chunk_data, chunk_info[i].compressed_chunk_size))
+                    {
+                        result = HapResult_Buffer_Too_Small;
+                        break;
+                    }
                 }
+                else if (chunk_info[i].compressed_chunk_data != compressed_data)
+                {
+                    memmove(compressed_data, chunk_info[i].compressed_chunk_data, chunk_info[i].compressed_chunk_size);
+                }
+                compressed_data += chunk_info[i].compressed_chunk_size;
             }
+        }
 
-            if (compressor == HapCompressorNone || chunk_packed_length >= chunk_size)
+        if (result == HapResult_No_Error && chunkStats && chunkStats->chunkDecisions)
+        {
+            unsigned int decided = chunkStats->compressedChunks + chunkStats->storedChunks + chunkStats->skippedChunks;
+            if (decided < chunkStats->chunkDecisionsCapacity)
             {
-                // store the chunk uncompressed
-                memcpy(compressed_data, chunk_input_start, chunk_size);
-                chunk_packed_length = chunk_size;
-                second_stage_compressor_table[i] = kHapCompressorNone;
+                decisions = chunkStats->chunkDecisions + decided;
+                decisions_length = chunkStats->chunkDecisionsCapacity - decided;
+                if (decisions_length > chunkCount)
+                {
+                    decisions_length = chunkCount;
+                }
             }
-            else
-            {
-                // ie we used snappy and saved some space
-                second_stage_compressor_table[i] = kHapCompressorSnappy;
+        }
+
+        if (result == HapResult_No_Error)
+        {
+            for (i = 0; i < chunkCount; i++) {
+                unsigned char decision;
+                second_stage_compressor_table[i] = chunk_info[i].stored_compressor;
+                hap_write_4_byte_uint(((uint8_t *)chunk_size_table) + (i * 4), chunk_info[i].compressed_chunk_size);
+                top_section_length += chunk_info[i].compressed_chunk_size;
+
+                if (chunk_info[i].skipped)
+                {
+                    decision = HapChunkDecision_Skipped;
+                    texture_stats.skippedChunks++;
+                    texture_stats.skippedBytes += chunk_info[i].uncompressed_chunk_size;
+                }
+                else if (chunk_info[i].stored_compressor == kHapCompressorSnappy)
+                {
+                    decision = HapChunkDecision_Compressed;
+                    texture_stats.compressedChunks++;
+                }
+                else
+                {
+                    decision = HapChunkDecision_Stored;
+                    texture_stats.storedChunks++;
+                }
+                texture_stats.sampledBytes += chunk_info[i].sampled_size;
+                if (i < decisions_length)
+                {
+                    decisions[i] = decision;
+                }
             }
-            hap_write_4_byte_uint(((uint8_t *)chunk_size_table) + (i * 4), chunk_packed_length);
-            compressed_data += chunk_packed_length;
-            top_section_length += chunk_packed_length;
-            compress_buffer_remaining -= chunk_packed_length;
+        }
+
+        free(chunk_info);
+
+        if (result != HapResult_No_Error)
+        {
+            return result;
         }
 
         if (top_section_length < inputBufferBytes + top_section_header_length)
@@ -447,12 +737,50 @@ static unsigned int hap_encode_texture(const void *inputBuffer, unsigned long in
         {
             // Signal to store the frame uncompressed
             compressor = HapCompressorNone;
+            texture_stats.storedChunks += texture_stats.compressedChunks;
+            texture_stats.compressedChunks = 0;
+            for (i = 0; i < decisions_length; i++)
+            {
+                if (decisions[i] == HapChunkDecision_Compressed)
+                {
+                    decisions[i] = HapChunkDecision_Stored;
+                }
+            }
+            if (segments)
+            {
+                segments->count = first_segment;
+                if (first_segment)
+                {
+                    segments->segments[first_segment - 1].length = first_segment_length;
+                }
+            }
+        }
+
+        if (chunkStats)
+        {
+            chunkStats->compressedChunks += texture_stats.compressedChunks;
+            chunkStats->storedChunks += texture_stats.storedChunks;
+            chunkStats->skippedChunks += texture_stats.skippedChunks;
+            chunkStats->sampledBytes += texture_stats.sampledBytes;
+            chunkStats->skippedBytes += texture_stats.skippedBytes;
         }
     }
 
     if (compressor == HapCompressorNone)
     {
-        memcpy(((uint8_t *)outputBuffer) + top_section_header_length, inputBuffer, inputBufferBytes);
+        if (segments)
+        {
+            // refer to the input rather than copying it
+            if (!hap_add_segment(segments, outputBuffer, top_section_header_length)
+                || !hap_add_segment(segments, inputBuffer, inputBufferBytes))
+            {
+                return HapResult_Buffer_Too_Small;
+            }
+        }
+        else
+        {
+            memcpy(((uint8_t *)outputBuffer) + top_section_header_length, inputBuffer, inputBufferBytes);
+        }
         top_section_length = inputBufferBytes;
         storedCompressor = kHapCompressorNone;
     }
@@ -473,9 +801,44 @@ unsigned int HapEncode(unsigned int count,
                        unsigned int *chunkCounts,
                        void *outputBuffer, unsigned long outputBufferBytes,
                        unsigned long *outputBufferBytesUsed)
+{
+    return HapEncodeWithCallback(count,
+                                 inputBuffers, inputBuffersBytes,
+                                 textureFormats,
+                                 compressors,
+                                 chunkCounts,
+                                 NULL, NULL,
+                                 outputBuffer, outputBufferBytes,
+                                 outputBufferBytesUsed,
+                                 NULL);
+}
+
+// zeroes the counts of chunkStats, keeping the caller's chunkDecisions
+static void hap_reset_chunk_stats(HapEncodeChunkStats *chunkStats)
+{
+    if (chunkStats)
+    {
+        unsigned char *chunkDecisions = chunkStats->chunkDecisions;
+        unsigned int chunkDecisionsCapacity = chunkStats->chunkDecisionsCapacity;
+        memset(chunkStats, 0, sizeof(HapEncodeChunkStats));
+        chunkStats->chunkDecisions = chunkDecisions;
+        chunkStats->chunkDecisionsCapacity = chunkDecisionsCapacity;
+    }
+}
+
+static unsigned int hap_encode_frame(unsigned int count,
+                                     const void **inputBuffers, unsigned long *inputBuffersBytes,
+                                     unsigned int *textureFormats,
+                                     unsigned int *compressors,
+                                     unsigned int *chunkCounts,
+                                     HapEncodeCallback callback, void *info,
+                                     void *outputBuffer, unsigned long outputBufferBytes,
+                                     unsigned long *outputBufferBytesUsed,
+                                     HapSegmentList *segments, HapEncodeChunkStats *chunkStats)
 {
     size_t top_section_header_length;
     size_t top_section_length;
+    size_t section_offset;
     unsigned long section_length;
 
     if (count == 0 || count > 2 // A frame must contain one or two textures
@@ -499,9 +862,11 @@ unsigned int HapEncode(unsigned int count,
                                   textureFormats[0],
                                   compressors[0],
                                   chunkCounts[0],
+                                  callback, info,
                                   outputBuffer,
                                   outputBufferBytes,
-                                  outputBufferBytesUsed);
+                                  outputBufferBytesUsed,
+                                  segments, chunkStats);
     }
     else if ((textureFormats[0] != HapTextureFormat_YCoCg_DXT5 && textureFormats[1] != HapTextureFormat_YCoCg_DXT5)
              && (textureFormats[0] != HapTextureFormat_A_RGTC1 && textureFormats[1] != HapTextureFormat_A_RGTC1))
@@ -530,24 +895,41 @@ unsigned int HapEncode(unsigned int count,
             top_section_header_length = 4U;
         }
 
-        // Encode each texture
+        if (segments && !hap_add_segment(segments, outputBuffer, top_section_header_length))
+        {
+            return HapResult_Buffer_Too_Small;
+        }
+
+        // Encode each texture, each after the one before or, when gathering segments, after the
+        // worst case of the one before as its chunks stay where they were compressed
         top_section_length = 0;
+        section_offset = top_section_header_length;
         for (unsigned int i = 0; i < count; i++)
         {
-            void *section = ((uint8_t *)outputBuffer) + top_section_header_length + top_section_length;
+            void *section = ((uint8_t *)outputBuffer) + section_offset;
             unsigned int result = hap_encode_texture(inputBuffers[i],
                                                      inputBuffersBytes[i],
                                                      textureFormats[i],
                                                      compressors[i],
                                                      chunkCounts[i],
+                                                     callback, info,
                                                      section,
-                                                     outputBufferBytes - (top_section_header_length + top_section_length),
-                                                     &section_length);
+                                                     outputBufferBytes - section_offset,
+                                                     &section_length,
+                                                     segments, chunkStats);
             if (result != HapResult_No_Error)
             {
                 return result;
             }
             top_section_length += section_length;
+            if (segments)
+            {
+                section_offset += hap_max_encoded_length(inputBuffersBytes[i], textureFormats[i], compressors[i], chunkCounts[i]);
+            }
+            else
+            {
+                section_offset += section_length;
+            }
         }
 
         hap_write_section_header(outputBuffer, top_section_header_length, top_section_length, kHapSectionMultipleImages);
@@ -558,6 +940,65 @@ unsigned int HapEncode(unsigned int count,
     }
 }
 
+unsigned int HapEncodeWithCallback(unsigned int count,
+                                   const void **inputBuffers, unsigned long *inputBuffersBytes,
+                                   unsigned int *textureFormats,
+                                   unsigned int *compressors,
+                                   unsigned int *chunkCounts,
+                                   HapEncodeCallback callback, void *info,
+                                   void *outputBuffer, unsigned long outputBufferBytes,
+                                   unsigned long *outputBufferBytesUsed,
+                                   HapEncodeChunkStats *chunkStats)
+{
+    hap_reset_chunk_stats(chunkStats);
+    return hap_encode_frame(count,
+                            inputBuffers, inputBuffersBytes,
+                            textureFormats,
+                            compressors,
+                            chunkCounts,
+                            callback, info,
+                            outputBuffer, outputBufferBytes,
+                            outputBufferBytesUsed,
+                            NULL, chunkStats);
+}
+
+unsigned int HapEncodeSegmentsWithCallback(unsigned int count,
+                                           const void **inputBuffers, unsigned long *inputBuffersBytes,
+                                           unsigned int *textureFormats,
+                                           unsigned int *compressors,
+                                           unsigned int *chunkCounts,
+                                           HapEncodeCallback callback, void *info,
+                                           void *workBuffer, unsigned long workBufferBytes,
+                                           HapEncodeSegment *segments, unsigned int segmentsCapacity,
+                                           unsigned int *segmentCount,
+                                           unsigned long *outputBufferBytesUsed,
+                                           HapEncodeChunkStats *chunkStats)
+{
+    HapSegmentList list;
+    unsigned int result;
+
+    if (segments == NULL || segmentCount == NULL)
+    {
+        return HapResult_Bad_Arguments;
+    }
+    hap_reset_chunk_stats(chunkStats);
+
+    list.segments = segments;
+    list.capacity = segmentsCapacity;
+    list.count = 0;
+    result = hap_encode_frame(count,
+                              inputBuffers, inputBuffersBytes,
+                              textureFormats,
+                              compressors,
+                              chunkCounts,
+                              callback, info,
+                              workBuffer, workBufferBytes,
+                              outputBufferBytesUsed,
+                              &list, chunkStats);
+    *segmentCount = list.count;
+    return result;
+}
+
 static void hap_decode_chunk(HapChunkDecodeInfo chunks[], unsigned int index)
 {
     if (chunks)
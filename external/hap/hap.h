@@ -33,20 +33,26 @@ extern "C" {
 #endif
 
 /*
- These match the constants defined by GL_EXT_texture_compression_s3tc and
- GL_ARB_texture_compression_rgtc
+ These match the constants defined by GL_EXT_texture_compression_s3tc,
+ GL_ARB_texture_compression_rgtc and GL_ARB_texture_compression_bptc
  */
 
 enum HapTextureFormat {
     HapTextureFormat_RGB_DXT1 = 0x83F0,
     HapTextureFormat_RGBA_DXT5 = 0x83F3,
     HapTextureFormat_YCoCg_DXT5 = 0x01,
-    HapTextureFormat_A_RGTC1 = 0x8DBB
+    HapTextureFormat_A_RGTC1 = 0x8DBB,
+    HapTextureFormat_RGBA_BPTC_UNORM = 0x8E8C,
+    HapTextureFormat_RGB_BPTC_SIGNED_FLOAT = 0x8E8E,
+    HapTextureFormat_RGB_BPTC_UNSIGNED_FLOAT = 0x8E8F
 };
 
 enum HapCompressor {
     HapCompressorNone,
-    HapCompressorSnappy
+    HapCompressorSnappy,
+    HapCompressorSnappySampled  // Snappy, except that chunks which samples show would not shrink are stored
+                                // uncompressed without compressing them in full; the frame is written as with
+                                // HapCompressorSnappy
 };
 
 enum HapResult {
@@ -63,6 +69,38 @@ enum HapResult {
 typedef void (*HapDecodeWorkFunction)(void *p, unsigned int index);
 typedef void (*HapDecodeCallback)(HapDecodeWorkFunction function, void *p, unsigned int count, void *info);
 
+/*
+ See HapEncodeWithCallback for descriptions of these function types.
+ */
+typedef void (*HapEncodeWorkFunction)(void *p, unsigned int index);
+typedef void (*HapEncodeCallback)(HapEncodeWorkFunction function, void *p, unsigned int count, void *info);
+
+/*
+ How a chunk of an encoded frame was stored. See HapEncodeChunkStats.
+ */
+enum HapChunkDecision {
+    HapChunkDecision_Compressed,    // stored compressed
+    HapChunkDecision_Stored,        // compressed in full, but stored uncompressed
+    HapChunkDecision_Skipped        // stored uncompressed as samples showed it would not shrink
+};
+
+/*
+ How the chunks of an encoded frame were stored. See HapEncodeWithCallback.
+ chunkDecisions and chunkDecisionsCapacity are set by the caller, and the rest by the encoder. If chunkDecisions is not
+ NULL, a HapChunkDecision is written to it for each chunk of each texture with a second-stage compressor, in turn,
+ up to chunkDecisionsCapacity of them; the sum of chunkCounts is always enough.
+ */
+typedef struct HapEncodeChunkStats {
+    unsigned int compressedChunks;  // stored compressed
+    unsigned int storedChunks;      // compressed in full, but stored uncompressed as they did not shrink, or as the
+                                    // texture was smaller stored uncompressed
+    unsigned int skippedChunks;     // stored uncompressed as samples showed they would not shrink
+    unsigned long sampledBytes;     // compressed to decide which chunks to skip
+    unsigned long skippedBytes;     // of the skipped chunks, which were not compressed in full
+    unsigned char *chunkDecisions;
+    unsigned int chunkDecisionsCapacity;
+} HapEncodeChunkStats;
+
 /*
  Returns the maximum size of an output buffer for a frame composed of multiple textures.
  count is the number of textures
@@ -100,6 +138,73 @@ unsigned int HapEncode(unsigned int count,
                        void *outputBuffer, unsigned long outputBufferBytes,
                        unsigned long *outputBufferBytesUsed);
 
+/*
+ As HapEncode, but permits the chunks of a texture to be compressed in parallel.
+
+ For each texture compressed with a second-stage compressor, callback will be called once for you to invoke a
+ platform-appropriate mechanism to assign work to threads, and trigger that work by calling the function passed to your
+ callback the number of times indicated by the count argument (one per chunk), usually from a number of different
+ threads. This callback must not return until all the work has been completed. Chunks are compressed into separate
+ regions of outputBuffer and then packed together, so the encoded frame is identical to that produced by HapEncode.
+
+ void MyHapEncodeCallback(HapEncodeWorkFunction function, void *p, unsigned int count, void *info)
+ {
+     int i;
+     for (i = 0; i < count; i++) {
+         // Invoke your multithreading mechanism to cause this function to be called
+         // on a suitable number of threads.
+         function(p, i);
+     }
+ }
+ info is an argument for your own use to pass context to the callback.
+ callback may be NULL, in which case chunks are compressed in turn on the calling thread.
+ chunkStats may be NULL; otherwise it will be set to how the frame's chunks were stored, and each chunk's decision
+ recorded if it asks for them.
+ */
+unsigned int HapEncodeWithCallback(unsigned int count,
+                                   const void **inputBuffers, unsigned long *inputBuffersBytes,
+                                   unsigned int *textureFormats,
+                                   unsigned int *compressors,
+                                   unsigned int *chunkCounts,
+                                   HapEncodeCallback callback, void *info,
+                                   void *outputBuffer, unsigned long outputBufferBytes,
+                                   unsigned long *outputBufferBytesUsed,
+                                   HapEncodeChunkStats *chunkStats);
+
+/*
+ A run of bytes of an encoded frame. See HapEncodeSegmentsWithCallback.
+ */
+typedef struct HapEncodeSegment {
+    const void *data;
+    unsigned long length;
+} HapEncodeSegment;
+
+/*
+ As HapEncodeWithCallback, but rather than packing the encoded frame into one buffer, describes it as segments which,
+ joined in order, make the frame, so that a caller can gather it straight into its final destination. Chunks are left
+ in the regions of workBuffer they were compressed into, and a texture stored without second-stage compression refers
+ to its input buffer rather than being copied, as does a chunk stored uncompressed.
+
+ workBuffer must be at least as long as HapMaxEncodedLength() gives, and it and the input buffers must be left
+ unchanged for as long as the segments are used.
+ segments is an array of segmentsCapacity entries; one, and two for each texture plus one for each chunk, is always
+ enough.
+ segmentCount will be set to the number of segments used
+ outputBufferBytesUsed will be set to the total length of the segments
+ chunkStats is as for HapEncodeWithCallback
+ */
+unsigned int HapEncodeSegmentsWithCallback(unsigned int count,
+                                           const void **inputBuffers, unsigned long *inputBuffersBytes,
+                                           unsigned int *textureFormats,
+                                           unsigned int *compressors,
+                                           unsigned int *chunkCounts,
+                                           HapEncodeCallback callback, void *info,
+                                           void *workBuffer, unsigned long workBufferBytes,
+                                           HapEncodeSegment *segments, unsigned int segmentsCapacity,
+                                           unsigned int *segmentCount,
+                                           unsigned long *outputBufferBytesUsed,
+                                           HapEncodeChunkStats *chunkStats);
+
 /*
  Decodes a texture from inputBuffer which is a Hap frame.
 
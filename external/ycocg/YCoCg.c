@@ -29,6 +29,14 @@
 #include <stdint.h>
 #include "ImageMath.h"
 
+/*
+ vImage is used for the matrix multiply on macOS; elsewhere use SSE2 for conversions to CoCgAY
+ */
+#if !defined(__APPLE__) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define YCOCG_USE_SSE2
+#include <emmintrin.h>
+#endif
+
 /*
  RGB <-> YCoCg
  Y  = [1/4  1/2  1/4][R]
@@ -40,8 +48,69 @@
  B  = [1   -1   -1] [Cg]
  */
 
+#ifdef YCOCG_USE_SSE2
+/*
+ Produces the same result as the matrices below:
+ Co = (2R - 2B + 512) / 4
+ Cg = (-R + 2G - B + 512) / 4
+ A  = A
+ Y  = (R + 2G + B) / 4
+ All the numerators are positive and no result needs clamping, so the divisions are shifts.
+ red_shift is 0 when red is the first byte of a pixel (RGBA) and 16 when it is the third (BGRA).
+ */
+static void ConvertToCoCgAY8888_SSE2( const uint8_t *src, uint8_t *dst, unsigned long width, unsigned long height, size_t src_rowbytes, size_t dst_rowbytes, int red_shift )
+{
+    const int blue_shift = 16 - red_shift;
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    const __m128i bias_co = _mm_set1_epi32(256);
+    const __m128i bias_cg = _mm_set1_epi32(512);
+    unsigned long y, x;
+
+    for (y = 0; y < height; y++)
+    {
+        const uint8_t *pixel_src = src + y * src_rowbytes;
+        uint8_t *pixel_dst = dst + y * dst_rowbytes;
+
+        for (x = 0; x + 4 <= width; x += 4)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(pixel_src + x * 4));
+            __m128i r = _mm_and_si128(_mm_srl_epi32(v, _mm_cvtsi32_si128(red_shift)), mask);
+            __m128i g2 = _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(v, 8), mask), 1);
+            __m128i b = _mm_and_si128(_mm_srl_epi32(v, _mm_cvtsi32_si128(blue_shift)), mask);
+            __m128i a = _mm_srli_epi32(v, 24);
+            __m128i rb = _mm_add_epi32(r, b);
+
+            __m128i co = _mm_srli_epi32(_mm_add_epi32(_mm_sub_epi32(r, b), bias_co), 1);
+            __m128i cg = _mm_srli_epi32(_mm_sub_epi32(_mm_add_epi32(g2, bias_cg), rb), 2);
+            __m128i luma = _mm_srli_epi32(_mm_add_epi32(rb, g2), 2);
+
+            __m128i out = _mm_or_si128(_mm_or_si128(co, _mm_slli_epi32(cg, 8)),
+                                       _mm_or_si128(_mm_slli_epi32(a, 16), _mm_slli_epi32(luma, 24)));
+            _mm_storeu_si128((__m128i *)(pixel_dst + x * 4), out);
+        }
+
+        for (; x < width; x++)
+        {
+            const uint8_t *p = pixel_src + x * 4;
+            int r = p[red_shift / 8];
+            int g = p[1];
+            int b = p[blue_shift / 8];
+
+            pixel_dst[x * 4 + 0] = (uint8_t)((r - b + 256) >> 1);
+            pixel_dst[x * 4 + 1] = (uint8_t)((2 * g - r - b + 512) >> 2);
+            pixel_dst[x * 4 + 2] = p[3];
+            pixel_dst[x * 4 + 3] = (uint8_t)((r + 2 * g + b) >> 2);
+        }
+    }
+}
+#endif
+
 void ConvertRGBAToCoCgAY8888( const uint8_t *src, uint8_t *dst, unsigned long width, unsigned long height, size_t src_rowbytes, size_t dst_rowbytes, int allow_tile )
 {
+#ifdef YCOCG_USE_SSE2
+    ConvertToCoCgAY8888_SSE2(src, dst, width, height, src_rowbytes, dst_rowbytes, 0);
+    (void)allow_tile;
+#else
     const int32_t post_bias[4] = { 512, 512, 0, 0 };
     
     const int16_t matrix[16] = {
@@ -52,6 +121,7 @@ void ConvertRGBAToCoCgAY8888( const uint8_t *src, uint8_t *dst, unsigned long wi
     };
     
     ImageMath_MatrixMultiply8888(src, src_rowbytes, dst, dst_rowbytes, width, height, matrix, 4, NULL, post_bias, allow_tile);
+#endif
 }
 
 void ConvertCoCgAY8888ToRGBA( const uint8_t *src, uint8_t *dst, unsigned long width, unsigned long height, size_t src_rowbytes, size_t dst_rowbytes, int allow_tile )
@@ -71,6 +141,10 @@ void ConvertCoCgAY8888ToRGBA( const uint8_t *src, uint8_t *dst, unsigned long wi
 
 void ConvertBGRAToCoCgAY8888( const uint8_t *src, uint8_t *dst, unsigned long width, unsigned long height, size_t src_rowbytes, size_t dst_rowbytes, int allow_tile )
 {
+#ifdef YCOCG_USE_SSE2
+    ConvertToCoCgAY8888_SSE2(src, dst, width, height, src_rowbytes, dst_rowbytes, 16);
+    (void)allow_tile;
+#else
     const int32_t post_bias[4] = { 512, 512, 0, 0 };
     
     const int16_t matrix[16] = {
@@ -81,6 +155,7 @@ void ConvertBGRAToCoCgAY8888( const uint8_t *src, uint8_t *dst, unsigned long wi
     };
     
     ImageMath_MatrixMultiply8888(src, src_rowbytes, dst, dst_rowbytes, width, height, matrix, 4, NULL, post_bias, allow_tile);
+#endif
 }
 
 void ConvertCoCgAY8888ToBGRA( const uint8_t *src, uint8_t *dst, unsigned long width, unsigned long height, size_t src_rowbytes, size_t dst_rowbytes, int allow_tile )
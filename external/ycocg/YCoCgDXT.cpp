@@ -70,9 +70,17 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #include "YCoCgDXT.h"
+#include "YCoCgDXTBlock.h"
 #include <string.h>
 #include <stdlib.h>
 
+#ifdef YCOCG_DXT_SIMD
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+#endif
+
 /* ALWAYS_INLINE */
 /* Derived from EAWebKit's AlwaysInline.h, losing some of its support for other compilers */
 
@@ -127,7 +135,7 @@ typedef unsigned int    dword;
 
 #define NVIDIA_G7X_HARDWARE_BUG_FIX     // keep the colors sorted as: max, min
 
-#if defined(__LITTLE_ENDIAN__) || defined(_WIN32)
+#if defined(__LITTLE_ENDIAN__) || defined(_WIN32) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
 #define EA_SYSTEM_LITTLE_ENDIAN
 #endif
 
@@ -163,15 +171,16 @@ static ALWAYS_INLINE void ExtractBlock( const byte *inPtr, const int stride, byt
 
 // This box extract replicates the last rows and columns if the row or columns are not 4 texels aligned
 // This is so we don't get random pixels which could affect the color interpolation
+// Texels are copied with memcpy rather than through int pointers, which would break aliasing rules.
 static void ExtractBlock( const byte *inPtr, const int stride, const int widthRemain, const int heightRemain, byte *colorBlock ) {
-    int *pBlock32 = (int *) colorBlock;  // Since we are using ARGA, we assume 4 byte alignment is already being used
-    int *pSource32 = (int*) inPtr; 
+    byte *pBlock = colorBlock;
+    const byte *pSource = inPtr;
     
     int hIndex=0;
     for(int j =0; j < 4; j++) {
         int wIndex = 0;
         for(int i=0; i < 4; i++) {
-            pBlock32[i] = pSource32[wIndex];    
+            memcpy( &pBlock[i * 4], &pSource[wIndex * 4], 4 );
             // Set up offset for next column source (keep existing if we are at the end)         
             if(wIndex < (widthRemain - 1)) {
                 wIndex++;
@@ -179,9 +188,9 @@ static void ExtractBlock( const byte *inPtr, const int stride, const int widthRe
         }
         
         // Set up offset for next texel row source (keep existing if we are at the end)
-        pBlock32 +=4;    
+        pBlock += 4 * 4;
         if(hIndex < (heightRemain-1)) {
-            pSource32 +=(stride >> 2);
+            pSource += stride;
             hIndex++;
         }
     }
@@ -299,10 +308,11 @@ static void SelectYCoCgDiagonal( const byte *colorBlock, byte *minColor, byte *m
     byte mid0 = ( (int) minColor[0] + maxColor[0] + 1 ) >> 1;
     byte mid1 = ( (int) minColor[1] + maxColor[1] + 1 ) >> 1;
     
-    byte side = 0;
+    // counted in ints: GCC 12's SLP vectorizer adds byte-sized ( b0 ^ b1 ) as 0 or -1 at -O3
+    int side = 0;
     for ( int i = 0; i < 16; i++ ) {
-        byte b0 = colorBlock[i*4+0] >= mid0;
-        byte b1 = colorBlock[i*4+1] >= mid1;
+        int b0 = colorBlock[i*4+0] >= mid0 ? 1 : 0;
+        int b1 = colorBlock[i*4+1] >= mid1 ? 1 : 0;
         side += ( b0 ^ b1 );
     }
     
@@ -415,7 +425,7 @@ static void EmitColorIndices( const byte *colorBlock, const byte *minColor, cons
 
 /*F*************************************************************************************************/
 /*!
- \Function    CompressYCoCgDXT5( const byte *inBuf, byte *outBuf, const int width, const int height, const int stride ) 
+ \Function    CompressYCoCgDXT5Reference( const byte *inBuf, byte *outBuf, const int width, const int height, const int stride ) 
  
  \Description        This is the C version of the YcoCgDXT5.  
  
@@ -451,7 +461,7 @@ static void EmitColorIndices( const byte *colorBlock, const byte *minColor, cons
  1.2     1/10/10 Added stride
  */
 /*************************************************************************************************F*/
-extern "C" int CompressYCoCgDXT5( const byte *inBuf, byte *outBuf, const int width, const int height , const int stride) {
+extern "C" int CompressYCoCgDXT5Reference( const byte *inBuf, byte *outBuf, const int width, const int height , const int stride) {
     
     int outputBytes =0;
     
@@ -498,6 +508,60 @@ extern "C" int CompressYCoCgDXT5( const byte *inBuf, byte *outBuf, const int wid
     return outputBytes;
 }
 
+// Runtime selection of the vectorized encoders, which produce the same output as the reference.
+// Builds other than MSVC's require SSE4.1 throughout, so there the reference is used only on
+// platforms without YCOCG_DXT_SIMD.
+
+typedef int (*CompressYCoCgDXT5Function)( const byte *inBuf, byte *outBuf, const int width, const int height, const int stride );
+
+#ifdef YCOCG_DXT_SIMD
+static bool HasSSE41() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid( info, 1 );
+    return ( info[2] & ( 1 << 19 ) ) != 0;
+#else
+    return __builtin_cpu_supports( "sse4.1" );
+#endif
+}
+
+static bool HasAVX2() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid( info, 0 );
+    if ( info[0] < 7 ) {
+        return false;
+    }
+    __cpuid( info, 1 );
+    // the OS must save the YMM registers (OSXSAVE, AVX, XCR0 bits 1 and 2)
+    if ( ( info[2] & ( 1 << 27 ) ) == 0 || ( info[2] & ( 1 << 28 ) ) == 0 || ( _xgetbv( 0 ) & 6 ) != 6 ) {
+        return false;
+    }
+    __cpuidex( info, 7, 0 );
+    return ( info[1] & ( 1 << 5 ) ) != 0;
+#else
+    return __builtin_cpu_supports( "avx2" );
+#endif
+}
+#endif
+
+static CompressYCoCgDXT5Function SelectCompressYCoCgDXT5() {
+#ifdef YCOCG_DXT_SIMD
+    if ( HasAVX2() ) {
+        return CompressYCoCgDXT5_AVX2;
+    }
+    if ( HasSSE41() ) {
+        return CompressYCoCgDXT5_SSE41;
+    }
+#endif
+    return CompressYCoCgDXT5Reference;
+}
+
+extern "C" int CompressYCoCgDXT5( const byte *inBuf, byte *outBuf, const int width, const int height, const int stride ) {
+    static const CompressYCoCgDXT5Function compress = SelectCompressYCoCgDXT5();
+    return compress( inBuf, outBuf, width, height, stride );
+}
+
 
 //--- YCoCgDXT5 Decompression ---
 static void RestoreLumaAlphaBlock(  const void * pSource, byte * colorBlock){
@@ -562,12 +626,21 @@ static ALWAYS_INLINE short ShortFlipBytes( short raw )
 }
 #endif
 
+// reads a short from byte storage without breaking aliasing rules
+static ALWAYS_INLINE unsigned short LoadUShort( const byte *p )
+{
+    unsigned short value;
+    memcpy( &value, p, 2 );
+    return value;
+}
+
 static void RestoreChromaBlock( const void * pSource, byte *colorBlock)
 {
-    unsigned short *pS =(unsigned short *) pSource;
-    pS +=4;  // Color info stars after 8 bytes (first 8 is the Y/alpha channel info)
+    const byte *pS = (const byte *) pSource;
+    pS +=8;  // Color info stars after 8 bytes (first 8 is the Y/alpha channel info)
     
-    unsigned short rawColor = *pS++;     
+    unsigned short rawColor = LoadUShort( pS );
+    pS +=2;
 #ifndef EA_SYSTEM_LITTLE_ENDIAN  
     rawColor = ShortFlipBytes(rawColor);
 #endif
@@ -578,7 +651,8 @@ static void RestoreChromaBlock( const void * pSource, byte *colorBlock)
     // Build the color lookup table 
     // The luma should have already been extracted and sitting at offset[3]
     Convert565ToColor( rawColor , &color[0][0] );     
-    rawColor = *pS++;     
+    rawColor = LoadUShort( pS );
+    pS +=2;
 #ifndef EA_SYSTEM_LITTLE_ENDIAN  
     rawColor = ShortFlipBytes(rawColor);
 #endif
@@ -613,7 +687,8 @@ static void RestoreChromaBlock( const void * pSource, byte *colorBlock)
     
     // We have 2 shorts of indexes (2 bits * 16 texels = 32 bits). (If can confirm 4x alignment, can grab it as a word with single loop) 
     for(int j=0; j < 2; j++) {
-        rawIndexes = *pS++;
+        rawIndexes = LoadUShort( pS );
+        pS +=2;
 #ifndef EA_SYSTEM_LITTLE_ENDIAN  
         rawIndexes = ShortFlipBytes(rawIndexes);
 #endif
@@ -646,10 +721,9 @@ static int ALWAYS_INLINE StoreBlock( const byte *colorBlock, const int stride, b
 static int StoreBlock( const byte *colorBlock , const int stride, const int widthRemain, const int heightRemain,  byte *outPtr) 
 {
     int outCount =0;
-    int width = stride >> 2;    // Convert to int offsets
     
-    int *pBlock32 = (int *) colorBlock;  // Since we are using ARGB, we assume 4 byte alignment is already being used
-    int *pOutput32 = (int*) outPtr; 
+    const byte *pBlock = colorBlock;
+    byte *pOutput = outPtr;
     
     int widthMax = 4;
     if(widthRemain < 4) {
@@ -663,13 +737,13 @@ static int StoreBlock( const byte *colorBlock , const int stride, const int widt
     
     for(int j =0; j < heightMax; j++) {
         for(int i=0; i < widthMax; i++) {
-            pOutput32[i] = pBlock32[i];    
+            memcpy( &pOutput[i * 4], &pBlock[i * 4], 4 );
             outCount +=4;       
         }
         
         // Set up offset for next texel row source (keep existing if we are at the end)
-        pBlock32 +=4;    
-        pOutput32 +=width;
+        pBlock += 4 * 4;
+        pOutput += stride;
     }
     return outCount;
 }
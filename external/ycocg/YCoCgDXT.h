@@ -103,7 +103,8 @@ typedef unsigned char   byte;
 /*!
  \Function    CompressYCoCgDXT5( const byte *inBuf, byte *outBuf, const int width, const int height, const int stride ) 
  
- \Description        This is the C version of the YcoCgDXT5.  
+ \Description        Compresses with the fastest encoder this CPU supports (AVX2, SSE4.1 or the C version).
+ Every encoder produces exactly the output of CompressYCoCgDXT5Reference.
  
  Input data needs to be converted from ARGB to YCoCg before calling this function.
  
@@ -139,6 +140,12 @@ typedef unsigned char   byte;
 /*************************************************************************************************F*/
 int CompressYCoCgDXT5( const byte *inBuf, byte *outBuf, const int width, const int height , const int stride);
 
+/*
+ The C version of the YCoCgDXT5 compressor, kept as the reference for the vectorized encoders.
+ Arguments and result are as for CompressYCoCgDXT5.
+ */
+int CompressYCoCgDXT5Reference( const byte *inBuf, byte *outBuf, const int width, const int height , const int stride);
+
 /*F*************************************************************************************************/
 /*!
  \Function    DeCompressYCoCgDXT5( const byte *inBuf, byte *outBuf, const int width, const int height, const int stride ) 
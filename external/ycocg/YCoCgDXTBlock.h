@@ -0,0 +1,256 @@
+/*
+ YCoCgDXTBlock.h
+ Hap Codec
+
+ Per-block endpoint selection shared by the vectorized YCoCg DXT5 encoders.
+
+ The vector encoders gather, scale and index a block's pixels with SIMD instructions, but the decisions made once
+ per block are scalar. These mirror ScaleYCoCg, InsetYCoCgBBox, SelectYCoCgDiagonal, EmitAlphaIndices and
+ EmitColorIndices in YCoCgDXT.cpp step for step, so that the vector encoders produce exactly the same blocks as
+ CompressYCoCgDXT5Reference.
+ */
+
+#ifndef HapCodec_YCoCgDXTBlock_h
+#define HapCodec_YCoCgDXTBlock_h
+
+#include <stdint.h>
+
+#include "YCoCgDXT.h"
+
+#define YCOCG_INSET_COLOR_SHIFT       4       // inset color bounding box
+#define YCOCG_INSET_ALPHA_SHIFT       5       // inset alpha bounding box
+
+#define YCOCG_C565_5_MASK             0xF8    // 0xFF minus last three bits
+#define YCOCG_C565_6_MASK             0xFC    // 0xFF minus last two bits
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define YCOCG_DXT_SIMD
+#endif
+
+#ifdef YCOCG_DXT_SIMD
+
+/*
+ Same arguments and result as CompressYCoCgDXT5, one block per iteration using SSE4.1
+ */
+int CompressYCoCgDXT5_SSE41(const byte *inBuf, byte *outBuf, const int width, const int height, const int stride);
+
+/*
+ Same arguments and result as CompressYCoCgDXT5, two blocks per iteration using AVX2
+ */
+int CompressYCoCgDXT5_AVX2(const byte *inBuf, byte *outBuf, const int width, const int height, const int stride);
+
+#endif
+
+/*
+ Copies a block to a 64-byte workspace, replicating the last row and column for blocks that overhang the image
+ */
+static inline void YCoCgExtractEdgeBlock(const byte *inPtr, const int stride, const int widthRemain, const int heightRemain, byte *colorBlock)
+{
+    const byte *row = inPtr;
+    for (int j = 0; j < 4; j++) {
+        for (int i = 0; i < 4; i++) {
+            int column = (i < widthRemain - 1) ? i : widthRemain - 1;
+            for (int k = 0; k < 4; k++) {
+                colorBlock[j * 16 + i * 4 + k] = row[column * 4 + k];
+            }
+        }
+        if (j < heightRemain - 1) {
+            row += stride;
+        }
+    }
+}
+
+/*
+ As ScaleYCoCg, applied to the block's bounds only. Returns the scale to apply to each pixel's Co and Cg.
+ */
+static inline int YCoCgScaleBounds(byte *minColor, byte *maxColor)
+{
+    int m0 = minColor[0] - 128; m0 = (m0 >= 0) ? m0 : -m0;
+    int m1 = minColor[1] - 128; m1 = (m1 >= 0) ? m1 : -m1;
+    int m2 = maxColor[0] - 128; m2 = (m2 >= 0) ? m2 : -m2;
+    int m3 = maxColor[1] - 128; m3 = (m3 >= 0) ? m3 : -m3;
+
+    if (m1 > m0) m0 = m1;
+    if (m3 > m2) m2 = m3;
+    if (m2 > m0) m0 = m2;
+
+    const int s0 = 128 / 2 - 1;
+    const int s1 = 128 / 4 - 1;
+
+    int mask0 = -(m0 <= s0);
+    int mask1 = -(m0 <= s1);
+    int scale = 1 + (1 & mask0) + (2 & mask1);
+
+    minColor[0] = (minColor[0] - 128) * scale + 128;
+    minColor[1] = (minColor[1] - 128) * scale + 128;
+    minColor[2] = (scale - 1) << 3;
+
+    maxColor[0] = (maxColor[0] - 128) * scale + 128;
+    maxColor[1] = (maxColor[1] - 128) * scale + 128;
+    maxColor[2] = (scale - 1) << 3;
+
+    return scale;
+}
+
+/*
+ As InsetYCoCgBBox
+ */
+static inline void YCoCgInsetBounds(byte *minColor, byte *maxColor)
+{
+    int inset[4];
+    int mini[4];
+    int maxi[4];
+
+    inset[0] = (maxColor[0] - minColor[0]) - ((1 << (YCOCG_INSET_COLOR_SHIFT - 1)) - 1);
+    inset[1] = (maxColor[1] - minColor[1]) - ((1 << (YCOCG_INSET_COLOR_SHIFT - 1)) - 1);
+    inset[3] = (maxColor[3] - minColor[3]) - ((1 << (YCOCG_INSET_ALPHA_SHIFT - 1)) - 1);
+
+    mini[0] = ((minColor[0] << YCOCG_INSET_COLOR_SHIFT) + inset[0]) >> YCOCG_INSET_COLOR_SHIFT;
+    mini[1] = ((minColor[1] << YCOCG_INSET_COLOR_SHIFT) + inset[1]) >> YCOCG_INSET_COLOR_SHIFT;
+    mini[3] = ((minColor[3] << YCOCG_INSET_ALPHA_SHIFT) + inset[3]) >> YCOCG_INSET_ALPHA_SHIFT;
+
+    maxi[0] = ((maxColor[0] << YCOCG_INSET_COLOR_SHIFT) - inset[0]) >> YCOCG_INSET_COLOR_SHIFT;
+    maxi[1] = ((maxColor[1] << YCOCG_INSET_COLOR_SHIFT) - inset[1]) >> YCOCG_INSET_COLOR_SHIFT;
+    maxi[3] = ((maxColor[3] << YCOCG_INSET_ALPHA_SHIFT) - inset[3]) >> YCOCG_INSET_ALPHA_SHIFT;
+
+    mini[0] = (mini[0] >= 0) ? mini[0] : 0;
+    mini[1] = (mini[1] >= 0) ? mini[1] : 0;
+    mini[3] = (mini[3] >= 0) ? mini[3] : 0;
+
+    maxi[0] = (maxi[0] <= 255) ? maxi[0] : 255;
+    maxi[1] = (maxi[1] <= 255) ? maxi[1] : 255;
+    maxi[3] = (maxi[3] <= 255) ? maxi[3] : 255;
+
+    minColor[0] = (mini[0] & YCOCG_C565_5_MASK) | (mini[0] >> 5);
+    minColor[1] = (mini[1] & YCOCG_C565_6_MASK) | (mini[1] >> 6);
+    minColor[3] = mini[3];
+
+    maxColor[0] = (maxi[0] & YCOCG_C565_5_MASK) | (maxi[0] >> 5);
+    maxColor[1] = (maxi[1] & YCOCG_C565_6_MASK) | (maxi[1] >> 6);
+    maxColor[3] = maxi[3];
+}
+
+/*
+ As SelectYCoCgDiagonal, given the count of pixels on the far side of the diagonal through
+ the midpoints (( minColor + maxColor + 1 ) >> 1) of the bounds
+ */
+static inline void YCoCgSelectDiagonal(int side, byte *minColor, byte *maxColor)
+{
+    byte mask = -(side > 8);
+
+    // NVIDIA_G7X_HARDWARE_BUG_FIX
+    mask &= -(minColor[0] != maxColor[0]);
+
+    byte c0 = minColor[1];
+    byte c1 = maxColor[1];
+
+    byte c2 = c0 ^ c1;
+    c0 = c2;
+    c0 ^= c1 ^= mask &= c2;
+
+    minColor[1] = c0;
+    maxColor[1] = c1;
+}
+
+/*
+ The seven thresholds EmitAlphaIndices compares each luma value against
+ */
+static inline void YCoCgAlphaThresholds(const byte minAlpha, const byte maxAlpha, byte thresholds[7])
+{
+    const int ALPHA_RANGE = 7;
+
+    byte mid = (maxAlpha - minAlpha) / (2 * ALPHA_RANGE);
+
+    thresholds[0] = minAlpha + mid;
+    thresholds[1] = (6 * maxAlpha + 1 * minAlpha) / ALPHA_RANGE + mid;
+    thresholds[2] = (5 * maxAlpha + 2 * minAlpha) / ALPHA_RANGE + mid;
+    thresholds[3] = (4 * maxAlpha + 3 * minAlpha) / ALPHA_RANGE + mid;
+    thresholds[4] = (3 * maxAlpha + 4 * minAlpha) / ALPHA_RANGE + mid;
+    thresholds[5] = (2 * maxAlpha + 5 * minAlpha) / ALPHA_RANGE + mid;
+    thresholds[6] = (1 * maxAlpha + 6 * minAlpha) / ALPHA_RANGE + mid;
+}
+
+/*
+ The Co and Cg of the four colors EmitColorIndices measures each pixel against
+ */
+static inline void YCoCgColorPalette(const byte *minColor, const byte *maxColor, byte colors[4][2])
+{
+    unsigned short c[2][2];
+
+    c[0][0] = (maxColor[0] & YCOCG_C565_5_MASK) | (maxColor[0] >> 5);
+    c[0][1] = (maxColor[1] & YCOCG_C565_6_MASK) | (maxColor[1] >> 6);
+    c[1][0] = (minColor[0] & YCOCG_C565_5_MASK) | (minColor[0] >> 5);
+    c[1][1] = (minColor[1] & YCOCG_C565_6_MASK) | (minColor[1] >> 6);
+
+    colors[0][0] = (byte)c[0][0];
+    colors[0][1] = (byte)c[0][1];
+    colors[1][0] = (byte)c[1][0];
+    colors[1][1] = (byte)c[1][1];
+    colors[2][0] = (byte)((2 * c[0][0] + 1 * c[1][0]) / 3);
+    colors[2][1] = (byte)((2 * c[0][1] + 1 * c[1][1]) / 3);
+    colors[3][0] = (byte)((1 * c[0][0] + 2 * c[1][0]) / 3);
+    colors[3][1] = (byte)((1 * c[0][1] + 2 * c[1][1]) / 3);
+}
+
+static inline unsigned short YCoCgColorTo565(const byte *color)
+{
+    return ((color[0] >> 3) << 11) | ((color[1] >> 2) << 5) | (color[2] >> 3);
+}
+
+static inline int YCoCgBitCount16(unsigned int x)
+{
+    x = (x & 0x5555) + ((x >> 1) & 0x5555);
+    x = (x & 0x3333) + ((x >> 2) & 0x3333);
+    x = (x & 0x0F0F) + ((x >> 4) & 0x0F0F);
+    return (int)((x & 0x00FF) + (x >> 8));
+}
+
+/*
+ Spreads the 16 bits of a per-pixel mask so pixel i lands on bit 2i, for 2-bit color indices
+ */
+static inline uint32_t YCoCgSpreadBits2(uint32_t x)
+{
+    x &= 0xFFFF;
+    x = (x | (x << 8)) & 0x00FF00FF;
+    x = (x | (x << 4)) & 0x0F0F0F0F;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+/*
+ Spreads the 16 bits of a per-pixel mask so pixel i lands on bit 3i, for 3-bit luma indices
+ */
+static inline uint64_t YCoCgSpreadBits3(uint64_t x)
+{
+    x &= 0xFFFF;
+    x = (x | (x << 16)) & 0x00000000FF0000FFull;
+    x = (x | (x << 8)) & 0x000000F00F00F00Full;
+    x = (x | (x << 4)) & 0x0000C30C30C30C3ull;
+    x = (x | (x << 2)) & 0x0000249249249249ull;
+    return x;
+}
+
+/*
+ Writes a finished block: luma endpoints, 48 bits of luma indices, chroma endpoints and 32 bits of chroma indices
+ */
+static inline void YCoCgEmitBlock(const byte *minColor, const byte *maxColor, uint64_t alphaIndices, uint32_t colorIndices, byte *outData)
+{
+    unsigned short maxPacked = YCoCgColorTo565(maxColor);
+    unsigned short minPacked = YCoCgColorTo565(minColor);
+
+    outData[0] = maxColor[3];
+    outData[1] = minColor[3];
+    for (int i = 0; i < 6; i++) {
+        outData[2 + i] = (byte)(alphaIndices >> (8 * i));
+    }
+    outData[8] = maxPacked & 255;
+    outData[9] = maxPacked >> 8;
+    outData[10] = minPacked & 255;
+    outData[11] = minPacked >> 8;
+    for (int i = 0; i < 4; i++) {
+        outData[12 + i] = (byte)(colorIndices >> (8 * i));
+    }
+}
+
+#endif
@@ -0,0 +1,257 @@
+/*
+ YCoCgDXT_AVX2.cpp
+ Hap Codec
+
+ YCoCg DXT5 compression, two 4x4 blocks per iteration using AVX2.
+
+ This is the SSE4.1 encoder with one block in each 128-bit lane. Every instruction used operates within
+ lanes, so the blocks stay independent, and the per-block decisions from YCoCgDXTBlock.h are made for each
+ lane in turn. This file must be compiled with AVX2 enabled; it is only called when the CPU supports it.
+ Output is identical to CompressYCoCgDXT5Reference.
+ */
+
+#include "YCoCgDXTBlock.h"
+
+#ifdef YCOCG_DXT_SIMD
+
+#include <immintrin.h>
+
+static inline __m256i Combine(__m128i lo, __m128i hi)
+{
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+static inline __m256i Broadcast(byte lo, byte hi)
+{
+    return Combine(_mm_set1_epi8((char)lo), _mm_set1_epi8((char)hi));
+}
+
+static inline __m256i LoadRow(const byte *a, const byte *b)
+{
+    return Combine(_mm_loadu_si128((const __m128i *)a), _mm_loadu_si128((const __m128i *)b));
+}
+
+static inline __m256i HorizontalMin(__m256i v)
+{
+    v = _mm256_min_epu8(v, _mm256_srli_si256(v, 8));
+    v = _mm256_min_epu8(v, _mm256_srli_si256(v, 4));
+    v = _mm256_min_epu8(v, _mm256_srli_si256(v, 2));
+    return _mm256_min_epu8(v, _mm256_srli_si256(v, 1));
+}
+
+static inline __m256i HorizontalMax(__m256i v)
+{
+    v = _mm256_max_epu8(v, _mm256_srli_si256(v, 8));
+    v = _mm256_max_epu8(v, _mm256_srli_si256(v, 4));
+    v = _mm256_max_epu8(v, _mm256_srli_si256(v, 2));
+    return _mm256_max_epu8(v, _mm256_srli_si256(v, 1));
+}
+
+// the first byte of each lane
+static inline void LaneBytes(__m256i v, byte *lo, byte *hi)
+{
+    *lo = (byte)_mm_cvtsi128_si32(_mm256_castsi256_si128(v));
+    *hi = (byte)_mm_cvtsi128_si32(_mm256_extracti128_si256(v, 1));
+}
+
+// a >= b for unsigned bytes
+static inline __m256i GreaterOrEqual(__m256i a, __m256i b)
+{
+    return _mm256_cmpeq_epi8(_mm256_max_epu8(a, b), a);
+}
+
+// a <= b for unsigned bytes
+static inline __m256i LessOrEqual(__m256i a, __m256i b)
+{
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(a, b), a);
+}
+
+static inline __m256i AbsDifference(__m256i a, __m256i b)
+{
+    return _mm256_sub_epi8(_mm256_max_epu8(a, b), _mm256_min_epu8(a, b));
+}
+
+static inline __m128i LaneMask(bool set)
+{
+    return set ? _mm_set1_epi8(-1) : _mm_setzero_si128();
+}
+
+static void EncodeBlockPair(const byte *inA, const int strideA, const byte *inB, const int strideB, byte *outA, byte *outB)
+{
+    const __m256i planar = Combine(_mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15),
+                                   _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15));
+    const __m256i zero = _mm256_setzero_si256();
+
+    __m256i r0 = _mm256_shuffle_epi8(LoadRow(inA + 0 * strideA, inB + 0 * strideB), planar);
+    __m256i r1 = _mm256_shuffle_epi8(LoadRow(inA + 1 * strideA, inB + 1 * strideB), planar);
+    __m256i r2 = _mm256_shuffle_epi8(LoadRow(inA + 2 * strideA, inB + 2 * strideB), planar);
+    __m256i r3 = _mm256_shuffle_epi8(LoadRow(inA + 3 * strideA, inB + 3 * strideB), planar);
+
+    __m256i t0 = _mm256_unpacklo_epi32(r0, r1);
+    __m256i t1 = _mm256_unpacklo_epi32(r2, r3);
+    __m256i t2 = _mm256_unpackhi_epi32(r0, r1);
+    __m256i t3 = _mm256_unpackhi_epi32(r2, r3);
+
+    __m256i co = _mm256_unpacklo_epi64(t0, t1);
+    __m256i cg = _mm256_unpackhi_epi64(t0, t1);
+    __m256i y = _mm256_unpackhi_epi64(t2, t3);
+
+    byte minColor[2][4];
+    byte maxColor[2][4];
+
+    LaneBytes(HorizontalMin(co), &minColor[0][0], &minColor[1][0]);
+    LaneBytes(HorizontalMin(cg), &minColor[0][1], &minColor[1][1]);
+    LaneBytes(HorizontalMin(y), &minColor[0][3], &minColor[1][3]);
+    LaneBytes(HorizontalMax(co), &maxColor[0][0], &maxColor[1][0]);
+    LaneBytes(HorizontalMax(cg), &maxColor[0][1], &maxColor[1][1]);
+    LaneBytes(HorizontalMax(y), &maxColor[0][3], &maxColor[1][3]);
+
+    // see the SSE4.1 encoder: a scale of 2 or 4 is c * scale + 128 in 8 bits
+    int scaleA = YCoCgScaleBounds(minColor[0], maxColor[0]);
+    int scaleB = YCoCgScaleBounds(minColor[1], maxColor[1]);
+    if (scaleA > 1 || scaleB > 1)
+    {
+        const __m256i times2 = Combine(LaneMask(scaleA == 2), LaneMask(scaleB == 2));
+        const __m256i times4 = Combine(LaneMask(scaleA == 4), LaneMask(scaleB == 4));
+        const __m256i bias = Broadcast(scaleA > 1 ? 0x80 : 0, scaleB > 1 ? 0x80 : 0);
+
+        __m256i co2 = _mm256_add_epi8(co, co);
+        __m256i cg2 = _mm256_add_epi8(cg, cg);
+        co = _mm256_blendv_epi8(co, co2, times2);
+        cg = _mm256_blendv_epi8(cg, cg2, times2);
+        co = _mm256_blendv_epi8(co, _mm256_add_epi8(co2, co2), times4);
+        cg = _mm256_blendv_epi8(cg, _mm256_add_epi8(cg2, cg2), times4);
+        co = _mm256_xor_si256(co, bias);
+        cg = _mm256_xor_si256(cg, bias);
+    }
+
+    YCoCgInsetBounds(minColor[0], maxColor[0]);
+    YCoCgInsetBounds(minColor[1], maxColor[1]);
+
+    byte mid0[2];
+    byte mid1[2];
+    for (int b = 0; b < 2; b++)
+    {
+        mid0[b] = ((int)minColor[b][0] + maxColor[b][0] + 1) >> 1;
+        mid1[b] = ((int)minColor[b][1] + maxColor[b][1] + 1) >> 1;
+    }
+    __m256i b0 = GreaterOrEqual(co, Broadcast(mid0[0], mid0[1]));
+    __m256i b1 = GreaterOrEqual(cg, Broadcast(mid1[0], mid1[1]));
+    unsigned int side = (unsigned int)_mm256_movemask_epi8(_mm256_xor_si256(b0, b1));
+    YCoCgSelectDiagonal(YCoCgBitCount16(side & 0xFFFF), minColor[0], maxColor[0]);
+    YCoCgSelectDiagonal(YCoCgBitCount16(side >> 16), minColor[1], maxColor[1]);
+
+    // luma indices
+    byte thresholds[2][7];
+    YCoCgAlphaThresholds(minColor[0][3], maxColor[0][3], thresholds[0]);
+    YCoCgAlphaThresholds(minColor[1][3], maxColor[1][3], thresholds[1]);
+
+    __m256i count = zero;
+    for (int k = 0; k < 7; k++)
+    {
+        count = _mm256_sub_epi8(count, LessOrEqual(y, Broadcast(thresholds[0][k], thresholds[1][k])));
+    }
+    const __m256i one = _mm256_set1_epi8(1);
+    __m256i index = _mm256_and_si256(_mm256_add_epi8(count, one), _mm256_set1_epi8(7));
+    index = _mm256_xor_si256(index, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(2), index), one));
+
+    unsigned int plane0 = (unsigned int)_mm256_movemask_epi8(_mm256_slli_epi16(index, 7));
+    unsigned int plane1 = (unsigned int)_mm256_movemask_epi8(_mm256_slli_epi16(index, 6));
+    unsigned int plane2 = (unsigned int)_mm256_movemask_epi8(_mm256_slli_epi16(index, 5));
+
+    // chroma indices
+    byte colors[2][4][2];
+    YCoCgColorPalette(minColor[0], maxColor[0], colors[0]);
+    YCoCgColorPalette(minColor[1], maxColor[1], colors[1]);
+
+    __m256i dLo[4];
+    __m256i dHi[4];
+    for (int k = 0; k < 4; k++)
+    {
+        __m256i dCo = AbsDifference(co, Broadcast(colors[0][k][0], colors[1][k][0]));
+        __m256i dCg = AbsDifference(cg, Broadcast(colors[0][k][1], colors[1][k][1]));
+        dLo[k] = _mm256_add_epi16(_mm256_unpacklo_epi8(dCo, zero), _mm256_unpacklo_epi8(dCg, zero));
+        dHi[k] = _mm256_add_epi16(_mm256_unpackhi_epi8(dCo, zero), _mm256_unpackhi_epi8(dCg, zero));
+    }
+
+    __m256i bit0[2];
+    __m256i bit1[2];
+    for (int h = 0; h < 2; h++)
+    {
+        const __m256i *d = (h == 0) ? dLo : dHi;
+        __m256i c0 = _mm256_cmpgt_epi16(d[0], d[3]);
+        __m256i c1 = _mm256_cmpgt_epi16(d[1], d[2]);
+        __m256i c2 = _mm256_cmpgt_epi16(d[0], d[2]);
+        __m256i c3 = _mm256_cmpgt_epi16(d[1], d[3]);
+        __m256i c4 = _mm256_cmpgt_epi16(d[2], d[3]);
+        bit0[h] = _mm256_and_si256(c0, c4);
+        bit1[h] = _mm256_or_si256(_mm256_and_si256(c1, c2), _mm256_and_si256(c0, c3));
+    }
+
+    // packing within lanes restores pixel order per block
+    unsigned int colorPlane0 = (unsigned int)_mm256_movemask_epi8(_mm256_packs_epi16(bit0[0], bit0[1]));
+    unsigned int colorPlane1 = (unsigned int)_mm256_movemask_epi8(_mm256_packs_epi16(bit1[0], bit1[1]));
+
+    byte *out[2] = { outA, outB };
+    for (int b = 0; b < 2; b++)
+    {
+        int shift = 16 * b;
+        uint64_t alphaIndices = YCoCgSpreadBits3(plane0 >> shift)
+            | (YCoCgSpreadBits3(plane1 >> shift) << 1)
+            | (YCoCgSpreadBits3(plane2 >> shift) << 2);
+        uint32_t colorIndices = YCoCgSpreadBits2(colorPlane0 >> shift)
+            | (YCoCgSpreadBits2(colorPlane1 >> shift) << 1);
+
+        YCoCgEmitBlock(minColor[b], maxColor[b], alphaIndices, colorIndices, out[b]);
+    }
+}
+
+int CompressYCoCgDXT5_AVX2(const byte *inBuf, byte *outBuf, const int width, const int height, const int stride)
+{
+    byte edge[2][64];
+    byte spare[16];
+    byte *outData = outBuf;
+
+    for (int j = 0; j < height; j += 4, inBuf += stride * 4)
+    {
+        int heightRemain = height - j;
+
+        // blocks are queued until there is a pair to encode
+        const byte *pending[2];
+        int pendingStride[2];
+        byte *pendingOut[2];
+        int pendingCount = 0;
+
+        for (int i = 0; i < width; i += 4, outData += 16)
+        {
+            int widthRemain = width - i;
+            if ((heightRemain < 4) || (widthRemain < 4))
+            {
+                YCoCgExtractEdgeBlock(inBuf + i * 4, stride, widthRemain, heightRemain, edge[pendingCount]);
+                pending[pendingCount] = edge[pendingCount];
+                pendingStride[pendingCount] = 16;
+            }
+            else
+            {
+                pending[pendingCount] = inBuf + i * 4;
+                pendingStride[pendingCount] = stride;
+            }
+            pendingOut[pendingCount] = outData;
+
+            if (++pendingCount == 2)
+            {
+                EncodeBlockPair(pending[0], pendingStride[0], pending[1], pendingStride[1], pendingOut[0], pendingOut[1]);
+                pendingCount = 0;
+            }
+        }
+
+        if (pendingCount == 1)
+        {
+            EncodeBlockPair(pending[0], pendingStride[0], pending[0], pendingStride[0], pendingOut[0], spare);
+        }
+    }
+
+    return (int)(outData - outBuf);
+}
+
+#endif
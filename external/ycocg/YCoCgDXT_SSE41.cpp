@@ -0,0 +1,181 @@
+/*
+ YCoCgDXT_SSE41.cpp
+ Hap Codec
+
+ YCoCg DXT5 compression, one 4x4 block per iteration using SSE4.1.
+
+ The block is transposed so that Co, Cg and Y each occupy one register of 16 bytes, which makes the bounds,
+ scaling, diagonal test and index selection a handful of instructions per channel. The per-block decisions
+ are shared with the AVX2 encoder in YCoCgDXTBlock.h. Output is identical to CompressYCoCgDXT5Reference.
+ */
+
+#include "YCoCgDXTBlock.h"
+
+#ifdef YCOCG_DXT_SIMD
+
+#include <smmintrin.h>
+
+static inline __m128i HorizontalMin(__m128i v)
+{
+    v = _mm_min_epu8(v, _mm_srli_si128(v, 8));
+    v = _mm_min_epu8(v, _mm_srli_si128(v, 4));
+    v = _mm_min_epu8(v, _mm_srli_si128(v, 2));
+    return _mm_min_epu8(v, _mm_srli_si128(v, 1));
+}
+
+static inline __m128i HorizontalMax(__m128i v)
+{
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 8));
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 4));
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 2));
+    return _mm_max_epu8(v, _mm_srli_si128(v, 1));
+}
+
+// a >= b for unsigned bytes
+static inline __m128i GreaterOrEqual(__m128i a, __m128i b)
+{
+    return _mm_cmpeq_epi8(_mm_max_epu8(a, b), a);
+}
+
+// a <= b for unsigned bytes
+static inline __m128i LessOrEqual(__m128i a, __m128i b)
+{
+    return _mm_cmpeq_epi8(_mm_min_epu8(a, b), a);
+}
+
+static inline __m128i AbsDifference(__m128i a, __m128i b)
+{
+    return _mm_sub_epi8(_mm_max_epu8(a, b), _mm_min_epu8(a, b));
+}
+
+static void EncodeBlock(const byte *inPtr, const int stride, byte *outData)
+{
+    const __m128i planar = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    const __m128i zero = _mm_setzero_si128();
+
+    // each row to [Co x4, Cg x4, A x4, Y x4], then transpose to one register per channel
+    __m128i r0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(inPtr + 0 * stride)), planar);
+    __m128i r1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(inPtr + 1 * stride)), planar);
+    __m128i r2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(inPtr + 2 * stride)), planar);
+    __m128i r3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(inPtr + 3 * stride)), planar);
+
+    __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+    __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+    __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+    __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+    __m128i co = _mm_unpacklo_epi64(t0, t1);
+    __m128i cg = _mm_unpackhi_epi64(t0, t1);
+    __m128i y = _mm_unpackhi_epi64(t2, t3);
+
+    byte minColor[4];
+    byte maxColor[4];
+
+    minColor[0] = (byte)_mm_cvtsi128_si32(HorizontalMin(co));
+    minColor[1] = (byte)_mm_cvtsi128_si32(HorizontalMin(cg));
+    minColor[3] = (byte)_mm_cvtsi128_si32(HorizontalMin(y));
+    maxColor[0] = (byte)_mm_cvtsi128_si32(HorizontalMax(co));
+    maxColor[1] = (byte)_mm_cvtsi128_si32(HorizontalMax(cg));
+    maxColor[3] = (byte)_mm_cvtsi128_si32(HorizontalMax(y));
+
+    // (c - 128) * scale + 128 wraps identically in 8 bits as c * scale + 128 for a scale of 2 or 4
+    int scale = YCoCgScaleBounds(minColor, maxColor);
+    if (scale > 1)
+    {
+        const __m128i bias = _mm_set1_epi8((char)0x80);
+        co = _mm_add_epi8(co, co);
+        cg = _mm_add_epi8(cg, cg);
+        if (scale == 4)
+        {
+            co = _mm_add_epi8(co, co);
+            cg = _mm_add_epi8(cg, cg);
+        }
+        co = _mm_xor_si128(co, bias);
+        cg = _mm_xor_si128(cg, bias);
+    }
+
+    YCoCgInsetBounds(minColor, maxColor);
+
+    byte mid0 = ((int)minColor[0] + maxColor[0] + 1) >> 1;
+    byte mid1 = ((int)minColor[1] + maxColor[1] + 1) >> 1;
+    __m128i b0 = GreaterOrEqual(co, _mm_set1_epi8((char)mid0));
+    __m128i b1 = GreaterOrEqual(cg, _mm_set1_epi8((char)mid1));
+    YCoCgSelectDiagonal(YCoCgBitCount16(_mm_movemask_epi8(_mm_xor_si128(b0, b1))), minColor, maxColor);
+
+    // luma indices: count the thresholds each value is at or below
+    byte thresholds[7];
+    YCoCgAlphaThresholds(minColor[3], maxColor[3], thresholds);
+
+    __m128i count = zero;
+    for (int k = 0; k < 7; k++)
+    {
+        count = _mm_sub_epi8(count, LessOrEqual(y, _mm_set1_epi8((char)thresholds[k])));
+    }
+    __m128i index = _mm_and_si128(_mm_add_epi8(count, _mm_set1_epi8(1)), _mm_set1_epi8(7));
+    index = _mm_xor_si128(index, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(2), index), _mm_set1_epi8(1)));
+
+    uint64_t alphaIndices = YCoCgSpreadBits3(_mm_movemask_epi8(_mm_slli_epi16(index, 7)))
+        | (YCoCgSpreadBits3(_mm_movemask_epi8(_mm_slli_epi16(index, 6))) << 1)
+        | (YCoCgSpreadBits3(_mm_movemask_epi8(_mm_slli_epi16(index, 5))) << 2);
+
+    // chroma indices: manhattan distance to each of the four colors, in 16 bits
+    byte colors[4][2];
+    YCoCgColorPalette(minColor, maxColor, colors);
+
+    __m128i dLo[4];
+    __m128i dHi[4];
+    for (int k = 0; k < 4; k++)
+    {
+        __m128i dCo = AbsDifference(co, _mm_set1_epi8((char)colors[k][0]));
+        __m128i dCg = AbsDifference(cg, _mm_set1_epi8((char)colors[k][1]));
+        dLo[k] = _mm_add_epi16(_mm_unpacklo_epi8(dCo, zero), _mm_unpacklo_epi8(dCg, zero));
+        dHi[k] = _mm_add_epi16(_mm_unpackhi_epi8(dCo, zero), _mm_unpackhi_epi8(dCg, zero));
+    }
+
+    __m128i bit0[2];
+    __m128i bit1[2];
+    for (int h = 0; h < 2; h++)
+    {
+        const __m128i *d = (h == 0) ? dLo : dHi;
+        __m128i c0 = _mm_cmpgt_epi16(d[0], d[3]);
+        __m128i c1 = _mm_cmpgt_epi16(d[1], d[2]);
+        __m128i c2 = _mm_cmpgt_epi16(d[0], d[2]);
+        __m128i c3 = _mm_cmpgt_epi16(d[1], d[3]);
+        __m128i c4 = _mm_cmpgt_epi16(d[2], d[3]);
+        bit0[h] = _mm_and_si128(c0, c4);
+        bit1[h] = _mm_or_si128(_mm_and_si128(c1, c2), _mm_and_si128(c0, c3));
+    }
+
+    uint32_t colorIndices = YCoCgSpreadBits2(_mm_movemask_epi8(_mm_packs_epi16(bit0[0], bit0[1])))
+        | (YCoCgSpreadBits2(_mm_movemask_epi8(_mm_packs_epi16(bit1[0], bit1[1]))) << 1);
+
+    YCoCgEmitBlock(minColor, maxColor, alphaIndices, colorIndices, outData);
+}
+
+int CompressYCoCgDXT5_SSE41(const byte *inBuf, byte *outBuf, const int width, const int height, const int stride)
+{
+    byte block[64];
+    byte *outData = outBuf;
+
+    for (int j = 0; j < height; j += 4, inBuf += stride * 4)
+    {
+        int heightRemain = height - j;
+        for (int i = 0; i < width; i += 4, outData += 16)
+        {
+            int widthRemain = width - i;
+            if ((heightRemain < 4) || (widthRemain < 4))
+            {
+                YCoCgExtractEdgeBlock(inBuf + i * 4, stride, widthRemain, heightRemain, block);
+                EncodeBlock(block, 16, outData);
+            }
+            else
+            {
+                EncodeBlock(inBuf + i * 4, stride, outData);
+            }
+        }
+    }
+
+    return (int)(outData - outBuf);
+}
+
+#endif
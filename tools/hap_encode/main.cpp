@@ -0,0 +1,722 @@
+// hap_encode
+//
+// Encodes a raw RGBA or BGRA frame sequence, or a synthetic pattern, through HapEncoder outside of any host
+// application, and reports the time spent in each stage of encoding. Used to benchmark and profile the
+// encoder on build machines, and, with --verify, to check frames decode through HapDecoder.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bc7.hpp"
+#include "codec.hpp"
+#include "downscale.hpp"
+#include "encode_pipeline.hpp"
+#include "hap.h"
+#include "squish.h"
+
+extern "C" {
+#include "YCoCg.h"
+}
+#include "YCoCgDXT.h"
+
+namespace {
+
+struct Subtype
+{
+    const char* name;
+    Codec4CC codec4CC;
+    bool hasColour;
+    bool hasAlpha;
+    unsigned int textures;
+};
+
+const std::array<Subtype, 6> kSubtypes{ {
+    { "hap", { 'H', 'a', 'p', '1' }, true, false, 1 },
+    { "hapalpha", { 'H', 'a', 'p', '5' }, true, true, 1 },
+    { "hapq", { 'H', 'a', 'p', 'Y' }, true, false, 1 },
+    { "hapqalpha", { 'H', 'a', 'p', 'M' }, true, true, 2 },
+    { "hapalphaonly", { 'H', 'a', 'p', 'A' }, false, true, 1 },
+    { "hap7", { 'H', 'a', 'p', '7' }, true, true, 1 }
+} };
+
+struct Options
+{
+    std::string format{ "all" };
+    FrameSize size{ 1920, 1080 };
+    std::string layout{ "bgra" };
+    bool bottomLeft{ false };          // rows run from the bottom of the image up
+    unsigned int frames{ 0 };          // 0 is all of input, or kDefaultSyntheticFrames
+    std::string pattern{ "gradient" };
+    int quality{ kSquishEncoderNormalQuality };
+    unsigned int chunks{ 1 };          // 0 chooses automatically
+    std::string input;
+    std::string output;
+    std::string trace;                 // prefix of trace files; empty does not trace
+    bool verify{ false };
+    bool reuse{ false };
+    bool sampleChunks{ false };
+    unsigned int pipeline{ 0 };        // frames in flight; 0 encodes one frame at a time
+    unsigned int proxies{ 0 };         // reduced copies encoded alongside each frame
+    unsigned int failOutput{ 0 };      // for the tests, the frame from 1 whose output throws; 0 none
+};
+
+const unsigned int kDefaultSyntheticFrames = 100;
+
+void usage()
+{
+    std::cerr <<
+        "usage: hap_encode [options] [input]\n"
+        "\n"
+        "Encodes input, a file of raw 8-bit frames, or a synthetic pattern when no input is\n"
+        "given, reporting the time spent in each stage of encoding.\n"
+        "\n"
+        "  -f, --format NAME   hap, hapalpha, hapq, hapqalpha, hapalphaonly, hap7 or all (default all)\n"
+        "  -s, --size WxH      frame size (default 1920x1080)\n"
+        "  -l, --layout NAME   channel order of input, rgba, bgra or argb (default bgra)\n"
+        "  -b, --bottom-left   rows of input run from the bottom of the image up, as some hosts give them\n"
+        "  -n, --frames N      frames to encode (default all of input, or 100 synthetic)\n"
+        "  -p, --pattern NAME  synthetic pattern, gradient, bars, noise or overlay, a box moving over a still\n"
+        "                      gradient (default gradient)\n"
+        "  -q, --quality N     0 fast, 1 normal, 2 best or 3 realtime; Hap, Hap Alpha and Hap 7 only (default 1)\n"
+        "  -c, --chunks N      chunks per texture, or auto to choose from the frame size and\n"
+        "                      HAP_DECODER_THREADS (default 1)\n"
+        "  -o, --output PATH   write encoded frames back to back to PATH; with format all, PATH.<format>\n"
+        "  -v, --verify        decode every frame, check it against the reference decoders and report PSNR\n"
+        "  -P, --pipeline N    overlap copy, conversion and packing with N frames in flight, reporting the time\n"
+        "                      each stage waited and the depth of the queues; writing and verifying become part\n"
+        "                      of packing (default 0, one frame at a time)\n"
+        "  -r, --reuse         compress only blocks that changed since the previous frame, and report how many\n"
+        "                      were reused\n"
+        "  -e, --sample-chunks compress in full only the chunks that samples show will shrink, storing the rest\n"
+        "                      uncompressed\n"
+        "  -t, --trace PREFIX  trace each stage of every frame, writing PREFIX-<n>.json for chrome://tracing and a\n"
+        "                      summary to PREFIX-<n>.txt, n counting formats encoded from 1\n"
+        "  -x, --proxies N     also encode N proxies from each frame, at half size, a quarter and so on, writing\n"
+        "                      them to PATH.<W>x<H> with --output, and with --verify checking them as frames\n"
+        "                      are; not with --pipeline\n"
+        "\n"
+        "Threads used per frame are set by HAP_ENCODER_THREADS, as in the plugins.\n";
+}
+
+unsigned int parseUnsigned(const std::string& option, const std::string& value)
+{
+    char* end;
+    unsigned long n = std::strtoul(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0')
+        throw std::runtime_error("invalid value for " + option + ": " + value);
+    return (unsigned int)n;
+}
+
+Options parseOptions(int argc, char* argv[])
+{
+    Options options;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help")
+        {
+            usage();
+            std::exit(0);
+        }
+        if (arg == "-v" || arg == "--verify")
+        {
+            options.verify = true;
+            continue;
+        }
+        if (arg == "-r" || arg == "--reuse")
+        {
+            options.reuse = true;
+            continue;
+        }
+        if (arg == "-e" || arg == "--sample-chunks")
+        {
+            options.sampleChunks = true;
+            continue;
+        }
+        if (arg == "-b" || arg == "--bottom-left")
+        {
+            options.bottomLeft = true;
+            continue;
+        }
+        if (arg[0] != '-')
+        {
+            if (!options.input.empty())
+                throw std::runtime_error("more than one input given");
+            options.input = arg;
+            continue;
+        }
+        if (i + 1 == argc)
+            throw std::runtime_error("missing value for " + arg);
+        std::string value = argv[++i];
+
+        if (arg == "-f" || arg == "--format")
+            options.format = value;
+        else if (arg == "-s" || arg == "--size")
+        {
+            size_t x = value.find('x');
+            if (x == std::string::npos)
+                throw std::runtime_error("invalid value for " + arg + ": " + value);
+            options.size.width = (int)parseUnsigned(arg, value.substr(0, x));
+            options.size.height = (int)parseUnsigned(arg, value.substr(x + 1));
+            if (options.size.width == 0 || options.size.height == 0)
+                throw std::runtime_error("invalid value for " + arg + ": " + value);
+        }
+        else if (arg == "-l" || arg == "--layout")
+        {
+            if (value != "rgba" && value != "bgra" && value != "argb")
+                throw std::runtime_error("unknown layout: " + value);
+            options.layout = value;
+        }
+        else if (arg == "-n" || arg == "--frames")
+            options.frames = parseUnsigned(arg, value);
+        else if (arg == "-p" || arg == "--pattern")
+        {
+            if (value != "gradient" && value != "bars" && value != "noise" && value != "overlay")
+                throw std::runtime_error("unknown pattern: " + value);
+            options.pattern = value;
+        }
+        else if (arg == "-q" || arg == "--quality")
+        {
+            options.quality = (int)parseUnsigned(arg, value);
+            if (options.quality > kSquishEncoderRealtimeQuality)
+                throw std::runtime_error("invalid value for " + arg + ": " + value);
+        }
+        else if (arg == "-c" || arg == "--chunks")
+            options.chunks = (value == "auto") ? 0 : parseUnsigned(arg, value);
+        else if (arg == "-P" || arg == "--pipeline")
+            options.pipeline = parseUnsigned(arg, value);
+        else if (arg == "-o" || arg == "--output")
+            options.output = value;
+        else if (arg == "-t" || arg == "--trace")
+            options.trace = value;
+        else if (arg == "-x" || arg == "--proxies")
+            options.proxies = parseUnsigned(arg, value);
+        else if (arg == "--fail-output")   // not in usage; the tests' check that failures are reported
+            options.failOutput = parseUnsigned(arg, value);
+        else
+            throw std::runtime_error("unknown option: " + arg);
+    }
+
+    if (options.proxies && options.pipeline)
+        throw std::runtime_error("--proxies can't be used with --pipeline");
+
+    return options;
+}
+
+// Frames to encode, either read from the input file or generated, all held in memory so that reading
+// does not appear in the timings
+
+class FrameSource
+{
+public:
+    FrameSource(const Options& options)
+        : frameBytes_(size_t(options.size.width) * options.size.height * 4)
+    {
+        if (options.input.empty())
+            generate(options);
+        else
+            read(options);
+    }
+
+    size_t frameBytes() const { return frameBytes_; }
+    unsigned int frameCount() const { return frameCount_; }
+    const uint8_t* frame(unsigned int i) const { return &frames_[(i % storedCount_) * frameBytes_]; }
+
+private:
+    // a moving pattern is generated for a handful of frames, then repeated
+    static const unsigned int kStoredSyntheticFrames = 8;
+
+    void generate(const Options& options)
+    {
+        frameCount_ = options.frames ? options.frames : kDefaultSyntheticFrames;
+        storedCount_ = std::min(frameCount_, kStoredSyntheticFrames);
+        frames_.resize(frameBytes_ * storedCount_);
+
+        const int width = options.size.width;
+        const int height = options.size.height;
+        const int boxSize = std::max(height / 4, 1);
+        uint32_t seed = 0x12345678;
+        for (unsigned int f = 0; f < storedCount_; ++f)
+        {
+            uint8_t* pixel = &frames_[f * frameBytes_];
+            const int boxLeft = (int)f * width / 16;
+            const int boxTop = height / 3;
+            for (int y = 0; y < height; ++y)
+            {
+                for (int x = 0; x < width; ++x, pixel += 4)
+                {
+                    bool inBox = (x >= boxLeft && x < boxLeft + boxSize && y >= boxTop && y < boxTop + boxSize);
+                    if (options.pattern == "overlay" && inBox)
+                    {
+                        pixel[0] = 224;
+                        pixel[1] = (uint8_t)(64 + f * 16);
+                        pixel[2] = 32;
+                        pixel[3] = 255;
+                    }
+                    else if (options.pattern == "overlay")
+                    {
+                        pixel[0] = (uint8_t)(x * 255 / width);
+                        pixel[1] = (uint8_t)(y * 255 / height);
+                        pixel[2] = (uint8_t)(((x + y) / 2) & 255);
+                        pixel[3] = (uint8_t)(255 - y * 255 / height);
+                    }
+                    else if (options.pattern == "noise")
+                    {
+                        seed = seed * 1664525 + 1013904223;
+                        std::memcpy(pixel, &seed, 4);
+                    }
+                    else if (options.pattern == "bars")
+                    {
+                        static const uint8_t bars[8][3] = {
+                            { 192, 192, 192 }, { 192, 192, 0 }, { 0, 192, 192 }, { 0, 192, 0 },
+                            { 192, 0, 192 }, { 192, 0, 0 }, { 0, 0, 192 }, { 16, 16, 16 } };
+                        int bar = (x * 8 / width + f) % 8;
+                        pixel[0] = bars[bar][0];
+                        pixel[1] = bars[bar][1];
+                        pixel[2] = bars[bar][2];
+                        pixel[3] = (y * 2 < height) ? 255 : (uint8_t)(x * 255 / width);
+                    }
+                    else
+                    {
+                        pixel[0] = (uint8_t)((x + f * 8) * 255 / (width + kStoredSyntheticFrames * 8));
+                        pixel[1] = (uint8_t)(y * 255 / height);
+                        pixel[2] = (uint8_t)(((x + y) / 2 + f * 4) & 255);
+                        pixel[3] = (uint8_t)(255 - y * 255 / height);
+                    }
+                }
+            }
+        }
+    }
+
+    void read(const Options& options)
+    {
+        std::ifstream input(options.input, std::ios::binary | std::ios::ate);
+        if (!input)
+            throw std::runtime_error("could not open " + options.input);
+
+        size_t available = (size_t)input.tellg() / frameBytes_;
+        if (available == 0)
+            throw std::runtime_error(options.input + " holds less than one frame");
+        frameCount_ = options.frames ? options.frames : (unsigned int)available;
+        storedCount_ = (unsigned int)std::min<size_t>(frameCount_, available);   // repeated to make up frames
+
+        frames_.resize(frameBytes_ * storedCount_);
+        input.seekg(0);
+        if (!input.read((char*)&frames_[0], frames_.size()))
+            throw std::runtime_error("could not read " + options.input);
+    }
+
+    size_t frameBytes_;
+    unsigned int frameCount_{ 0 };
+    unsigned int storedCount_{ 0 };
+    std::vector<uint8_t> frames_;
+};
+
+double milliseconds(std::chrono::steady_clock::duration duration)
+{
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+// Decodes a frame to rgba with the scalar decoders that HapDecoder's must match exactly: squish, and
+// DeCompressYCoCgDXT5 followed by ConvertCoCgAY8888ToRGBA
+
+void decodeInTurn(HapDecodeWorkFunction function, void* p, unsigned int count, void*)
+{
+    for (unsigned int i = 0; i < count; ++i)
+        function(p, i);
+}
+
+std::vector<uint8_t> referenceDecode(const std::vector<uint8_t>& frame, FrameSize size)
+{
+    const int width = size.width;
+    const int height = size.height;
+    const size_t pixels = size_t(width) * height;
+    std::vector<uint8_t> rgba(pixels * 4);
+
+    unsigned int count;
+    if (HapGetFrameTextureCount(&frame[0], (unsigned long)frame.size(), &count) != HapResult_No_Error)
+        throw std::runtime_error("reference decode failed");
+
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        std::vector<uint8_t> texture(size_t((width + 3) / 4) * ((height + 3) / 4) * 16);
+        std::vector<uint8_t> decoded(pixels * 4);
+        unsigned long bytesUsed;
+        unsigned int textureFormat;
+        if (HapDecode(&frame[0], (unsigned long)frame.size(), i, decodeInTurn, nullptr,
+                      &texture[0], (unsigned long)texture.size(), &bytesUsed, &textureFormat) != HapResult_No_Error)
+            throw std::runtime_error("reference decode failed");
+
+        switch (textureFormat)
+        {
+        case HapTextureFormat_RGB_DXT1:
+            squish::DecompressImage(&decoded[0], width, height, &texture[0], squish::kDxt1);
+            for (size_t p = 0; p < pixels; ++p)
+                decoded[p * 4 + 3] = 255;
+            break;
+        case HapTextureFormat_RGBA_DXT5:
+            squish::DecompressImage(&decoded[0], width, height, &texture[0], squish::kDxt5);
+            break;
+        case HapTextureFormat_YCoCg_DXT5:
+            DeCompressYCoCgDXT5(&texture[0], &decoded[0], width, height, width * 4);
+            ConvertCoCgAY8888ToRGBA(&decoded[0], &decoded[0], width, height, width * 4, width * 4, 0);
+            break;
+        case HapTextureFormat_A_RGTC1:
+            // squish only writes alpha; alone, the colour is white
+            squish::DecompressImage(&decoded[0], width, height, &texture[0], squish::kRgtc1A);
+            for (size_t p = 0; p < pixels; ++p)
+                decoded[p * 4] = decoded[p * 4 + 1] = decoded[p * 4 + 2] = 255;
+            break;
+        case HapTextureFormat_RGBA_BPTC_UNORM:
+            // block by block, without HapDecoder's banding or edge handling
+            for (int y = 0; y < height; y += 4)
+            {
+                for (int x = 0; x < width; x += 4)
+                {
+                    uint8_t pixels[64];
+                    decompressBc7Block(&texture[(size_t(y / 4) * ((width + 3) / 4) + x / 4) * 16], pixels);
+                    for (int j = 0; j < std::min(4, height - y); ++j)
+                        std::memcpy(&decoded[(size_t(y + j) * width + x) * 4], pixels + j * 16, std::min(4, width - x) * 4);
+                }
+            }
+            break;
+        default:
+            throw std::runtime_error("reference decode failed");
+        }
+
+        // later textures only supply alpha
+        for (size_t p = 0; p < pixels; ++p)
+        {
+            if (i == 0)
+                std::memcpy(&rgba[p * 4], &decoded[p * 4], 4);
+            else
+                rgba[p * 4 + 3] = decoded[p * 4 + 3];
+        }
+    }
+
+    return rgba;
+}
+
+// Decodes each frame of size through HapDecoder, checking it against the reference decoders and
+// measuring its difference from the source, whose channels are in layout and rows bottom up with
+// bottomLeft
+
+class Verifier
+{
+public:
+    Verifier(FrameSize size, const Subtype& subtype, const std::string& layout, bool bottomLeft)
+        : size_(size), subtype_(subtype), layout_(layout), bottomLeft_(bottomLeft),
+          parameters_(std::make_unique<DecoderParametersBase>(size)),
+          decoder_(parameters_), job_(decoder_.create()),
+          decoded_(size_t(size.width) * size.height * 4)
+    {}
+
+    void verify(const uint8_t* frame, size_t frameBytes, const uint8_t* source, unsigned int index)
+    {
+        auto start = std::chrono::steady_clock::now();
+        DecodeInput in;
+        in.buffer.assign(frame, frame + frameBytes);
+        job_->doDecode(in);
+        job_->doCopyLocalToExternal(&decoded_[0], size_t(size_.width) * 4,
+            ChannelFormat_U8 | FrameOrigin_TopLeft | ChannelLayout_RGBA);
+        decoding_ += std::chrono::steady_clock::now() - start;
+        ++frames_;
+
+        if (referenceDecode(in.buffer, size_) != decoded_)
+            throw std::runtime_error(std::string(subtype_.name) + " " + std::to_string(size_.width) + "x"
+                + std::to_string(size_.height) + " frame " + std::to_string(index) + " does not match the reference decoders");
+
+        // source is in the input layout and row order
+        static const int rgba[4] = { 0, 1, 2, 3 }, bgra[4] = { 2, 1, 0, 3 }, argb[4] = { 1, 2, 3, 0 };
+        const int* channels = (layout_ == "bgra") ? bgra : (layout_ == "argb") ? argb : rgba;
+        const size_t rowBytes = size_t(size_.width) * 4;
+        for (int y = 0; y < size_.height; ++y)
+        {
+            const uint8_t* decodedRow = &decoded_[y * rowBytes];
+            const uint8_t* sourceRow = source + (bottomLeft_ ? size_.height - 1 - y : y) * rowBytes;
+            for (size_t p = 0; p < rowBytes; p += 4)
+            {
+                for (int c = 0; c < 4; ++c)
+                {
+                    if ((c < 3) ? subtype_.hasColour : subtype_.hasAlpha)
+                    {
+                        double difference = double(decodedRow[p + c]) - sourceRow[p + channels[c]];
+                        squaredError_ += difference * difference;
+                        ++samples_;
+                    }
+                }
+            }
+        }
+    }
+
+    double framesPerSecond() const { return frames_ / (milliseconds(decoding_) / 1000.0); }
+
+    double psnr() const
+    {
+        return (squaredError_ == 0.0) ? INFINITY : 10.0 * std::log10(255.0 * 255.0 * samples_ / squaredError_);
+    }
+
+private:
+    FrameSize size_;
+    const Subtype& subtype_;
+    std::string layout_;
+    bool bottomLeft_;
+    std::unique_ptr<DecoderParametersBase> parameters_;
+    HapDecoder decoder_;
+    std::unique_ptr<DecoderJob> job_;
+    std::vector<uint8_t> decoded_;
+    std::chrono::steady_clock::duration decoding_{};
+    unsigned int frames_{ 0 };
+    double squaredError_{ 0.0 };
+    double samples_{ 0.0 };
+};
+
+void encode(const Options& options, const Subtype& subtype, const FrameSource& source)
+{
+    std::unique_ptr<EncoderParametersBase> parameters = std::make_unique<EncoderParametersBase>(
+        options.size, subtype.codec4CC, HapChunkCounts{ options.chunks, options.chunks }, options.quality);
+    HapEncoder encoder(parameters);
+    if (options.reuse)
+        encoder.enableBlockReuse();
+    if (options.sampleChunks)
+        encoder.enableChunkSampling();
+    if (!options.trace.empty())
+        encoder.enableTracing(options.trace);
+    encoder.enableProxies(options.proxies);
+    HapFrameSizeEstimate estimateBefore = encoder.frameSizeEstimate();
+
+    std::ofstream output;
+    std::string path = (options.format == "all") ? options.output + "." + subtype.name : options.output;
+    if (!options.output.empty())
+    {
+        output.open(path, std::ios::binary | std::ios::trunc);
+        if (!output)
+            throw std::runtime_error("could not open " + path);
+    }
+
+    FrameFormat format = ChannelFormat_U8
+        | (options.bottomLeft ? FrameOrigin_BottomLeft : FrameOrigin_TopLeft)
+        | ((options.layout == "rgba") ? ChannelLayout_RGBA
+           : (options.layout == "argb") ? ChannelLayout_ARGB : ChannelLayout_BGRA);
+    size_t stride = size_t(options.size.width) * 4;
+
+    std::unique_ptr<Verifier> verifier;
+    if (options.verify)
+        verifier = std::make_unique<Verifier>(options.size, subtype, options.layout, options.bottomLeft);
+
+    // writes and verifies each encoded frame, in order
+    size_t encodedBytes = 0;
+    unsigned int emitted = 0;
+    std::chrono::steady_clock::duration emitting{};
+    auto emit = [&](const uint8_t* frame, size_t frameBytes) {
+        auto emitStart = std::chrono::steady_clock::now();
+        encodedBytes += frameBytes;
+        if (emitted + 1 == options.failOutput)
+            throw std::runtime_error("failing the output of frame " + std::to_string(emitted) + " for --fail-output");
+
+        if (output.is_open() && !output.write((const char*)frame, frameBytes))
+            throw std::runtime_error("could not write " + path);
+        if (verifier)
+            verifier->verify(frame, frameBytes, source.frame(emitted), emitted);
+
+        ++emitted;
+        emitting += std::chrono::steady_clock::now() - emitStart;
+    };
+
+    // and each proxy's frame, after the full-size one
+    std::vector<std::ofstream> proxyOutputs(encoder.proxyCount());
+    std::vector<std::string> proxyPaths(encoder.proxyCount());
+    for (size_t p = 0; p < encoder.proxyCount() && output.is_open(); ++p)
+    {
+        const FrameSize& size = encoder.proxy(p).frameSize();
+        proxyPaths[p] = path + "." + std::to_string(size.width) + "x" + std::to_string(size.height);
+        proxyOutputs[p].open(proxyPaths[p], std::ios::binary | std::ios::trunc);
+        if (!proxyOutputs[p])
+            throw std::runtime_error("could not open " + proxyPaths[p]);
+    }
+    // proxies are verified against the frame reduced as the encoder reduces it: top row first,
+    // each from the one before
+    std::vector<std::unique_ptr<Verifier>> proxyVerifiers;
+    std::vector<std::vector<uint8_t>> proxySources(encoder.proxyCount());
+    for (size_t p = 0; p < encoder.proxyCount() && verifier; ++p)
+        proxyVerifiers.push_back(std::make_unique<Verifier>(encoder.proxy(p).frameSize(), subtype, options.layout, false));
+    auto emitProxy = [&](size_t p, const uint8_t* frame, size_t frameBytes) {
+        auto emitStart = std::chrono::steady_clock::now();
+        if (proxyOutputs[p].is_open() && !proxyOutputs[p].write((const char*)frame, frameBytes))
+            throw std::runtime_error("could not write " + proxyPaths[p]);
+        if (!proxyVerifiers.empty())
+        {
+            // the full-size frame has been emitted
+            unsigned int index = emitted - 1;
+            FrameSize from = (p == 0) ? options.size : encoder.proxy(p - 1).frameSize();
+            const uint8_t* top = (p == 0) ? source.frame(index) : proxySources[p - 1].data();
+            ptrdiff_t rowBytes = ptrdiff_t(from.width) * 4;
+            if (p == 0 && options.bottomLeft)
+            {
+                top += (from.height - 1) * rowBytes;
+                rowBytes = -rowBytes;
+            }
+
+            const FrameSize& size = encoder.proxy(p).frameSize();
+            proxySources[p].resize(size_t(size.width) * size.height * 4);
+            halveFrame(top, rowBytes, from.width, from.height, proxySources[p].data(), size_t(size.width) * 4, nullptr);
+            proxyVerifiers[p]->verify(frame, frameBytes, proxySources[p].data(), index);
+        }
+        emitting += std::chrono::steady_clock::now() - emitStart;
+    };
+
+    HapEncoderTimings timings;
+    std::vector<HapEncoderTimings> proxyTimings;
+    std::unique_ptr<HapEncodePipelineStats> pipelineStats;
+
+    auto start = std::chrono::steady_clock::now();
+    if (options.pipeline)
+    {
+        // emit runs on the packing thread, so its time is part of the total
+        HapEncodePipeline pipeline(encoder, options.pipeline, [&](const EncodeOutput& out) {
+            emit(out.buffer.data(), out.buffer.size());
+        });
+        for (unsigned int i = 0; i < source.frameCount(); ++i)
+            pipeline.push(source.frame(i), stride, format);
+        pipeline.finish();
+
+        timings = pipeline.timings();
+        pipelineStats = std::make_unique<HapEncodePipelineStats>(pipeline.stats());
+    }
+    else
+    {
+        std::unique_ptr<EncoderJob> job = encoder.create();
+        HapEncoderJob& hapJob = static_cast<HapEncoderJob&>(*job);
+
+        // frames are packed straight into a buffer of the tool's, as a writer owning its sample
+        // buffers would have them, and the source's frames outlive their encoding so they are
+        // converted in place; the pipeline shows the host's path, copying and through EncodeOutput
+        std::unique_ptr<uint8_t[]> written(new uint8_t[hapJob.maxEncodedSize()]);
+        std::vector<std::unique_ptr<uint8_t[]>> proxyWritten;
+        for (size_t p = 0; p < hapJob.proxyCount(); ++p)
+            proxyWritten.emplace_back(new uint8_t[hapJob.proxy(p).maxEncodedSize()]);
+        for (unsigned int i = 0; i < source.frameCount(); ++i)
+        {
+            hapJob.doReferenceExternal(source.frame(i), stride, format);
+            hapJob.doConvert();
+            emit(written.get(), hapJob.doPack(written.get(), hapJob.maxEncodedSize()));
+            for (size_t p = 0; p < hapJob.proxyCount(); ++p)
+            {
+                HapEncoderJob& proxy = hapJob.proxy(p);
+                emitProxy(p, proxyWritten[p].get(), proxy.doPack(proxyWritten[p].get(), proxy.maxEncodedSize()));
+            }
+        }
+
+        timings = hapJob.timings();
+        for (size_t p = 0; p < hapJob.proxyCount(); ++p)
+            proxyTimings.push_back(hapJob.proxy(p).timings());
+    }
+    auto total = std::chrono::steady_clock::now() - start;
+    if (!options.pipeline)
+        total -= emitting;
+
+    const double frames = timings.frames;
+    const double seconds = milliseconds(total) / 1000.0;
+    const double inputMB = double(source.frameBytes()) * frames / 1e6;
+
+    std::printf("%-13s %5u frames  %8.1f fps  %8.1f MB/s in  %8.1f MB/s out  ratio %5.2f\n",
+        subtype.name, timings.frames, frames / seconds, inputMB / seconds, encodedBytes / 1e6 / seconds,
+        double(source.frameBytes()) * frames / encodedBytes);
+    std::printf("              ms/frame  copy %7.3f  convert %7.3f  compress %7.3f  pack %7.3f  total %7.3f\n",
+        milliseconds(timings.copy) / frames, milliseconds(timings.convert) / frames,
+        milliseconds(timings.compress) / frames, milliseconds(timings.pack) / frames,
+        milliseconds(total) / frames);
+    BufferPoolStats pool = encoder.bufferPoolStats();
+    std::printf("              buffers  hits %llu  misses %llu  expired %llu  peak resident %.1f MB  chunks %u",
+        (unsigned long long)pool.hits, (unsigned long long)pool.misses, (unsigned long long)pool.expired,
+        pool.peakResidentBytes / 1e6,
+        encoder.chunkCounts()[0]);
+    if (subtype.textures == 2)
+        std::printf(", %u", encoder.chunkCounts()[1]);
+    std::printf("\n");
+    HapDataRateStats dataRate = encoder.dataRateStats();
+    std::printf("              MB/frame  estimated %7.3f, then %7.3f  written %7.3f  peak %7.3f  textures %7.3f  chunk compression %4.2f\n",
+        estimateBefore.predictedFrameBytes / 1e6, encoder.frameSizeEstimate().predictedFrameBytes / 1e6,
+        dataRate.meanFrameBytes() / 1e6, dataRate.peakFrameBytes / 1e6,
+        estimateBefore.textureBytes / 1e6, dataRate.compressionRatio());
+    std::printf("              chunks   compressed %llu  stored after compressing %llu  skipped %llu  MB/frame  sampled %7.3f  skipped %7.3f\n",
+        (unsigned long long)dataRate.compressedChunks, (unsigned long long)dataRate.storedChunks,
+        (unsigned long long)dataRate.skippedChunks, dataRate.sampledBytes / 1e6 / frames, dataRate.skippedBytes / 1e6 / frames);
+    if (options.reuse)
+    {
+        BlockReuseStats reuse = encoder.blockReuseStats();
+        std::printf("              reused %5.1f%% of blocks  frames without cache %u\n",
+            reuse.blocks ? 100.0 * reuse.reusedBlocks / reuse.blocks : 0.0, reuse.busyFrames);
+    }
+    for (size_t p = 0; p < proxyTimings.size(); ++p)
+    {
+        const HapEncoderTextures& proxy = encoder.proxy(p);
+        const FrameSize& size = proxy.frameSize();
+        const HapEncoderTimings& t = proxyTimings[p];
+        std::printf("              proxy %5dx%-5d ms/frame  reduce %7.3f  convert %7.3f  compress %7.3f  pack %7.3f  MB/frame %7.3f\n",
+            size.width, size.height, milliseconds(t.copy) / frames, milliseconds(t.convert) / frames,
+            milliseconds(t.compress) / frames, milliseconds(t.pack) / frames,
+            proxy.dataRateStats().meanFrameBytes() / 1e6);
+        if (!proxyVerifiers.empty())
+            std::printf("                                 decode %8.1f fps  matches reference  psnr %6.2f dB\n",
+                proxyVerifiers[p]->framesPerSecond(), proxyVerifiers[p]->psnr());
+    }
+    if (pipelineStats)
+        std::printf("              stall ms/frame  copy %7.3f  convert %7.3f  pack %7.3f  queued convert %4.2f (max %u)  pack %4.2f (max %u)\n",
+            milliseconds(pipelineStats->copyStall) / frames, milliseconds(pipelineStats->convertStall) / frames,
+            milliseconds(pipelineStats->packStall) / frames,
+            pipelineStats->convertQueueMean, pipelineStats->convertQueueMax,
+            pipelineStats->packQueueMean, pipelineStats->packQueueMax);
+    if (verifier)
+        std::printf("              decode %8.1f fps  matches reference  psnr %6.2f dB\n",
+            verifier->framesPerSecond(), verifier->psnr());
+    if (encoder.traceSession())
+        std::printf("              trace    %s.json, summary %s.txt\n",
+            encoder.traceSession()->path().c_str(), encoder.traceSession()->path().c_str());
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        Options options = parseOptions(argc, argv);
+
+        FrameSource source(options);
+        if (source.frameCount() == 0)
+            throw std::runtime_error("no frames to encode");
+
+        bool found = false;
+        for (const Subtype& subtype : kSubtypes)
+        {
+            if (options.format == "all" || options.format == subtype.name)
+            {
+                encode(options, subtype, source);
+                found = true;
+            }
+        }
+        if (!found)
+            throw std::runtime_error("unknown format: " + options.format);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "hap_encode: " << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}